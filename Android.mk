@@ -21,7 +21,10 @@ LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := libmflinger
-LOCAL_SRC_FILES := lib/mlib.c
+LOCAL_SRC_FILES := \
+    lib/mlib.c \
+    lib/mcodec.c \
+    lib/muring.c
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/include
 include $(BUILD_SHARED_LIBRARY)
 
@@ -31,9 +34,10 @@ include $(BUILD_SHARED_LIBRARY)
 include $(CLEAR_VARS)
 LOCAL_MODULE := mflinger
 LOCAL_SRC_FILES := src/mflinger/mflinger.cpp
-LOCAL_C_INCLUDES := $(LOCAL_PATH)/include
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/include $(LOCAL_PATH)/lib
 LOCAL_CFLAGS := -DLOG_TAG=\"mflinger\"
 LOCAL_SHARED_LIBRARIES := \
+    libcutils \
     liblog \
     libutils \
     libgui \
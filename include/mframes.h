@@ -0,0 +1,106 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_FRAMES_H
+#define M_FRAMES_H
+
+#include <stdint.h>
+
+#include "mlib.h"
+#include "mseqlock.h"
+
+/*
+ * Layout of the frame ring mclient publishes with --fanout.
+ *
+ * Consumers connect to the abstract unix socket M_FRAMES_SOCK_PATH
+ * (SOCK_SEQPACKET) and receive a single MFramesHello carrying the ring's
+ * memfd, which they map read-only with MAP_SHARED. Abstract sockets have
+ * no file permissions, so the ring only goes to processes of the same
+ * user; others are disconnected without it.
+ *
+ * The ring starts with an MFramesHeader, followed by num_slots frame
+ * slots. Every slot holds a complete BGRA8888 frame with a stride of
+ * max_width px. Frame n lives in slot n % num_slots; header.latest is the
+ * newest complete frame. The writer never waits, so a reader copies what
+ * it needs out of a slot under the slot's seqlock and drops the copy if
+ * the slot was rewritten meanwhile:
+ *
+ *     uint64_t n = mframes_latest(hdr);
+ *     const struct MFrameSlot *slot = mframes_slot(hdr, n);
+ *     uint32_t seq = mseqlock_read_begin(&slot->seq);
+ *     ... check slot->frame == n, copy slot->rects and pixels ...
+ *     if (mseqlock_read_retry(&slot->seq, seq)) start over;
+ *
+ * Damage rectangles describe the change since frame n - 1 only, readers
+ * that skipped frames must treat the whole frame as damaged.
+ */
+
+#define M_FRAMES_SOCK_PATH "pionux-frames"
+
+#define MFRAMES_MAGIC (0x3152464d) /* "MFR1" */
+
+#define MFRAMES_MAX_RECTS (32)
+
+struct MFramesHello
+{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t size; /* bytes to map */
+};
+
+struct MFramesHeader
+{
+    uint32_t magic;
+    uint32_t num_slots;
+    uint32_t max_width;     /* px, also the stride of every slot */
+    uint32_t max_height;    /* px */
+    uint64_t slots_offset;  /* byte offset of the first slot */
+    uint64_t slot_size;     /* bytes from one slot to the next */
+    uint64_t pixels_offset; /* byte offset of the pixels within a slot */
+    uint64_t latest;        /* newest complete frame, 0 = none yet */
+};
+
+struct MFrameSlot
+{
+    uint32_t seq;       /* mseqlock, odd while the slot is being written */
+    uint32_t num_rects; /* damage since the previous frame */
+    uint64_t frame;     /* frame number, starting at 1 */
+    uint64_t timestamp; /* CLOCK_MONOTONIC capture time in ns */
+    uint32_t width;     /* px */
+    uint32_t height;    /* px */
+    MRect rects[MFRAMES_MAX_RECTS];
+};
+
+static inline uint64_t mframes_latest(const struct MFramesHeader *hdr)
+{
+    return __atomic_load_n(&hdr->latest, __ATOMIC_ACQUIRE);
+}
+
+static inline struct MFrameSlot *mframes_slot(const struct MFramesHeader *hdr,
+                                              uint64_t frame)
+{
+    return (struct MFrameSlot *)((uint8_t *)hdr + hdr->slots_offset +
+                                 (frame % hdr->num_slots) * hdr->slot_size);
+}
+
+static inline uint8_t *mframes_pixels(const struct MFramesHeader *hdr,
+                                      const struct MFrameSlot *slot)
+{
+    return (uint8_t *)slot + hdr->pixels_offset;
+}
+
+#endif // M_FRAMES_H
@@ -33,6 +33,42 @@
 //
 #define M_SOCK_PATH "pionux-bridge"
 
+/*
+ * Same protocol over SOCK_SEQPACKET: every request and reply is a single
+ * datagram, so the server reads a whole request with one recv().
+ */
+#define M_SEQPACKET_SOCK_PATH "pionux-bridge-seq"
+
+/*
+ * Remote transport for clients on another kernel (VMs, containers).
+ *
+ * Clients connect there instead when this environment variable is set:
+ *     tcp:HOST:PORT   e.g. tcp:10.0.2.2:5900
+ *     vsock:CID:PORT  e.g. vsock:2:5900
+ * with the shared secret in M_TOKEN_ENV.
+ *
+ * Same protocol over a stream, except no fds can be passed: locked
+ * buffers are drawn in a client-side shadow copy and unlocks carry the
+ * damaged pixels (M_UNLOCK_FLAG_DAMAGE). Both ends must agree on the
+ * struct layouts, i.e. share the ABI.
+ */
+#define M_DISPLAY_ENV "MFLINGER_DISPLAY"
+
+/*
+ * Before its first request a remote client sends an MAuthRequest with the
+ * shared secret from this environment variable, which must match the
+ * server's. Nothing else keeps other hosts (or VMs) off the display. The
+ * transport is not encrypted, tunnel it where the network is not trusted.
+ */
+#define M_TOKEN_ENV "MFLINGER_TOKEN"
+#define M_TOKEN_SIZE (64)
+
+struct MAuthRequest
+{
+    char token[M_TOKEN_SIZE]; /* zero padded */
+};
+typedef struct MAuthRequest MAuthRequest;
+
 //
 // Opcodes
 //
@@ -42,6 +78,12 @@
 #define M_LOCK_BUFFER (1 << 7)
 #define M_UNLOCK_AND_POST_BUFFER (1 << 8)
 #define M_RESIZE_BUFFER (1 << 9)
+#define M_SELECT_EVENTS (1 << 10)
+#define M_SET_BUFFER_COUNT (1 << 11)
+#define M_BATCH (1 << 12)
+#define M_TRIM_BUFFER (1 << 13)
+#define M_MAP_POSITION (1 << 14)
+#define M_SET_ROTATION (1 << 15)
 
 struct MRequestHeader
 {
@@ -69,6 +111,7 @@ struct MGetDisplayInfoResponse
 {
     uint32_t width;
     uint32_t height;
+    uint32_t orientation; /* M_ORIENTATION_* */
 };
 typedef struct MGetDisplayInfoResponse MGetDisplayInfoResponse;
 
@@ -76,6 +119,13 @@ struct MCreateBufferRequest
 {
     uint32_t width;
     uint32_t height;
+
+    /*
+     * Allocate for up to this size (0 = width/height), resizes within it
+     * only change the surface crop and never reallocate buffers.
+     */
+    uint32_t max_width;
+    uint32_t max_height;
 };
 typedef struct MCreateBufferRequest MCreateBufferRequest;
 
@@ -114,23 +164,169 @@ struct MResizeBufferResponse
 };
 typedef struct MResizeBufferResponse MResizeBufferResponse;
 
+/*
+ * Explicit sync: instead of waiting for the buffer to be released by its
+ * previous consumer, the server hands out the buffer right away together
+ * with an acquire fence fd (sync_file) to wait on before writing. Without
+ * a fence fd the buffer is ready.
+ */
+#define M_LOCK_FLAG_FENCED (1 << 0)
+
 struct MLockBufferRequest
 {
     int32_t id;
+    MRect dirty;    /* region to redraw, zero width/height = whole buffer */
+    uint32_t flags; /* M_LOCK_FLAG_* */
 };
 typedef struct MLockBufferRequest MLockBufferRequest;
 
 struct MLockBufferResponse
 {
     MBuffer buffer;
-    int32_t result;
+    MRect dirty;      /* region the client must redraw */
+    int32_t num_fds;  /* buffer fd, plus an acquire fence fd if 2 */
+    int32_t result;   /* 0, -1 or M_LOCK_RESULT_WOULD_BLOCK */
 };
 typedef struct MLockBufferResponse MLockBufferResponse;
 
+/*
+ * A fenced lock never waits for a free buffer: when all of them are
+ * queued or held by the compositor, the response carries no fds and this
+ * result, and the client tries again on its next frame.
+ */
+#define M_LOCK_RESULT_WOULD_BLOCK 1
+
+/*
+ * A release fence fd accompanies the request, the compositor waits on it
+ * before reading the buffer.
+ */
+#define M_UNLOCK_FLAG_FENCED (1 << 0)
+
+/*
+ * The request is followed by an MDamageHeader and num_rects times an
+ * MDamageRect plus size bytes of the rectangle's pixels encoded with
+ * mcodec. Only used on remote connections, where the server locks the
+ * buffer itself and draws the pixels into it.
+ */
+#define M_UNLOCK_FLAG_DAMAGE (1 << 1)
+
 struct MUnlockBufferRequest
 {
     int32_t id;
+    uint32_t flags; /* M_UNLOCK_FLAG_* */
 };
 typedef struct MUnlockBufferRequest MUnlockBufferRequest;
 
+#define M_MAX_DAMAGE_RECTS (64)
+
+struct MDamageHeader
+{
+    uint32_t num_rects; /* up to M_MAX_DAMAGE_RECTS */
+};
+typedef struct MDamageHeader MDamageHeader;
+
+struct MDamageRect
+{
+    MRect rect;    /* within the buffer's visible size */
+    uint32_t size; /* bytes of encoded pixels that follow */
+};
+typedef struct MDamageRect MDamageRect;
+
+/*
+ * Buffers in the queue between client and compositor. Fewer buffers
+ * get a post on screen sooner, more let the client run ahead of the
+ * display. Only while no buffer is locked.
+ */
+struct MSetBufferCountRequest
+{
+    int32_t id;
+    uint32_t count; /* 0 = compositor default */
+};
+typedef struct MSetBufferCountRequest MSetBufferCountRequest;
+
+struct MSetBufferCountResponse
+{
+    int32_t result;
+    uint32_t count; /* in effect, raised to what the compositor needs */
+};
+typedef struct MSetBufferCountResponse MSetBufferCountResponse;
+
+/*
+ * The reply passes the client end of a SOCK_SEQPACKET socket pair, the
+ * server sends one MEvent per packet through it. Replies on the main
+ * socket would get mixed up with unsolicited events, hence the second
+ * channel.
+ */
+struct MSelectEventsRequest
+{
+    uint32_t mask; /* M_EVENT_* types to receive */
+};
+typedef struct MSelectEventsRequest MSelectEventsRequest;
+
+struct MSelectEventsResponse
+{
+    int32_t result;
+};
+typedef struct MSelectEventsResponse MSelectEventsResponse;
+
+/*
+ * Free the buffers the compositor is not showing, they are allocated
+ * again by the next lock. Gets no reply.
+ */
+struct MTrimBufferRequest
+{
+    int32_t id;
+};
+typedef struct MTrimBufferRequest MTrimBufferRequest;
+
+/*
+ * The response comes with the fd of a shared MPositionPage. The client
+ * publishes the surface's position there instead of sending
+ * M_UPDATE_BUFFER requests, and the server applies the latest one once
+ * per refresh. Unavailable on remote connections.
+ */
+struct MMapPositionRequest
+{
+    int32_t id;
+};
+typedef struct MMapPositionRequest MMapPositionRequest;
+
+struct MMapPositionResponse
+{
+    int32_t result;
+};
+typedef struct MMapPositionResponse MMapPositionResponse;
+
+struct MPositionPage
+{
+    uint32_t seq; /* mseqlock.h, bumped by the client's updates */
+    uint32_t xpos;
+    uint32_t ypos;
+};
+typedef struct MPositionPage MPositionPage;
+
+/*
+ * Turn all of the session's surfaces on the display, positions are
+ * still given unrotated. Gets no reply.
+ */
+struct MSetRotationRequest
+{
+    uint32_t orientation; /* M_ORIENTATION_* */
+};
+typedef struct MSetRotationRequest MSetRotationRequest;
+
+/*
+ * The request is followed by size bytes of requests that get no reply,
+ * each with its own MRequestHeader: M_UPDATE_BUFFER and unfenced
+ * M_UNLOCK_AND_POST_BUFFER without M_UNLOCK_FLAG_DAMAGE. The server
+ * applies them in order, in a single compositor transaction.
+ */
+#define M_MAX_BATCH_SIZE (512)
+
+struct MBatchRequest
+{
+    uint32_t size; /* up to M_MAX_BATCH_SIZE */
+};
+typedef struct MBatchRequest MBatchRequest;
+
 #endif // MLIB_PROTOCOL_H
@@ -18,18 +18,86 @@
 #ifndef MLIB_H
 #define MLIB_H
 
+struct MUring;
+
 struct MDisplay
 {
-    int sock_fd; /* server socket */
+    int sock_fd;    /* server socket */
+    uint32_t flags; /* M_DISPLAY_* flags in effect */
+
+    struct MUring *__uring;
+    int __event_fd;
+    void *__scratch; /* encoded damage on remote displays */
+    uint32_t __scratch_size;
+    void *__batch; /* requests queued since MBeginBatch() */
+    uint32_t __batch_size;
+    int __batching;
 };
 typedef struct MDisplay MDisplay;
 
+/*
+ * Display rotation from its natural orientation, as the compositor
+ * reports it. The reported size is already rotated.
+ */
+#define M_ORIENTATION_0 (0)
+#define M_ORIENTATION_90 (1)
+#define M_ORIENTATION_180 (2)
+#define M_ORIENTATION_270 (3)
+
 struct MDisplayInfo
 {
+    uint32_t width;       /* width in px */
+    uint32_t height;      /* height in px */
+    uint32_t orientation; /* M_ORIENTATION_* */
+};
+typedef struct MDisplayInfo MDisplayInfo;
+
+struct MRect
+{
+    int32_t x;       /* left in px */
+    int32_t y;       /* top in px */
     uint32_t width;  /* width in px */
     uint32_t height; /* height in px */
 };
-typedef struct MDisplayInfo MDisplayInfo;
+typedef struct MRect MRect;
+
+/*
+ * Event types, also used as the mask for MSelectEvents().
+ */
+#define M_EVENT_DISPLAY_STATE (1 << 0)
+#define M_EVENT_FRAME_TIMESTAMPS (1 << 1)
+
+struct MDisplayStateEvent
+{
+    uint32_t visible; /* non-zero while the display shows our surfaces */
+};
+typedef struct MDisplayStateEvent MDisplayStateEvent;
+
+/*
+ * Sent once the compositor is done with a posted frame. Times are
+ * CLOCK_MONOTONIC ns, 0 if unknown, e.g. a frame that was replaced
+ * before it reached the screen has neither latched nor presented.
+ */
+struct MFrameTimestampsEvent
+{
+    int32_t id;         /* buffer, see MBufferId() */
+    uint32_t frame;     /* posts of the buffer up to this one, from 1 */
+    uint64_t posted;    /* queued to the compositor */
+    uint64_t latched;   /* picked up for composition */
+    uint64_t presented; /* shown on the display */
+};
+typedef struct MFrameTimestampsEvent MFrameTimestampsEvent;
+
+struct MEvent
+{
+    uint32_t type; /* M_EVENT_* */
+    union
+    {
+        MDisplayStateEvent display_state;
+        MFrameTimestampsEvent frame_timestamps;
+    };
+};
+typedef struct MEvent MEvent;
 
 struct MBuffer
 {
@@ -39,28 +107,189 @@ struct MBuffer
     void *bits;      /* raw buffer bytes in BGRA8888 format */
 
     int __fd;
+    int __fence_fd;
     int32_t __id;
+    uint32_t __shadow_size; /* bytes at bits owned by a remote display */
+    MRect __dirty;        /* region to send on remote unlocks */
+    void *__position;     /* shared position page, NULL = send updates */
 };
 typedef struct MBuffer MBuffer;
 
+/*
+ * Connect over SOCK_SEQPACKET instead of SOCK_STREAM. Every request and
+ * reply is then a single datagram, so the server never has to piece a
+ * request together from partial reads.
+ */
+#define M_DISPLAY_SEQPACKET (1 << 0)
+
+/*
+ * Push the per-frame lock/unlock traffic through io_uring, so each is a
+ * single submission. Dropped from the display's flags (with a warning)
+ * where the kernel does not support it.
+ */
+#define M_DISPLAY_URING (1 << 1)
+
+/*
+ * Set by MOpenDisplayWithFlags() when M_DISPLAY_ENV points it to a
+ * remote server. Buffers are then drawn into a local shadow copy and
+ * every unlock transfers the damaged pixels, see MUnlockBufferDamage().
+ * Fences and events are unavailable.
+ */
+#define M_DISPLAY_REMOTE (1 << 2)
+
 int MOpenDisplay(MDisplay *dpy);
+int MOpenDisplayWithFlags(MDisplay *dpy, uint32_t flags);
 int MCloseDisplay(MDisplay *dpy);
 
+/**
+ * @return the fd to poll for server activity (e.g. hangups)
+ */
+int MConnectionNumber(MDisplay *dpy);
+
 int MGetDisplayInfo(MDisplay *dpy, MDisplayInfo *dpy_info);
 
+/**
+ * Have the server turn every surface of this client by @param
+ * orientation (M_ORIENTATION_*), so a client can keep drawing in the
+ * display's natural orientation, at its natural size, without rotating
+ * pixels itself. Positions stay in the client's unrotated coordinates.
+ */
+int MSetRotation(MDisplay *dpy, uint32_t orientation);
+
+/**
+ * Hold back the requests that get no reply, MUpdateBuffer() and, on
+ * local displays, MUnlockBuffer(), until MFlushBatch() sends them all
+ * in one write and the server applies them in one transaction. Any
+ * other call flushes what was queued first, so requests never change
+ * order.
+ */
+int MBeginBatch(MDisplay *dpy);
+int MFlushBatch(MDisplay *dpy);
+
+//
+// Events
+//
+/**
+ * Start receiving the events in @param mask. The current state is sent
+ * right away, e.g. an M_EVENT_DISPLAY_STATE event.
+ */
+int MSelectEvents(MDisplay *dpy, uint32_t mask);
+
+/**
+ * @return the fd to poll for events, -1 before MSelectEvents()
+ */
+int MEventConnectionNumber(MDisplay *dpy);
+
+/**
+ * Read the next event without blocking.
+ * @return 1 if @param ev was filled, 0 if none is pending, -1 on error
+ * (including the server going away)
+ */
+int MNextEvent(MDisplay *dpy, MEvent *ev);
+
 //
 // Buffer management
 //
 int MCreateBuffer(MDisplay *dpy, MBuffer *buf);
+/**
+ * Allocate the buffer for up to @param max_width x @param max_height
+ * right away, so MResizeBuffer() within that size never reallocates.
+ */
+int MCreateBufferWithMaxSize(MDisplay *dpy, MBuffer *buf,
+                             uint32_t max_width, uint32_t max_height);
+/**
+ * @return the id events refer to @param buf by
+ */
+int32_t MBufferId(MBuffer *buf);
+/**
+ * Move @param buf, a store into its position page once mapped.
+ */
 int MUpdateBuffer(MDisplay *dpy, MBuffer *buf,
                   uint32_t xpos, uint32_t ypos);
+/**
+ * Share a page with the server that MUpdateBuffer() publishes @param buf's
+ * position through, rather than queueing a request per move. The server
+ * applies the newest position once per refresh, so this suits positions
+ * that change often (e.g. a cursor). The page stays mapped for the life
+ * of the process.
+ */
+int MMapBufferPosition(MDisplay *dpy, MBuffer *buf);
 int MResizeBuffer(MDisplay *dpy, MBuffer *buf,
                   uint32_t width, uint32_t height);
 
+/*
+ * Buffer queue depths for MSetBufferCount(): double buffering puts a
+ * post on screen sooner, triple buffering keeps the client from waiting
+ * on the display.
+ */
+#define M_BUFFER_COUNT_DEFAULT (0)
+#define M_BUFFER_COUNT_LOW_LATENCY (2)
+#define M_BUFFER_COUNT_THROUGHPUT (3)
+
+/**
+ * Set the number of buffers queued between @param buf and the
+ * compositor, while it is not locked.
+ * @param actual if not NULL, set to the count in effect, which can be
+ * higher than asked for
+ */
+int MSetBufferCount(MDisplay *dpy, MBuffer *buf, uint32_t count,
+                    uint32_t *actual);
+
+/**
+ * Release the memory behind @param buf, other than what is on screen,
+ * while it sits idle. The next lock reallocates and reports the whole
+ * buffer dirty. @param buf must not be locked.
+ */
+int MTrimBuffer(MDisplay *dpy, MBuffer *buf);
+
 //
 // Buffer rendering
 //
 int MLockBuffer(MDisplay *dpy, MBuffer *buf);
+/**
+ * Lock a buffer for a partial update of @param dirty.
+ *
+ * Pixels outside of @param dirty keep the content of the last posted
+ * buffer. On return @param dirty holds the region that must actually be
+ * redrawn, which can grow (up to the whole buffer) when the previous
+ * content cannot be preserved, e.g. for the very first frame.
+ */
+int MLockBufferRect(MDisplay *dpy, MBuffer *buf, MRect *dirty);
 int MUnlockBuffer(MDisplay *dpy, MBuffer *buf);
 
+/*
+ * Explicit sync. MLockBufferFenced() returns as soon as the server has a
+ * buffer, which may still be read by its previous consumer. Do any other
+ * work first and call MWaitBuffer() right before writing to it.
+ *
+ * Since the server cannot copy the old content into a busy buffer, the
+ * returned dirty region may be larger than with MLockBufferRect().
+ *
+ * Returns 1 without a buffer when none is free right now; keep the damage
+ * and try again on the next frame.
+ */
+int MLockBufferFenced(MDisplay *dpy, MBuffer *buf, MRect *dirty);
+
+/**
+ * Wait until a buffer from MLockBufferFenced() is writable.
+ * @param timeout_ms as for poll(), -1 waits forever
+ * @return 0 when writable, 1 on timeout, -1 on error
+ */
+int MWaitBuffer(MBuffer *buf, int timeout_ms);
+
+/**
+ * Post a buffer once @param release_fence signals, e.g. when writes
+ * queued on another engine are done. Takes ownership of the fence,
+ * -1 posts right away like MUnlockBuffer().
+ */
+int MUnlockBufferFenced(MDisplay *dpy, MBuffer *buf, int release_fence);
+
+/**
+ * Post a buffer of which only @param rects changed since the last post.
+ * Remote displays only transfer these rectangles (MUnlockBuffer() sends
+ * the whole dirty region of the lock), local ones ignore them.
+ */
+int MUnlockBufferDamage(MDisplay *dpy, MBuffer *buf,
+                        const MRect *rects, int nrects);
+
 #endif // MLIB_H
@@ -0,0 +1,63 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_SEQLOCK_H
+#define M_SEQLOCK_H
+
+#include <stdint.h>
+
+/*
+ * Single-writer sequence lock for data shared with other processes.
+ *
+ * The sequence is odd while the writer is updating the protected data.
+ * The writer never waits on readers: readers copy what they need and
+ * start over if the sequence was odd or changed in the meantime.
+ *
+ *     do {
+ *         seq = mseqlock_read_begin(&lock);
+ *         ... copy the data ...
+ *     } while (mseqlock_read_retry(&lock, seq));
+ */
+
+static inline void mseqlock_write_begin(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    /* the odd sequence must be visible before any data changes */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void mseqlock_write_end(uint32_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t mseqlock_read_begin(const uint32_t *seq)
+{
+    return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @param start the value returned by mseqlock_read_begin()
+ * @return non-zero if the data read since may be torn
+ */
+static inline int mseqlock_read_retry(const uint32_t *seq, uint32_t start)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (start & 1) || __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+#endif // M_SEQLOCK_H
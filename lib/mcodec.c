@@ -0,0 +1,199 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mcodec.h"
+
+/*
+ * Shorter matches cost as much as the raw pixels, keep them in literals.
+ */
+#define MIN_MATCH (3)
+
+#define TOKEN(op, count) (((uint32_t)(count) << 2) | (op))
+#define TOKEN_OP(token) ((token) & 3)
+#define TOKEN_COUNT(token) ((token) >> 2)
+
+size_t mcodec_bound(uint32_t width, uint32_t height)
+{
+    /*
+     * A match of n >= MIN_MATCH pixels takes at most 8 bytes, i.e. it
+     * saves the token of the literal that follows it, leaving one token
+     * of overhead per row.
+     */
+    return (size_t)height * (width + 1) * sizeof(uint32_t);
+}
+
+static uint32_t run_length(const uint32_t *row, uint32_t x, uint32_t width)
+{
+    uint32_t n = 1;
+    while (x + n < width && row[x + n] == row[x])
+    {
+        ++n;
+    }
+    return n;
+}
+
+static uint32_t above_length(const uint32_t *row, const uint32_t *above,
+                             uint32_t x, uint32_t width)
+{
+    uint32_t n = 0;
+    while (x + n < width && row[x + n] == above[x + n])
+    {
+        ++n;
+    }
+    return n;
+}
+
+/**
+ * @return non-zero if a match worth a token starts at @param x
+ */
+static int match_starts(const uint32_t *row, const uint32_t *above,
+                        uint32_t x, uint32_t width)
+{
+    if (x + MIN_MATCH > width)
+    {
+        return 0;
+    }
+
+    if (row[x] == row[x + 1] && row[x] == row[x + 2])
+    {
+        return 1;
+    }
+
+    return above != NULL && row[x] == above[x] &&
+           row[x + 1] == above[x + 1] && row[x + 2] == above[x + 2];
+}
+
+static uint8_t *put_u32(uint8_t *dst, uint32_t v)
+{
+    memcpy(dst, &v, sizeof(v));
+    return dst + sizeof(v);
+}
+
+size_t mcodec_encode(const uint32_t *src, uint32_t stride,
+                     uint32_t width, uint32_t height, uint8_t *dst)
+{
+    uint8_t *out = dst;
+    uint32_t x, y;
+
+    for (y = 0; y < height; ++y)
+    {
+        const uint32_t *row = src + (size_t)y * stride;
+        const uint32_t *above = y > 0 ? row - stride : NULL;
+
+        x = 0;
+        while (x < width)
+        {
+            uint32_t run = run_length(row, x, width);
+            uint32_t copy = above != NULL ? above_length(row, above, x, width)
+                                          : 0;
+
+            if (copy >= MIN_MATCH && copy >= run)
+            {
+                out = put_u32(out, TOKEN(MCODEC_ABOVE, copy));
+                x += copy;
+            }
+            else if (run >= MIN_MATCH)
+            {
+                out = put_u32(out, TOKEN(MCODEC_RUN, run));
+                out = put_u32(out, row[x]);
+                x += run;
+            }
+            else
+            {
+                uint32_t start = x++;
+                while (x < width && !match_starts(row, above, x, width))
+                {
+                    ++x;
+                }
+                out = put_u32(out, TOKEN(MCODEC_LITERAL, x - start));
+                memcpy(out, row + start, (x - start) * sizeof(uint32_t));
+                out += (x - start) * sizeof(uint32_t);
+            }
+        }
+    }
+
+    return out - dst;
+}
+
+int mcodec_decode(const uint8_t *src, size_t len, uint32_t *dst,
+                  uint32_t stride, uint32_t width, uint32_t height)
+{
+    const uint8_t *end = src + len;
+    uint32_t x, y, i, token, count, px;
+
+    for (y = 0; y < height; ++y)
+    {
+        uint32_t *row = dst + (size_t)y * stride;
+
+        for (x = 0; x < width; x += count)
+        {
+            if (end - src < (ptrdiff_t)sizeof(token))
+            {
+                return -1;
+            }
+            memcpy(&token, src, sizeof(token));
+            src += sizeof(token);
+
+            count = TOKEN_COUNT(token);
+            if (count == 0 || count > width - x)
+            {
+                return -1;
+            }
+
+            switch (TOKEN_OP(token))
+            {
+            case MCODEC_LITERAL:
+                if ((size_t)(end - src) < count * sizeof(uint32_t))
+                {
+                    return -1;
+                }
+                memcpy(row + x, src, count * sizeof(uint32_t));
+                src += count * sizeof(uint32_t);
+                break;
+
+            case MCODEC_RUN:
+                if (end - src < (ptrdiff_t)sizeof(px))
+                {
+                    return -1;
+                }
+                memcpy(&px, src, sizeof(px));
+                src += sizeof(px);
+                for (i = 0; i < count; ++i)
+                {
+                    row[x + i] = px;
+                }
+                break;
+
+            case MCODEC_ABOVE:
+                if (y == 0)
+                {
+                    return -1;
+                }
+                memcpy(row + x, row + x - stride, count * sizeof(uint32_t));
+                break;
+
+            default:
+                return -1;
+            }
+        }
+    }
+
+    return src == end ? 0 : -1;
+}
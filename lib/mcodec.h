@@ -0,0 +1,71 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_CODEC_H
+#define M_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Lossless codec for BGRA8888 rectangles sent over remote transports.
+ *
+ * Desktop content is mostly flat fills and repeated rows, so each row is
+ * coded as a sequence of tokens: a run of one pixel, a copy of the pixels
+ * straight above or a literal stretch of raw pixels. A token is a 32-bit
+ * word, (count << 2) | op, followed by one pixel for runs and count
+ * pixels for literals. Tokens never span rows.
+ *
+ * Shared by libmflinger and mflinger, hence the C linkage.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MCODEC_LITERAL (0)
+#define MCODEC_RUN (1)
+#define MCODEC_ABOVE (2)
+
+/**
+ * @return the largest possible encoding of a @param width x @param height
+ * rectangle in bytes
+ */
+size_t mcodec_bound(uint32_t width, uint32_t height);
+
+/**
+ * @param stride of @param src in px
+ * @param dst at least mcodec_bound() bytes
+ * @return bytes written to @param dst
+ */
+size_t mcodec_encode(const uint32_t *src, uint32_t stride,
+                     uint32_t width, uint32_t height, uint8_t *dst);
+
+/**
+ * Decode exactly @param len bytes into a rectangle of @param dst.
+ * @param stride of @param dst in px
+ * @return 0 on success, -1 if the data is malformed (@param dst may be
+ * partially written)
+ */
+int mcodec_decode(const uint8_t *src, size_t len, uint32_t *dst,
+                  uint32_t stride, uint32_t width, uint32_t height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // M_CODEC_H
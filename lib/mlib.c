@@ -16,20 +16,42 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 
+#include <poll.h>
+#include <fcntl.h>
+
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/uio.h>
 
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/vm_sockets.h>
+
 #include "mlib.h"
 #include "mlib-protocol.h"
 #include "mlog.h"
+#include "mseqlock.h"
+#include "mcodec.h"
+#include "muring.h"
+
+/* a frame never has more than a few operations in flight */
+#define URING_ENTRIES (8)
+
+enum
+{
+    URING_REQUEST = 1,
+    URING_REPLY,
+    URING_CLOSE,
+};
 
 //
 // Private
@@ -39,13 +61,57 @@ static int buffer_size(MBuffer *buf)
     return buf->stride * buf->height * 4;
 }
 
-static int recvfd(const int sock_fd, void *data, const int data_len)
+/* a buffer fd and its acquire fence */
+#define MAX_REPLY_FDS (2)
+
+/**
+ * Pull the fds passed in the control data of @param msgh.
+ * @return number of fds stored in @param fds, -1 on error
+ */
+static int cmsg_fds(struct msghdr *msgh, int *fds, const int max_fds)
 {
-    struct msghdr msgh = {0};
     struct cmsghdr *cmsg;
+    int i, n = 0;
+
+    /* 
+     * loop through the control data to pull the fds
+     * (there should only be one control message)
+     */
+    for (cmsg = CMSG_FIRSTHDR(msgh); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msgh, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (i = 0; i < count && n < max_fds; ++i)
+            {
+                memcpy(&fds[n++], CMSG_DATA(cmsg) + i * sizeof(int),
+                       sizeof(int));
+            }
+        }
+    }
+
+    if (msgh->msg_flags & MSG_CTRUNC)
+    {
+        MLOGE("insufficient buffer space for ancillary data\n");
+        for (i = 0; i < n; ++i)
+        {
+            close(fds[i]);
+        }
+        return -1;
+    }
+
+    return n;
+}
+
+static int recvfds(const int sock_fd, void *data, const int data_len,
+                   int *fds, const int max_fds)
+{
+    struct msghdr msgh = {0};
     struct iovec iov;
-    char control[CMSG_SPACE(sizeof(int))]; /* single int fd */
-    int n, buf_fd;
+    char control[CMSG_SPACE(MAX_REPLY_FDS * sizeof(int))];
+    int n;
 
     /* we read data_len bytes from the socket into data */
     iov.iov_base = data;
@@ -57,7 +123,7 @@ static int recvfd(const int sock_fd, void *data, const int data_len)
     msgh.msg_control = control;
     msgh.msg_controllen = sizeof(control);
 
-    n = recvmsg(sock_fd, &msgh, MSG_WAITALL);
+    n = recvmsg(sock_fd, &msgh, MSG_WAITALL | MSG_CMSG_CLOEXEC);
     if (n < 0)
     {
         MLOGE("recvmsg error: %s\n", strerror(errno));
@@ -66,31 +132,615 @@ static int recvfd(const int sock_fd, void *data, const int data_len)
 
     /* TODO check n to ensure proper response!!! */
 
-    if (msgh.msg_flags)
+    return cmsg_fds(&msgh, fds, max_fds);
+}
+
+/**
+ * Send a request and receive a reply carrying fds as one linked
+ * write + recvmsg submission.
+ */
+static int uring_transact_fds(MDisplay *dpy, const void *request,
+                              const int request_len,
+                              void *response, const int response_len,
+                              int *fds, const int max_fds)
+{
+    struct msghdr msgh = {0};
+    struct iovec iov;
+    char control[CMSG_SPACE(MAX_REPLY_FDS * sizeof(int))];
+    uint64_t user_data[2];
+    int32_t res[2];
+    int i, num_fds, n = -1;
+
+    iov.iov_base = response;
+    iov.iov_len = response_len;
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+    msgh.msg_control = control;
+    msgh.msg_controllen = sizeof(control);
+
+    /* the link keeps the recvmsg from racing ahead of the request */
+    if (muring_queue_write(dpy->__uring, dpy->sock_fd, request, request_len,
+                           URING_REQUEST, 1) < 0 ||
+        muring_queue_recvmsg(dpy->__uring, dpy->sock_fd, &msgh,
+                             MSG_WAITALL | MSG_CMSG_CLOEXEC,
+                             URING_REPLY, 0) < 0)
+    {
+        /* a lone linked write would pull in whatever is queued next */
+        muring_discard(dpy->__uring);
+        return -1;
+    }
+    if (muring_submit(dpy->__uring, 2, user_data, res) < 0)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < 2; ++i)
     {
-        if (msgh.msg_flags & MSG_CTRUNC)
+        if (user_data[i] == URING_REQUEST && res[i] < 0)
         {
-            MLOGE("insufficient buffer space for ancillary data\n");
+            /* the linked reply was cancelled */
+            MLOGE("error sending request: %s\n", strerror(-res[i]));
             return -1;
         }
+        else if (user_data[i] == URING_REPLY)
+        {
+            n = res[i];
+        }
+    }
+    if (n < 0)
+    {
+        MLOGE("recvmsg error: %s\n", strerror(-n));
+        return -1;
     }
 
-    /* 
-     * loop through the control data to pull the fd
-     * (there should only be one control message)
+    num_fds = cmsg_fds(&msgh, fds, max_fds);
+
+    /* older kernels may complete MSG_WAITALL early on stream sockets */
+    if (num_fds > 0 && n < response_len &&
+        recv(dpy->sock_fd, (char *)response + n, response_len - n,
+             MSG_WAITALL) != response_len - n)
+    {
+        MLOGE("error receiving rest of reply: %s\n", strerror(errno));
+        for (i = 0; i < num_fds; ++i)
+        {
+            close(fds[i]);
+        }
+        return -1;
+    }
+
+    return num_fds;
+}
+
+/**
+ * Send the requests queued since MBeginBatch() behind an M_BATCH header.
+ */
+static int flush_batch(MDisplay *dpy)
+{
+    struct
+    {
+        MRequestHeader header;
+        MBatchRequest request;
+    } packet;
+    struct iovec iov[2];
+    size_t left;
+    ssize_t n;
+    int i = 0;
+
+    if (dpy->__batch_size == 0)
+    {
+        return 0;
+    }
+    packet.header.op = M_BATCH;
+    packet.request.size = dpy->__batch_size;
+    dpy->__batch_size = 0;
+
+    iov[0].iov_base = &packet;
+    iov[0].iov_len = sizeof(packet);
+    iov[1].iov_base = dpy->__batch;
+    iov[1].iov_len = packet.request.size;
+    left = sizeof(packet) + packet.request.size;
+    for (;;)
+    {
+        n = writev(dpy->sock_fd, &iov[i], 2 - i);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (n < 0)
+        {
+            MLOGE("error sending request batch: %s\n", strerror(errno));
+            return -1;
+        }
+
+        left -= n;
+        if (left == 0)
+        {
+            return 0;
+        }
+
+        /* a stream socket under pressure may take only part of it */
+        while ((size_t)n >= iov[i].iov_len)
+        {
+            n -= iov[i].iov_len;
+            ++i;
+        }
+        iov[i].iov_base = (uint8_t *)iov[i].iov_base + n;
+        iov[i].iov_len -= n;
+    }
+}
+
+/**
+ * Queue a request that gets no reply if a batch is open.
+ * @return 1 if queued, 0 if the caller has to send it, -1 on error
+ */
+static int batch_request(MDisplay *dpy, const void *request,
+                         const uint32_t request_len)
+{
+    if (!dpy->__batching)
+    {
+        return 0;
+    }
+
+    if (dpy->__batch_size + request_len > M_MAX_BATCH_SIZE &&
+        flush_batch(dpy) < 0)
+    {
+        return -1;
+    }
+
+    memcpy((uint8_t *)dpy->__batch + dpy->__batch_size, request,
+           request_len);
+    dpy->__batch_size += request_len;
+    return 1;
+}
+
+/**
+ * @return number of fds received into @param fds, -1 on error
+ */
+static int transact_fds(MDisplay *dpy, const void *request,
+                        const int request_len,
+                        void *response, const int response_len,
+                        int *fds, const int max_fds)
+{
+    if (flush_batch(dpy) < 0)
+    {
+        return -1;
+    }
+
+    if (dpy->__uring != NULL)
+    {
+        return uring_transact_fds(dpy, request, request_len,
+                                  response, response_len, fds, max_fds);
+    }
+
+    if (write(dpy->sock_fd, request, request_len) < 0)
+    {
+        MLOGE("error sending request: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return recvfds(dpy->sock_fd, response, response_len, fds, max_fds);
+}
+
+static int sendfd(const int sock_fd, const void *data, const int data_len,
+                  const int fd)
+{
+    struct msghdr msgh = {0};
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = data_len;
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+
+    msgh.msg_control = control.buf;
+    msgh.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msgh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock_fd, &msgh, 0);
+}
+
+static int write_all(const int sock_fd, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (len > 0)
+    {
+        ssize_t n = write(sock_fd, p, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (n < 0)
+        {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @return 1 if anything of @param r is left inside @param buf
+ */
+static int clip_to_buffer(MRect *r, const MBuffer *buf)
+{
+    int32_t right = r->x + (int32_t)r->width;
+    int32_t bottom = r->y + (int32_t)r->height;
+    int32_t left = r->x > 0 ? r->x : 0;
+    int32_t top = r->y > 0 ? r->y : 0;
+    if (right > (int32_t)buf->width)
+    {
+        right = buf->width;
+    }
+    if (bottom > (int32_t)buf->height)
+    {
+        bottom = buf->height;
+    }
+
+    if (right <= left || bottom <= top)
+    {
+        return 0;
+    }
+
+    r->x = left;
+    r->y = top;
+    r->width = right - left;
+    r->height = bottom - top;
+    return 1;
+}
+
+static void union_rect(MRect *dst, const MRect *src)
+{
+    if (src->width == 0 || src->height == 0)
+    {
+        return;
+    }
+    if (dst->width == 0 || dst->height == 0)
+    {
+        *dst = *src;
+        return;
+    }
+
+    int32_t left = dst->x < src->x ? dst->x : src->x;
+    int32_t top = dst->y < src->y ? dst->y : src->y;
+    int32_t right = dst->x + (int32_t)dst->width;
+    int32_t bottom = dst->y + (int32_t)dst->height;
+    if (src->x + (int32_t)src->width > right)
+    {
+        right = src->x + src->width;
+    }
+    if (src->y + (int32_t)src->height > bottom)
+    {
+        bottom = src->y + src->height;
+    }
+
+    dst->x = left;
+    dst->y = top;
+    dst->width = right - left;
+    dst->height = bottom - top;
+}
+
+/**
+ * Connect to the address in M_DISPLAY_ENV.
+ * @return the socket, -1 on error
+ */
+static int connect_remote(const char *address)
+{
+    int sock_fd = -1;
+
+    if (strncmp(address, "vsock:", 6) == 0)
+    {
+        struct sockaddr_vm remote;
+        const char *cid = address + 6;
+        const char *port = strchr(cid, ':');
+        char *cid_end = NULL, *port_end = NULL;
+
+        memset(&remote, 0, sizeof(remote));
+        remote.svm_family = AF_VSOCK;
+        if (port != NULL)
+        {
+            remote.svm_cid = strtoul(cid, &cid_end, 10);
+            remote.svm_port = strtoul(port + 1, &port_end, 10);
+        }
+        if (port == NULL || port == cid || cid_end != port ||
+            port[1] == '\0' || *port_end != '\0')
+        {
+            MLOGE("invalid vsock address: %s\n", address);
+            return -1;
+        }
+
+        sock_fd = socket(AF_VSOCK, SOCK_STREAM, 0);
+        if (sock_fd < 0 ||
+            connect(sock_fd, (struct sockaddr *)&remote, sizeof(remote)) < 0)
+        {
+            MLOGE("error connecting to %s: %s\n", address, strerror(errno));
+            if (sock_fd >= 0)
+            {
+                close(sock_fd);
+            }
+            return -1;
+        }
+        return sock_fd;
+    }
+
+    const char *port = strrchr(address, ':');
+    if (strncmp(address, "tcp:", 4) != 0 || port == address + 3)
+    {
+        MLOGE("unsupported %s address: %s\n", M_DISPLAY_ENV, address);
+        return -1;
+    }
+
+    char host[256];
+    size_t host_len = port - (address + 4);
+    if (host_len >= sizeof(host))
+    {
+        MLOGE("invalid tcp address: %s\n", address);
+        return -1;
+    }
+    memcpy(host, address + 4, host_len);
+    host[host_len] = '\0';
+
+    struct addrinfo hints, *res, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port + 1, &hints, &res);
+    if (err != 0)
+    {
+        MLOGE("error resolving %s: %s\n", address, gai_strerror(err));
+        return -1;
+    }
+
+    for (ai = res; ai != NULL && sock_fd < 0; ai = ai->ai_next)
+    {
+        sock_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock_fd >= 0 && connect(sock_fd, ai->ai_addr, ai->ai_addrlen) < 0)
+        {
+            close(sock_fd);
+            sock_fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+
+    if (sock_fd < 0)
+    {
+        MLOGE("error connecting to %s: %s\n", address, strerror(errno));
+        return -1;
+    }
+
+    /* requests are small and latency bound, never hold them back */
+    int one = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock_fd;
+}
+
+/**
+ * Remote lock: the server locks the buffer on its side, we hand out a
+ * shadow copy to draw in.
+ */
+static int lock_shadow(MDisplay *dpy, MBuffer *buf, MRect *dirty,
+                       const void *request, const int request_len)
+{
+    MLockBufferResponse response;
+    if (flush_batch(dpy) < 0 ||
+        write_all(dpy->sock_fd, request, request_len) < 0 ||
+        recv(dpy->sock_fd, &response, sizeof(response), MSG_WAITALL) !=
+            sizeof(response))
+    {
+        MLOGE("error locking remote buffer: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (response.result != 0)
+    {
+        MLOGE("server failed to lock buffer\n");
+        return -1;
+    }
+
+    if (buf->width != response.buffer.width ||
+        buf->height != response.buffer.height)
+    {
+        MLOGW("locked buffer dim mismatch...watch out!\n");
+    }
+    buf->stride = response.buffer.stride;
+    buf->__fd = -1;
+    buf->__fence_fd = -1;
+
+    /* the shadow only ever grows, so it keeps its content across frames */
+    uint32_t size = buffer_size(buf);
+    if (size > buf->__shadow_size)
+    {
+        void *bits = realloc(buf->__shadow_size > 0 ? buf->bits : NULL, size);
+        if (bits == NULL)
+        {
+            MLOGE("error allocating shadow buffer\n");
+            return -1;
+        }
+        buf->bits = bits;
+        buf->__shadow_size = size;
+    }
+
+    buf->__dirty = response.dirty;
+    if (dirty != NULL)
+    {
+        *dirty = response.dirty;
+    }
+    return 0;
+}
+
+/**
+ * Remote unlock: send the pixels of @param rects along with the request.
+ */
+static int unlock_shadow(MDisplay *dpy, MBuffer *buf,
+                         const MRect *rects, int nrects)
+{
+    struct
+    {
+        MRequestHeader header;
+        MUnlockBufferRequest request;
+        MDamageHeader damage;
+    } packet;
+    MRect bounds = {0, 0, 0, 0};
+    int i;
+
+    /* past the limit, the bounding box is cheaper anyway */
+    if (nrects > M_MAX_DAMAGE_RECTS)
+    {
+        for (i = 0; i < nrects; ++i)
+        {
+            union_rect(&bounds, &rects[i]);
+        }
+        rects = &bounds;
+        nrects = 1;
+    }
+
+    size_t size = sizeof(packet);
+    for (i = 0; i < nrects; ++i)
+    {
+        size += sizeof(MDamageRect) +
+                mcodec_bound(rects[i].width, rects[i].height);
+    }
+    if (size > dpy->__scratch_size)
+    {
+        void *scratch = realloc(dpy->__scratch, size);
+        if (scratch == NULL)
+        {
+            MLOGE("error allocating damage buffer\n");
+            return -1;
+        }
+        dpy->__scratch = scratch;
+        dpy->__scratch_size = size;
+    }
+
+    packet.header.op = M_UNLOCK_AND_POST_BUFFER;
+    packet.request.id = buf->__id;
+    packet.request.flags = M_UNLOCK_FLAG_DAMAGE;
+    packet.damage.num_rects = 0;
+
+    uint8_t *out = (uint8_t *)dpy->__scratch + sizeof(packet);
+    for (i = 0; i < nrects; ++i)
+    {
+        MDamageRect damage = {rects[i], 0};
+        if (!clip_to_buffer(&damage.rect, buf))
+        {
+            continue;
+        }
+
+        const uint32_t *src = (const uint32_t *)buf->bits +
+                              damage.rect.y * buf->stride + damage.rect.x;
+        damage.size = mcodec_encode(src, buf->stride,
+                                    damage.rect.width, damage.rect.height,
+                                    out + sizeof(damage));
+        memcpy(out, &damage, sizeof(damage));
+        out += sizeof(damage) + damage.size;
+        packet.damage.num_rects++;
+    }
+    memcpy(dpy->__scratch, &packet, sizeof(packet));
+
+    if (flush_batch(dpy) < 0 ||
+        write_all(dpy->sock_fd, dpy->__scratch,
+                  out - (uint8_t *)dpy->__scratch) < 0)
+    {
+        MLOGE("error sending unlock buffer request: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int lock_buffer(MDisplay *dpy, MBuffer *buf, MRect *dirty,
+                       const uint32_t flags)
+{
+    int fds[MAX_REPLY_FDS];
+    int num_fds;
+    struct
+    {
+        MRequestHeader header;
+        MLockBufferRequest request;
+    } packet;
+    packet.header.op = M_LOCK_BUFFER;
+    packet.request.id = buf->__id;
+    packet.request.flags = flags;
+    if (dirty != NULL)
+    {
+        packet.request.dirty = *dirty;
+    }
+    else
+    {
+        memset(&packet.request.dirty, 0, sizeof(packet.request.dirty));
+    }
+
+    if (dpy->flags & M_DISPLAY_REMOTE)
+    {
+        /* nothing to wait on, the shadow copy is ours alone */
+        packet.request.flags &= ~M_LOCK_FLAG_FENCED;
+        return lock_shadow(dpy, buf, dirty, &packet, sizeof(packet));
+    }
+
+    /* send lock buffer request to server and receive the buffer */
+    MLockBufferResponse response;
+    num_fds = transact_fds(dpy, &packet, sizeof(packet),
+                           &response, sizeof(response),
+                           fds, MAX_REPLY_FDS);
+    if (num_fds == 0 && response.result == M_LOCK_RESULT_WOULD_BLOCK)
+    {
+        return 1;
+    }
+    if (num_fds < 1)
+    {
+        MLOGE("error receiving buffer fd: %s\n",
+              strerror(errno));
+        return -1;
+    }
+
+    buf->__fd = fds[0];
+    buf->__fence_fd = num_fds > 1 ? fds[1] : -1;
+
+    if (buf->width != response.buffer.width ||
+        buf->height != response.buffer.height)
+    {
+        MLOGW("locked buffer dim mismatch...watch out!\n");
+    }
+    buf->stride = response.buffer.stride;
+    if (dirty != NULL)
+    {
+        *dirty = response.dirty;
+    }
+
+    /*
+     * mmap into client memory for software r/w
+     * 
+     * NOTE: we need to be careful since we do not know
+     * the offset for sure...let's cross our fingers and
+     * guess no offset!
      */
-    for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg != NULL;
-         cmsg = CMSG_NXTHDR(&msgh, cmsg))
+    int offset = 0;
+    void *vaddr = mmap(0, buffer_size(buf), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, buf->__fd, offset);
+    if (vaddr == MAP_FAILED)
     {
-        if (cmsg->cmsg_level == SOL_SOCKET &&
-            cmsg->cmsg_type == SCM_RIGHTS)
+        MLOGE("error mmaping buffer: %s\n", strerror(errno));
+        close(buf->__fd);
+        buf->__fd = -1;
+        if (buf->__fence_fd >= 0)
         {
-            buf_fd = *(int *)CMSG_DATA(cmsg);
-            return buf_fd;
+            close(buf->__fence_fd);
+            buf->__fence_fd = -1;
         }
+        return -1;
     }
+    buf->bits = vaddr;
 
-    return -1;
+    return 0;
 }
 
 //
@@ -98,37 +748,139 @@ static int recvfd(const int sock_fd, void *data, const int data_len)
 //
 int MOpenDisplay(MDisplay *dpy)
 {
-    int sock_fd, len;
-    struct sockaddr_un remote;
+    return MOpenDisplayWithFlags(dpy, 0);
+}
+
+static int connect_local(const int seqpacket)
+{
+    int sock_fd, len;
+    struct sockaddr_un remote;
+
+    /* create the socket shell */
+    if ((sock_fd = socket(AF_UNIX, seqpacket ? SOCK_SEQPACKET : SOCK_STREAM,
+                          0)) == -1)
+    {
+        MLOGE("error opening socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Unix domain socket */
+    remote.sun_family = AF_UNIX;
+
+    /* set up abstract namespace path */
+    strcpy(remote.sun_path + 1, seqpacket ? M_SEQPACKET_SOCK_PATH : M_SOCK_PATH);
+    remote.sun_path[0] = '\0'; // abstract namespace indicator
+    len = 1 + strlen(remote.sun_path + 1) + sizeof(remote.sun_family);
+
+    /* try to connect! */
+    if (connect(sock_fd, (struct sockaddr *)&remote, len) == -1)
+    {
+        MLOGE("error connecting socket: %s\n", strerror(errno));
+        close(sock_fd);
+        return -1;
+    }
+
+    return sock_fd;
+}
+
+/**
+ * Send the shared secret in M_TOKEN_ENV, the first thing a remote server
+ * expects.
+ * @return 0 on success, -1 on error
+ */
+static int authenticate(const int sock_fd)
+{
+    const char *token = getenv(M_TOKEN_ENV);
+    MAuthRequest auth;
 
-    /* create the socket shell */
-    if ((sock_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    if (token == NULL || *token == '\0' || strlen(token) >= M_TOKEN_SIZE)
     {
-        MLOGE("error opening socket: %s\n", strerror(errno));
+        MLOGE("remote displays need a %s of 1 to %d characters\n",
+              M_TOKEN_ENV, M_TOKEN_SIZE - 1);
         return -1;
     }
 
-    /* Unix domain socket */
-    remote.sun_family = AF_UNIX;
+    memset(&auth, 0, sizeof(auth));
+    memcpy(auth.token, token, strlen(token));
+    if (write_all(sock_fd, &auth, sizeof(auth)) < 0)
+    {
+        MLOGE("error sending %s: %s\n", M_TOKEN_ENV, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
 
-    /* set up abstract namespace path */
-    strcpy(remote.sun_path + 1, M_SOCK_PATH);
-    remote.sun_path[0] = '\0'; // abstract namespace indicator
-    len = 1 + strlen(remote.sun_path + 1) + sizeof(remote.sun_family);
+int MOpenDisplayWithFlags(MDisplay *dpy, uint32_t flags)
+{
+    int sock_fd;
+    const char *address = getenv(M_DISPLAY_ENV);
 
-    /* try to connect! */
-    if (connect(sock_fd, (struct sockaddr *)&remote, len) == -1)
+    if (address != NULL && *address != '\0')
+    {
+        sock_fd = connect_remote(address);
+        if (sock_fd >= 0 && authenticate(sock_fd) < 0)
+        {
+            close(sock_fd);
+            sock_fd = -1;
+        }
+
+        /* plain stream, and io_uring only pays off for fd passing */
+        flags &= ~(M_DISPLAY_SEQPACKET | M_DISPLAY_URING);
+        flags |= M_DISPLAY_REMOTE;
+    }
+    else
+    {
+        sock_fd = connect_local(flags & M_DISPLAY_SEQPACKET);
+        flags &= ~M_DISPLAY_REMOTE;
+    }
+    if (sock_fd < 0)
     {
-        MLOGE("error connecting socket: %s\n", strerror(errno));
         return -1;
     }
 
     dpy->sock_fd = sock_fd;
+    dpy->flags = flags;
+    dpy->__uring = NULL;
+    dpy->__event_fd = -1;
+    dpy->__scratch = NULL;
+    dpy->__scratch_size = 0;
+    dpy->__batch = NULL;
+    dpy->__batch_size = 0;
+    dpy->__batching = 0;
+
+    if (flags & M_DISPLAY_URING)
+    {
+        dpy->__uring = muring_create(URING_ENTRIES);
+        if (dpy->__uring == NULL)
+        {
+            MLOGW("falling back to plain syscalls\n");
+            dpy->flags &= ~M_DISPLAY_URING;
+        }
+    }
     return 0;
 }
 
 int MCloseDisplay(MDisplay *dpy)
 {
+    /* whatever is still queued goes out, as it would unbatched */
+    flush_batch(dpy);
+    free(dpy->__batch);
+    dpy->__batch = NULL;
+    dpy->__batching = 0;
+
+    muring_free(dpy->__uring);
+    dpy->__uring = NULL;
+
+    free(dpy->__scratch);
+    dpy->__scratch = NULL;
+    dpy->__scratch_size = 0;
+
+    if (dpy->__event_fd >= 0)
+    {
+        close(dpy->__event_fd);
+        dpy->__event_fd = -1;
+    }
+
     if (close(dpy->sock_fd) < 0)
     {
         MLOGE("error closing socket: %s\n", strerror(errno));
@@ -139,6 +891,33 @@ int MCloseDisplay(MDisplay *dpy)
     return 0;
 }
 
+int MConnectionNumber(MDisplay *dpy)
+{
+    return dpy->sock_fd;
+}
+
+int MBeginBatch(MDisplay *dpy)
+{
+    if (dpy->__batch == NULL)
+    {
+        dpy->__batch = malloc(M_MAX_BATCH_SIZE);
+        if (dpy->__batch == NULL)
+        {
+            MLOGE("error allocating request batch\n");
+            return -1;
+        }
+    }
+
+    dpy->__batching = 1;
+    return 0;
+}
+
+int MFlushBatch(MDisplay *dpy)
+{
+    dpy->__batching = 0;
+    return flush_batch(dpy);
+}
+
 int MGetDisplayInfo(MDisplay *dpy, MDisplayInfo *dpy_info)
 {
     struct
@@ -148,7 +927,8 @@ int MGetDisplayInfo(MDisplay *dpy, MDisplayInfo *dpy_info)
     } packet;
     packet.header.op = M_GET_DISPLAY_INFO;
 
-    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0)
+    if (flush_batch(dpy) < 0 ||
+        write(dpy->sock_fd, &packet, sizeof(packet)) < 0)
     {
         MLOGE("error sending get display info request: %s\n",
               strerror(errno));
@@ -165,10 +945,115 @@ int MGetDisplayInfo(MDisplay *dpy, MDisplayInfo *dpy_info)
 
     dpy_info->width = response.width;
     dpy_info->height = response.height;
+    dpy_info->orientation = response.orientation;
+    return 0;
+}
+
+int MSetRotation(MDisplay *dpy, uint32_t orientation)
+{
+    struct
+    {
+        MRequestHeader header;
+        MSetRotationRequest request;
+    } packet;
+    packet.header.op = M_SET_ROTATION;
+    packet.request.orientation = orientation;
+
+    if (flush_batch(dpy) < 0 ||
+        write(dpy->sock_fd, &packet, sizeof(packet)) < 0)
+    {
+        MLOGE("error sending set rotation request: %s\n",
+              strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int MSelectEvents(MDisplay *dpy, uint32_t mask)
+{
+    int fd;
+    struct
+    {
+        MRequestHeader header;
+        MSelectEventsRequest request;
+    } packet;
+
+    if (dpy->flags & M_DISPLAY_REMOTE)
+    {
+        MLOGE("events need fd passing, unavailable on remote displays\n");
+        return -1;
+    }
+    packet.header.op = M_SELECT_EVENTS;
+    packet.request.mask = mask;
+
+    MSelectEventsResponse response;
+    if (transact_fds(dpy, &packet, sizeof(packet),
+                     &response, sizeof(response), &fd, 1) < 1)
+    {
+        MLOGE("error receiving event channel\n");
+        return -1;
+    }
+
+    /* events are polled for, never block on them */
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+    {
+        MLOGE("error making event channel non-blocking: %s\n",
+              strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    if (dpy->__event_fd >= 0)
+    {
+        close(dpy->__event_fd);
+    }
+    dpy->__event_fd = fd;
     return 0;
 }
 
+int MEventConnectionNumber(MDisplay *dpy)
+{
+    return dpy->__event_fd;
+}
+
+int MNextEvent(MDisplay *dpy, MEvent *ev)
+{
+    ssize_t n;
+    for (;;)
+    {
+        n = recv(dpy->__event_fd, ev, sizeof(*ev), 0);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+
+            MLOGE("error receiving event: %s\n", strerror(errno));
+            return -1;
+        }
+        else if (n == 0)
+        {
+            MLOGE("event channel closed by server\n");
+            return -1;
+        }
+        else if (n == sizeof(*ev))
+        {
+            return 1;
+        }
+
+        MLOGW("ignoring malformed event (%d bytes)\n", (int)n);
+    }
+}
+
 int MCreateBuffer(MDisplay *dpy, MBuffer *buf)
+{
+    return MCreateBufferWithMaxSize(dpy, buf, 0, 0);
+}
+
+int MCreateBufferWithMaxSize(MDisplay *dpy, MBuffer *buf,
+                             uint32_t max_width, uint32_t max_height)
 {
     struct
     {
@@ -178,9 +1063,12 @@ int MCreateBuffer(MDisplay *dpy, MBuffer *buf)
     packet.header.op = M_CREATE_BUFFER;
     packet.request.width = buf->width;
     packet.request.height = buf->height;
+    packet.request.max_width = max_width;
+    packet.request.max_height = max_height;
 
     /* send create buffer request to server */
-    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0)
+    if (flush_batch(dpy) < 0 ||
+        write(dpy->sock_fd, &packet, sizeof(packet)) < 0)
     {
         MLOGE("error sending create buffer request: %s\n",
               strerror(errno));
@@ -196,9 +1084,16 @@ int MCreateBuffer(MDisplay *dpy, MBuffer *buf)
     }
 
     buf->__id = response.id;
+    buf->__shadow_size = 0;
+    buf->__position = NULL;
     return response.result ? -1 : 0;
 }
 
+int32_t MBufferId(MBuffer *buf)
+{
+    return buf->__id;
+}
+
 int MUpdateBuffer(MDisplay *dpy, MBuffer *buf,
                   uint32_t xpos, uint32_t ypos)
 {
@@ -212,6 +1107,24 @@ int MUpdateBuffer(MDisplay *dpy, MBuffer *buf,
     packet.request.xpos = xpos;
     packet.request.ypos = ypos;
 
+    if (buf->__position != NULL)
+    {
+        MPositionPage *page = (MPositionPage *)buf->__position;
+        mseqlock_write_begin(&page->seq);
+        page->xpos = xpos;
+        page->ypos = ypos;
+        mseqlock_write_end(&page->seq);
+        return 0;
+    }
+
+    switch (batch_request(dpy, &packet, sizeof(packet)))
+    {
+    case 1:
+        return 0;
+    case -1:
+        return -1;
+    }
+
     if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0)
     {
         MLOGE("error sending update buffer request: %s\n",
@@ -224,6 +1137,44 @@ int MUpdateBuffer(MDisplay *dpy, MBuffer *buf,
     return 0;
 }
 
+int MMapBufferPosition(MDisplay *dpy, MBuffer *buf)
+{
+    int fd;
+    struct
+    {
+        MRequestHeader header;
+        MMapPositionRequest request;
+    } packet;
+
+    if (dpy->flags & M_DISPLAY_REMOTE)
+    {
+        MLOGE("position pages need fd passing, unavailable on remote displays\n");
+        return -1;
+    }
+    packet.header.op = M_MAP_POSITION;
+    packet.request.id = buf->__id;
+
+    MMapPositionResponse response;
+    if (transact_fds(dpy, &packet, sizeof(packet),
+                     &response, sizeof(response), &fd, 1) < 1)
+    {
+        MLOGE("error receiving position page\n");
+        return -1;
+    }
+
+    void *page = mmap(NULL, sizeof(MPositionPage), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED)
+    {
+        MLOGE("error mmaping position page: %s\n", strerror(errno));
+        return -1;
+    }
+
+    buf->__position = page;
+    return 0;
+}
+
 int MResizeBuffer(MDisplay *dpy, MBuffer *buf,
                   uint32_t width, uint32_t height)
 {
@@ -237,7 +1188,8 @@ int MResizeBuffer(MDisplay *dpy, MBuffer *buf,
     packet.request.width = width;
     packet.request.height = height;
 
-    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0)
+    if (flush_batch(dpy) < 0 ||
+        write(dpy->sock_fd, &packet, sizeof(packet)) < 0)
     {
         MLOGE("error sending resize buffer request: %s\n",
               strerror(errno));
@@ -261,66 +1213,121 @@ int MResizeBuffer(MDisplay *dpy, MBuffer *buf,
     return response.result ? -1 : 0;
 }
 
-int MLockBuffer(MDisplay *dpy, MBuffer *buf)
+int MSetBufferCount(MDisplay *dpy, MBuffer *buf, uint32_t count,
+                    uint32_t *actual)
 {
-    int buf_fd;
     struct
     {
         MRequestHeader header;
-        MLockBufferRequest request;
+        MSetBufferCountRequest request;
     } packet;
-    packet.header.op = M_LOCK_BUFFER;
+    packet.header.op = M_SET_BUFFER_COUNT;
     packet.request.id = buf->__id;
+    packet.request.count = count;
 
-    /* send lock buffer request to server */
-    if (write(dpy->sock_fd, &packet, sizeof(packet)) < 0)
+    if (flush_batch(dpy) < 0 ||
+        write(dpy->sock_fd, &packet, sizeof(packet)) < 0)
     {
-        MLOGE("error sending lock buffer request: %s\n",
+        MLOGE("error sending set buffer count request: %s\n",
               strerror(errno));
         return -1;
     }
 
-    /* receive the buffer */
-    MLockBufferResponse response;
-    buf_fd = recvfd(dpy->sock_fd, &response, sizeof(response));
-    if (buf_fd < 0)
+    MSetBufferCountResponse response;
+    if (read(dpy->sock_fd, &response, sizeof(response)) < 0)
     {
-        MLOGE("error receiving buffer fd: %s\n",
+        MLOGE("error receiving set buffer count response: %s\n",
               strerror(errno));
         return -1;
     }
 
-    if (buf->width != response.buffer.width ||
-        buf->height != response.buffer.height)
+    if (response.result == 0 && actual != NULL)
     {
-        MLOGW("locked buffer dim mismatch...watch out!\n");
+        *actual = response.count;
     }
-    buf->stride = response.buffer.stride;
-    buf->__fd = buf_fd;
+    return response.result ? -1 : 0;
+}
 
-    /*
-     * mmap into client memory for software r/w
-     * 
-     * NOTE: we need to be careful since we do not know
-     * the offset for sure...let's cross our fingers and
-     * guess no offset!
-     */
-    int offset = 0;
-    void *vaddr = mmap(0, buffer_size(buf), PROT_READ | PROT_WRITE,
-                       MAP_SHARED, buf_fd, offset);
-    if (vaddr == MAP_FAILED)
+int MTrimBuffer(MDisplay *dpy, MBuffer *buf)
+{
+    struct
     {
-        MLOGE("error mmaping buffer: %s\n", strerror(errno));
-        close(buf->__fd);
-        buf->__fd = -1;
+        MRequestHeader header;
+        MTrimBufferRequest request;
+    } packet;
+    packet.header.op = M_TRIM_BUFFER;
+    packet.request.id = buf->__id;
+
+    /* the server's lock response covers whatever the shadow was holding */
+    if (buf->__shadow_size > 0)
+    {
+        free(buf->bits);
+        buf->bits = NULL;
+        buf->__shadow_size = 0;
+    }
+
+    if (flush_batch(dpy) < 0 ||
+        write(dpy->sock_fd, &packet, sizeof(packet)) < 0)
+    {
+        MLOGE("error sending trim buffer request: %s\n",
+              strerror(errno));
         return -1;
     }
-    buf->bits = vaddr;
 
     return 0;
 }
 
+int MLockBufferRect(MDisplay *dpy, MBuffer *buf, MRect *dirty)
+{
+    return lock_buffer(dpy, buf, dirty, 0);
+}
+
+int MLockBuffer(MDisplay *dpy, MBuffer *buf)
+{
+    return MLockBufferRect(dpy, buf, NULL);
+}
+
+int MLockBufferFenced(MDisplay *dpy, MBuffer *buf, MRect *dirty)
+{
+    return lock_buffer(dpy, buf, dirty, M_LOCK_FLAG_FENCED);
+}
+
+int MWaitBuffer(MBuffer *buf, int timeout_ms)
+{
+    if (buf->__fence_fd < 0)
+    {
+        return 0;
+    }
+
+    /* sync_file fds (and eventfds) poll readable once signaled */
+    struct pollfd pfd = {buf->__fence_fd, POLLIN, 0};
+    int n;
+    do
+    {
+        n = poll(&pfd, 1, timeout_ms);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+    {
+        MLOGE("error waiting on buffer fence: %s\n", strerror(errno));
+        return -1;
+    }
+    else if (n == 0)
+    {
+        return 1;
+    }
+
+    close(buf->__fence_fd);
+    buf->__fence_fd = -1;
+    return 0;
+}
+
 int MUnlockBuffer(MDisplay *dpy, MBuffer *buf)
+{
+    return MUnlockBufferFenced(dpy, buf, -1);
+}
+
+int MUnlockBufferFenced(MDisplay *dpy, MBuffer *buf, int release_fence)
 {
     int err;
     struct
@@ -330,13 +1337,25 @@ int MUnlockBuffer(MDisplay *dpy, MBuffer *buf)
     } packet;
     packet.header.op = M_UNLOCK_AND_POST_BUFFER;
     packet.request.id = buf->__id;
+    packet.request.flags = release_fence >= 0 ? M_UNLOCK_FLAG_FENCED : 0;
 
-    /* send unlock buffer request to server */
-    err = write(dpy->sock_fd, &packet, sizeof(packet));
-    if (err < 0)
+    if (dpy->flags & M_DISPLAY_REMOTE)
     {
-        MLOGE("error sending unlock buffer request: %s\n",
-              strerror(errno));
+        /* fences stay local, the server gets finished pixels */
+        if (release_fence >= 0)
+        {
+            struct pollfd pfd = {release_fence, POLLIN, 0};
+            poll(&pfd, 1, -1);
+            close(release_fence);
+        }
+        return unlock_shadow(dpy, buf, &buf->__dirty, 1);
+    }
+
+    /* never waited on, nothing was written */
+    if (buf->__fence_fd >= 0)
+    {
+        close(buf->__fence_fd);
+        buf->__fence_fd = -1;
     }
 
     /* munmap the stale buffer */
@@ -345,6 +1364,80 @@ int MUnlockBuffer(MDisplay *dpy, MBuffer *buf)
         MLOGE("error munmapping buffer: %s\n", strerror(errno));
     }
 
+    if (release_fence < 0)
+    {
+        err = batch_request(dpy, &packet, sizeof(packet));
+        if (err != 0)
+        {
+            close(buf->__fd);
+            buf->__fd = -1;
+            return err < 0 ? -1 : 0;
+        }
+    }
+    else if (flush_batch(dpy) < 0)
+    {
+        close(release_fence);
+        close(buf->__fd);
+        buf->__fd = -1;
+        return -1;
+    }
+
+    if (dpy->__uring != NULL && release_fence < 0)
+    {
+        uint64_t user_data[2];
+        int32_t res[2];
+        int i;
+
+        /* request and fd close go out in one submission */
+        if (muring_queue_write(dpy->__uring, dpy->sock_fd, &packet,
+                               sizeof(packet), URING_REQUEST, 0) == 0 &&
+            muring_queue_close(dpy->__uring, buf->__fd, URING_CLOSE) == 0)
+        {
+            /*
+             * Should the submission fail, the close may or may not have
+             * run: leaking the fd beats closing a number already reused.
+             */
+            err = muring_submit(dpy->__uring, 2, user_data, res);
+            if (err == 0)
+            {
+                for (i = 0; i < 2; ++i)
+                {
+                    if (res[i] < 0)
+                    {
+                        MLOGE("error %s: %s\n",
+                              user_data[i] == URING_REQUEST
+                                  ? "sending unlock buffer request"
+                                  : "closing buffer fd",
+                              strerror(-res[i]));
+                        err = -1;
+                    }
+                }
+            }
+
+            buf->__fd = -1;
+            return err;
+        }
+
+        /* no room for both, send and close the plain way */
+        muring_discard(dpy->__uring);
+    }
+
+    /* send unlock buffer request to server, along with the fence */
+    if (release_fence >= 0)
+    {
+        err = sendfd(dpy->sock_fd, &packet, sizeof(packet), release_fence);
+        close(release_fence);
+    }
+    else
+    {
+        err = write(dpy->sock_fd, &packet, sizeof(packet));
+    }
+    if (err < 0)
+    {
+        MLOGE("error sending unlock buffer request: %s\n",
+              strerror(errno));
+    }
+
     /*
      * close the buffer fd or risk flooding the
      * system with new fds on each lock/unlock cycle! 
@@ -353,3 +1446,14 @@ int MUnlockBuffer(MDisplay *dpy, MBuffer *buf)
     buf->__fd = -1;
     return err;
 }
+
+int MUnlockBufferDamage(MDisplay *dpy, MBuffer *buf,
+                        const MRect *rects, int nrects)
+{
+    if (!(dpy->flags & M_DISPLAY_REMOTE))
+    {
+        return MUnlockBuffer(dpy, buf);
+    }
+
+    return unlock_shadow(dpy, buf, rects, nrects);
+}
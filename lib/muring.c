@@ -0,0 +1,424 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include "muring.h"
+#include "mlog.h"
+
+/*
+ * Requires the 5.6 uapi (IORING_OP_WRITE, IORING_OP_CLOSE and opcode
+ * probing). With older headers the ring is never created and every
+ * display silently uses plain syscalls.
+ */
+#if defined(__NR_io_uring_setup) && defined(IORING_SETUP_CLAMP)
+#define HAVE_IO_URING
+#endif
+
+#ifdef HAVE_IO_URING
+
+struct MUring
+{
+    int mFd;
+
+    /* submission ring, shared with the kernel */
+    void *mSqRing;
+    size_t mSqRingSize;
+    unsigned *mSqHead;
+    unsigned *mSqTail;
+    unsigned *mSqMask;
+    unsigned *mSqArray;
+    struct io_uring_sqe *mSqes;
+    size_t mSqesSize;
+    unsigned mQueued; /* sqes queued since the last submit */
+
+    /* completion ring, shared with the kernel */
+    void *mCqRing;
+    size_t mCqRingSize;
+    unsigned *mCqHead;
+    unsigned *mCqTail;
+    unsigned *mCqMask;
+    struct io_uring_cqe *mCqes;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * @return non-zero if the kernel supports every opcode we queue
+ */
+static int probe_ops(int fd)
+{
+    static const uint8_t needed[] = {
+        IORING_OP_WRITE,
+        IORING_OP_RECVMSG,
+        IORING_OP_CLOSE,
+    };
+    size_t size = sizeof(struct io_uring_probe) +
+                  256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    size_t i;
+    int ok = 0;
+
+    if (probe == NULL)
+    {
+        return 0;
+    }
+
+    /* probing itself is 5.6+, so failure means too old */
+    if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+    {
+        ok = 1;
+        for (i = 0; i < sizeof(needed); ++i)
+        {
+            if (needed[i] > probe->last_op ||
+                !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+            {
+                ok = 0;
+            }
+        }
+    }
+
+    free(probe);
+    return ok;
+}
+
+static void unmap_rings(struct MUring *this)
+{
+    if (this->mSqes != NULL && this->mSqes != MAP_FAILED)
+    {
+        munmap(this->mSqes, this->mSqesSize);
+    }
+    if (this->mCqRing != NULL && this->mCqRing != MAP_FAILED &&
+        this->mCqRing != this->mSqRing)
+    {
+        munmap(this->mCqRing, this->mCqRingSize);
+    }
+    if (this->mSqRing != NULL && this->mSqRing != MAP_FAILED)
+    {
+        munmap(this->mSqRing, this->mSqRingSize);
+    }
+}
+
+static int map_rings(struct MUring *this, const struct io_uring_params *p)
+{
+    this->mSqRingSize = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    this->mCqRingSize = p->cq_off.cqes +
+                        p->cq_entries * sizeof(struct io_uring_cqe);
+
+    /* newer kernels share one mapping between both rings */
+    if (p->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (this->mCqRingSize > this->mSqRingSize)
+        {
+            this->mSqRingSize = this->mCqRingSize;
+        }
+        this->mCqRingSize = this->mSqRingSize;
+    }
+
+    this->mSqRing = mmap(NULL, this->mSqRingSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, this->mFd,
+                         IORING_OFF_SQ_RING);
+    if (this->mSqRing == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        this->mCqRing = this->mSqRing;
+    }
+    else
+    {
+        this->mCqRing = mmap(NULL, this->mCqRingSize, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, this->mFd,
+                             IORING_OFF_CQ_RING);
+        if (this->mCqRing == MAP_FAILED)
+        {
+            return -1;
+        }
+    }
+
+    this->mSqesSize = p->sq_entries * sizeof(struct io_uring_sqe);
+    this->mSqes = mmap(NULL, this->mSqesSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, this->mFd, IORING_OFF_SQES);
+    if (this->mSqes == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    uint8_t *sq = (uint8_t *)this->mSqRing;
+    this->mSqHead = (unsigned *)(sq + p->sq_off.head);
+    this->mSqTail = (unsigned *)(sq + p->sq_off.tail);
+    this->mSqMask = (unsigned *)(sq + p->sq_off.ring_mask);
+    this->mSqArray = (unsigned *)(sq + p->sq_off.array);
+
+    uint8_t *cq = (uint8_t *)this->mCqRing;
+    this->mCqHead = (unsigned *)(cq + p->cq_off.head);
+    this->mCqTail = (unsigned *)(cq + p->cq_off.tail);
+    this->mCqMask = (unsigned *)(cq + p->cq_off.ring_mask);
+    this->mCqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+    return 0;
+}
+
+struct MUring *muring_create(unsigned entries)
+{
+    struct io_uring_params params;
+    struct MUring *this = calloc(1, sizeof(*this));
+    if (this == NULL)
+    {
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    this->mFd = io_uring_setup(entries, &params);
+    if (this->mFd < 0)
+    {
+        /* ENOSYS on old kernels, EPERM when blocked by seccomp */
+        MLOGW("io_uring unavailable: %s\n", strerror(errno));
+        free(this);
+        return NULL;
+    }
+
+    if (!probe_ops(this->mFd))
+    {
+        MLOGW("io_uring lacks required opcodes\n");
+        close(this->mFd);
+        free(this);
+        return NULL;
+    }
+
+    if (map_rings(this, &params) < 0)
+    {
+        MLOGE("error mapping io_uring rings: %s\n", strerror(errno));
+        unmap_rings(this);
+        close(this->mFd);
+        free(this);
+        return NULL;
+    }
+
+    return this;
+}
+
+void muring_free(struct MUring *this)
+{
+    if (this == NULL)
+    {
+        return;
+    }
+
+    unmap_rings(this);
+    close(this->mFd);
+    free(this);
+}
+
+static struct io_uring_sqe *get_sqe(struct MUring *this, uint64_t user_data,
+                                    int link)
+{
+    unsigned head = __atomic_load_n(this->mSqHead, __ATOMIC_ACQUIRE);
+    unsigned tail = *this->mSqTail + this->mQueued;
+    if (tail - head > *this->mSqMask)
+    {
+        MLOGE("io_uring submission queue full\n");
+        return NULL;
+    }
+
+    unsigned index = tail & *this->mSqMask;
+    struct io_uring_sqe *sqe = &this->mSqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+
+    this->mSqArray[index] = index;
+    this->mQueued++;
+    return sqe;
+}
+
+int muring_queue_write(struct MUring *this, int fd, const void *buf,
+                       size_t len, uint64_t user_data, int link)
+{
+    struct io_uring_sqe *sqe = get_sqe(this, user_data, link);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    /* sockets are not seekable, -1 means "current position" */
+    sqe->off = (uint64_t)-1;
+    return 0;
+}
+
+int muring_queue_recvmsg(struct MUring *this, int fd, struct msghdr *msg,
+                         int flags, uint64_t user_data, int link)
+{
+    struct io_uring_sqe *sqe = get_sqe(this, user_data, link);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    return 0;
+}
+
+int muring_queue_close(struct MUring *this, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = get_sqe(this, user_data, 0);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    return 0;
+}
+
+void muring_discard(struct MUring *this)
+{
+    /* never published, the kernel has not seen them */
+    this->mQueued = 0;
+}
+
+int muring_submit(struct MUring *this, unsigned count,
+                  uint64_t *user_data, int32_t *res)
+{
+    unsigned to_submit = this->mQueued;
+    unsigned reaped = 0;
+
+    /* publish the queued entries to the kernel */
+    __atomic_store_n(this->mSqTail, *this->mSqTail + to_submit,
+                     __ATOMIC_RELEASE);
+    this->mQueued = 0;
+
+    while (reaped < count)
+    {
+        unsigned head = *this->mCqHead;
+        unsigned tail = __atomic_load_n(this->mCqTail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail && reaped < count; ++head, ++reaped)
+        {
+            const struct io_uring_cqe *cqe = &this->mCqes[head & *this->mCqMask];
+            user_data[reaped] = cqe->user_data;
+            res[reaped] = cqe->res;
+        }
+        __atomic_store_n(this->mCqHead, head, __ATOMIC_RELEASE);
+
+        if (reaped == count && to_submit == 0)
+        {
+            break;
+        }
+
+        /* submit and block for the rest in a single syscall */
+        int submitted = io_uring_enter(this->mFd, to_submit, count - reaped,
+                                       count > reaped ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (submitted < 0 || (submitted == 0 && to_submit > 0))
+        {
+            MLOGE("io_uring_enter error: %s\n",
+                  submitted < 0 ? strerror(errno) : "nothing submitted");
+
+            /* take back what the kernel did not consume */
+            __atomic_store_n(this->mSqTail, *this->mSqTail - to_submit,
+                             __ATOMIC_RELEASE);
+            return -1;
+        }
+
+        /* a short count leaves the rest for the next round */
+        to_submit -= submitted;
+    }
+
+    return 0;
+}
+
+#else // HAVE_IO_URING
+
+struct MUring *muring_create(unsigned entries)
+{
+    MLOGW("built without io_uring support\n");
+    return NULL;
+}
+
+void muring_free(struct MUring *this)
+{
+}
+
+int muring_queue_write(struct MUring *this, int fd, const void *buf,
+                       size_t len, uint64_t user_data, int link)
+{
+    return -1;
+}
+
+int muring_queue_recvmsg(struct MUring *this, int fd, struct msghdr *msg,
+                         int flags, uint64_t user_data, int link)
+{
+    return -1;
+}
+
+int muring_queue_close(struct MUring *this, int fd, uint64_t user_data)
+{
+    return -1;
+}
+
+void muring_discard(struct MUring *this)
+{
+}
+
+int muring_submit(struct MUring *this, unsigned count,
+                  uint64_t *user_data, int32_t *res)
+{
+    return -1;
+}
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,70 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_URING_H
+#define M_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+
+/*
+ * Minimal io_uring wrapper for libmflinger (no liburing dependency).
+ *
+ * Private to the library, MDisplay only carries an opaque pointer.
+ */
+
+struct MUring;
+
+/**
+ * @return a new ring, NULL if the kernel lacks io_uring or any of
+ * the opcodes the transport needs (callers fall back to syscalls)
+ */
+struct MUring *muring_create(unsigned entries);
+void muring_free(struct MUring *this);
+
+/*
+ * Queue operations. Nothing reaches the kernel before muring_submit().
+ * @param link the next queued operation only starts once this one
+ * completed successfully, and is cancelled otherwise
+ * @return 0, -1 if the submission queue is full
+ */
+int muring_queue_write(struct MUring *this, int fd, const void *buf,
+                       size_t len, uint64_t user_data, int link);
+int muring_queue_recvmsg(struct MUring *this, int fd, struct msghdr *msg,
+                         int flags, uint64_t user_data, int link);
+int muring_queue_close(struct MUring *this, int fd, uint64_t user_data);
+
+/**
+ * Drop everything queued since the last muring_submit(), e.g. when a
+ * later part of a linked chain did not fit.
+ */
+void muring_discard(struct MUring *this);
+
+/**
+ * Submit everything queued and wait for @param count completions in the
+ * same syscall, then reap them.
+ * @param user_data/@param res filled with each completion, in order of
+ * completion
+ * @return 0, -1 on error, in which case the entries the kernel did not
+ * take are dropped
+ */
+int muring_submit(struct MUring *this, unsigned count,
+                  uint64_t *user_data, int32_t *res);
+
+#endif // M_URING_H
@@ -0,0 +1,353 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbudget.h"
+#include "mrect.h"
+
+#define BYTES_PER_PIXEL (4)
+
+/* smaller uploads are dominated by fixed costs and skew the rate */
+#define MIN_SAMPLE_BYTES (256 * 1024)
+
+void mbudget_init(struct MBudget *this, uint64_t bytes, uint64_t time_ns)
+{
+    memset(this, 0, sizeof(*this));
+    this->mBytes = bytes;
+    this->mTime = time_ns;
+}
+
+int mbudget_parse(const char *arg, uint64_t *bytes, uint64_t *time_ns)
+{
+    char *end;
+    unsigned long long val = strtoull(arg, &end, 10);
+    if (*arg == '\0' || end == arg)
+    {
+        return -1;
+    }
+
+    *bytes = 0;
+    *time_ns = 0;
+    if (strcmp(end, "ms") == 0)
+    {
+        *time_ns = val * 1000000ull;
+    }
+    else if (strcmp(end, "K") == 0 || strcmp(end, "k") == 0)
+    {
+        *bytes = val * 1024;
+    }
+    else if (strcmp(end, "M") == 0 || strcmp(end, "m") == 0)
+    {
+        *bytes = val * 1024 * 1024;
+    }
+    else if (*end == '\0')
+    {
+        *bytes = val;
+    }
+    else
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+uint64_t mbudget_allowance(struct MBudget *this)
+{
+    if (this->mBytes != 0)
+    {
+        return this->mBytes;
+    }
+
+    /* until the first measurement there is nothing to go by */
+    return this->mTime * this->mRate / 1000;
+}
+
+void mbudget_feedback(struct MBudget *this, uint64_t bytes, uint64_t ns)
+{
+    if (bytes < MIN_SAMPLE_BYTES || ns == 0)
+    {
+        return;
+    }
+
+    uint64_t rate = bytes * 1000 / ns;
+    if (rate == 0)
+    {
+        rate = 1;
+    }
+    this->mRate = this->mRate ? (this->mRate * 7 + rate) / 8 : rate;
+}
+
+/**
+ * Carry @param r over to the next frame, growing the last rectangle
+ * once there is no room left.
+ */
+static void defer(struct MBudget *this, const MRect *r)
+{
+    if (mrect_is_empty(r))
+    {
+        return;
+    }
+
+    if (this->mNumPending == MBUDGET_MAX_RECTS)
+    {
+        mrect_union(&this->mPending[MBUDGET_MAX_RECTS - 1], r);
+        return;
+    }
+    this->mPending[this->mNumPending++] = *r;
+}
+
+/**
+ * @return Chebyshev distance in px from the pointer to @param r, 0 if
+ * it is inside
+ */
+static uint32_t distance(const MRect *r, int32_t px, int32_t py)
+{
+    int64_t dx = 0, dy = 0;
+    if (px < r->x)
+    {
+        dx = (int64_t)r->x - px;
+    }
+    else if (px >= r->x + (int64_t)r->width)
+    {
+        dx = px - (r->x + (int64_t)r->width) + 1;
+    }
+    if (py < r->y)
+    {
+        dy = (int64_t)r->y - py;
+    }
+    else if (py >= r->y + (int64_t)r->height)
+    {
+        dy = py - (r->y + (int64_t)r->height) + 1;
+    }
+
+    int64_t d = dx > dy ? dx : dy;
+    return d > UINT32_MAX ? UINT32_MAX : (uint32_t)d;
+}
+
+/**
+ * Upload order: rectangles near the pointer by distance, then the rest
+ * top to bottom, left to right.
+ */
+static int goes_before(const MRect *a, uint32_t da, const MRect *b, uint32_t db)
+{
+    int fa = da <= MBUDGET_FOCUS, fb = db <= MBUDGET_FOCUS;
+    if (fa != fb)
+    {
+        return fa;
+    }
+    if (fa && da != db)
+    {
+        return da < db;
+    }
+    if (a->y != b->y)
+    {
+        return a->y < b->y;
+    }
+    return a->x < b->x;
+}
+
+static void sort_rects(MRect *rects, int nrects, int32_t px, int32_t py)
+{
+    uint32_t dist[2 * MBUDGET_MAX_RECTS];
+    int i, j;
+
+    /* insertion sort, there are only a few */
+    for (i = 0; i < nrects; ++i)
+    {
+        MRect r = rects[i];
+        uint32_t d = distance(&r, px, py);
+        for (j = i; j > 0 && goes_before(&r, d, &rects[j - 1], dist[j - 1]); --j)
+        {
+            rects[j] = rects[j - 1];
+            dist[j] = dist[j - 1];
+        }
+        rects[j] = r;
+        dist[j] = d;
+    }
+}
+
+/**
+ * Add the parts of @param r that @param rects[from..n) do not cover yet.
+ * @return new number of rectangles, -1 if more than @param max are needed
+ */
+static int add_uncovered(MRect *rects, int n, int max, const MRect *r,
+                         int from)
+{
+    MRect rest[4];
+    int nrest, i, j;
+
+    for (j = from; j < n; ++j)
+    {
+        MRect overlap = rects[j];
+        if (!mrect_intersect(&overlap, r))
+        {
+            continue;
+        }
+
+        nrest = mrect_subtract(r, &rects[j], rest);
+        for (i = 0; i < nrest && n >= 0; ++i)
+        {
+            n = add_uncovered(rects, n, max, &rest[i], j + 1);
+        }
+        return n;
+    }
+
+    if (mrect_is_empty(r))
+    {
+        return n;
+    }
+    if (n == max)
+    {
+        return -1;
+    }
+    rects[n++] = *r;
+    return n;
+}
+
+/**
+ * Gather the new and the carried over damage without overlaps, so every
+ * pixel is uploaded (and counted against the budget) once.
+ * @return number of rectangles in @param rects
+ */
+static int gather(struct MBudget *this, const MRect *damage, int ndamage,
+                  MRect *rects)
+{
+    int n = 0, i;
+
+    for (i = 0; i < ndamage && n >= 0; ++i)
+    {
+        n = add_uncovered(rects, n, 2 * MBUDGET_MAX_RECTS, &damage[i], 0);
+    }
+    for (i = 0; i < this->mNumPending && n >= 0; ++i)
+    {
+        n = add_uncovered(rects, n, 2 * MBUDGET_MAX_RECTS,
+                          &this->mPending[i], 0);
+    }
+
+    /* too many to be worth uploading one by one */
+    if (n < 0 || n > MBUDGET_MAX_RECTS)
+    {
+        MRect bounds = {0, 0, 0, 0};
+        for (i = 0; i < ndamage; ++i)
+        {
+            mrect_union(&bounds, &damage[i]);
+        }
+        for (i = 0; i < this->mNumPending; ++i)
+        {
+            mrect_union(&bounds, &this->mPending[i]);
+        }
+        rects[0] = bounds;
+        n = 1;
+    }
+    this->mNumPending = 0;
+
+    return n;
+}
+
+int mbudget_split(struct MBudget *this, const MRect *damage, int ndamage,
+                  int32_t px, int32_t py, MRect *now)
+{
+    MRect rects[2 * MBUDGET_MAX_RECTS];
+    int n = gather(this, damage, ndamage, rects);
+    int nnow = 0, i;
+
+    uint64_t budget = mbudget_allowance(this);
+    if (budget == 0)
+    {
+        memcpy(now, rects, n * sizeof(rects[0]));
+        return n;
+    }
+
+    sort_rects(rects, n, px, py);
+    for (i = 0; i < n; ++i)
+    {
+        const MRect *r = &rects[i];
+        if (mrect_is_empty(r))
+        {
+            continue;
+        }
+
+        uint64_t line = (uint64_t)r->width * BYTES_PER_PIXEL;
+        uint64_t size = line * r->height;
+
+        if (size <= budget)
+        {
+            now[nnow++] = *r;
+            budget -= size;
+            continue;
+        }
+
+        /* take whole rows, and always make some progress */
+        uint64_t rows = budget / line;
+        if (nnow == 0 && rows < MBUDGET_MIN_ROWS)
+        {
+            rows = MBUDGET_MIN_ROWS < r->height ? MBUDGET_MIN_ROWS : r->height;
+        }
+        if (rows == 0)
+        {
+            defer(this, r);
+            continue;
+        }
+        budget = budget > rows * line ? budget - rows * line : 0;
+
+        /* near the pointer the band grows out from it, otherwise from the top */
+        int64_t top = r->y;
+        if (distance(r, px, py) <= MBUDGET_FOCUS)
+        {
+            top = (int64_t)py - (int64_t)(rows / 2);
+            if (top > r->y + (int64_t)(r->height - rows))
+            {
+                top = r->y + (int64_t)(r->height - rows);
+            }
+            if (top < r->y)
+            {
+                top = r->y;
+            }
+        }
+
+        MRect band = {r->x, (int32_t)top, r->width, (uint32_t)rows};
+        MRect above = {r->x, r->y, r->width, (uint32_t)(top - r->y)};
+        MRect below = {r->x, band.y + (int32_t)rows, r->width,
+                       (uint32_t)(r->y + (int64_t)r->height - top - rows)};
+        now[nnow++] = band;
+        defer(this, &above);
+        defer(this, &below);
+    }
+
+    if (this->mNumPending > 0)
+    {
+        this->mDeferred++;
+    }
+
+    return nnow;
+}
+
+void mbudget_drop(struct MBudget *this, const MRect *covered)
+{
+    int i, n = 0;
+    for (i = 0; i < this->mNumPending; ++i)
+    {
+        if (!mrect_contains(covered, &this->mPending[i]))
+        {
+            this->mPending[n++] = this->mPending[i];
+        }
+    }
+    this->mNumPending = n;
+}
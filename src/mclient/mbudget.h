@@ -0,0 +1,84 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_BUDGET_H
+#define M_BUDGET_H
+
+#include <stdint.h>
+
+#include "mlib.h"
+
+/*
+ * Per-frame upload budget: when a frame's damage is too large to grab
+ * and copy within the budget, only part of it is uploaded, the area
+ * around the pointer first and then in scan order, and the rest is
+ * carried over to the following frames. This bounds the worst-case
+ * frame time (e.g. full-screen repaints at 4K) at the price of the
+ * screen filling in over a few frames.
+ */
+#define MBUDGET_MAX_RECTS (32) /* carried over rectangles */
+#define MBUDGET_FOCUS (128)    /* px around the pointer that go first */
+#define MBUDGET_MIN_ROWS (16)  /* rows uploaded per frame however small the budget */
+
+struct MBudget
+{
+    uint64_t mBytes; /* fixed budget per frame, 0 = derive it from mTime */
+    uint64_t mTime;  /* budget per frame in ns, 0 = none */
+    uint64_t mRate;  /* smoothed upload bytes per us, 0 = unknown */
+
+    MRect mPending[MBUDGET_MAX_RECTS]; /* damage left for the next frames */
+    int mNumPending;
+    uint64_t mDeferred; /* frames that left damage behind */
+};
+
+/**
+ * @param bytes/@param time_ns budget per frame, both 0 = unlimited
+ */
+void mbudget_init(struct MBudget *this, uint64_t bytes, uint64_t time_ns);
+
+/**
+ * Parse a budget: a time (e.g. "8ms") or a byte count with an optional
+ * K or M suffix (e.g. "4M"). "0" turns the budget off.
+ */
+int mbudget_parse(const char *arg, uint64_t *bytes, uint64_t *time_ns);
+
+/**
+ * @return bytes that may be uploaded this frame, 0 = unlimited
+ */
+uint64_t mbudget_allowance(struct MBudget *this);
+
+/**
+ * Feed back how long an upload (grab and copy) took, for time budgets.
+ */
+void mbudget_feedback(struct MBudget *this, uint64_t bytes, uint64_t ns);
+
+/**
+ * Pick what to upload this frame out of the new @param damage and the
+ * damage carried over, the rest is carried over again.
+ * @param px/@param py pointer position on screen
+ * @param now room for MBUDGET_MAX_RECTS rectangles
+ * @return number of rectangles in @param now
+ */
+int mbudget_split(struct MBudget *this, const MRect *damage, int ndamage,
+                  int32_t px, int32_t py, MRect *now);
+
+/**
+ * Forget carried over damage that @param covered uploads anyway.
+ */
+void mbudget_drop(struct MBudget *this, const MRect *covered);
+
+#endif // M_BUDGET_H
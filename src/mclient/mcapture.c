@@ -0,0 +1,581 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "mcapture.h"
+#include "mrect.h"
+#include "mlog.h"
+
+/*
+ * Screen capture of damaged regions.
+ *
+ * Each frame, the damage accumulated on the server is fetched as a list
+ * of rectangles, the rectangles are grabbed into a SysV shm segment shared
+ * with the X server and then copied into the locked MBuffer.
+ *
+ * How the rectangles get into the segment is up to the backend, e.g. one
+ * synchronous XShmGetImage per rectangle (Xlib) or pipelined requests
+ * (XCB). Unless the backend keeps a full-screen image in the segment,
+ * rectangles are packed one after another, which always fits since
+ * damage rectangles never overlap.
+ */
+
+#define BYTES_PER_PIXEL (4)
+
+static const struct MCaptureOps *backends[] = {
+    &mcapture_xcb_ops,
+    &mcapture_pixmap_ops,
+    &mcapture_xlib_ops,
+};
+
+static int cleanup_shm(const void *shmaddr, const int shmid)
+{
+    if (shmdt(shmaddr) < 0)
+    {
+        MLOGE("error detaching shm: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (shmctl(shmid, IPC_RMID, 0) < 0)
+    {
+        MLOGE("error destroying shm: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int shm_cleanup(struct MCapture *this)
+{
+    int err = 0;
+    if (!XShmDetach(this->mXdpy, &this->mShmInfo))
+    {
+        MLOGE("error detaching shm from X server\n");
+        err = -1;
+    }
+
+    /* make sure the server let go before the segment goes away */
+    XSync(this->mXdpy, False);
+
+    /* try to clean up shm even if X fails to detach to avoid leaks */
+    err |= cleanup_shm(this->mShmInfo.shmaddr, this->mShmInfo.shmid);
+
+    return err;
+}
+
+static void update_size(struct MCapture *this)
+{
+    int screen = DefaultScreen(this->mXdpy);
+    this->mWidth = XDisplayWidth(this->mXdpy, screen);
+    this->mHeight = XDisplayHeight(this->mXdpy, screen);
+}
+
+/**
+ * @param size bytes, at least enough for the current screen
+ */
+static int shm_init(struct MCapture *this, size_t size)
+{
+    //
+    // create a shared memory segment to store actual image data
+    //
+    this->mShmInfo.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0777);
+    if (this->mShmInfo.shmid < 0)
+    {
+        MLOGE("error creating shm segment: %s\n", strerror(errno));
+        return -1;
+    }
+
+    this->mShmInfo.shmaddr = shmat(this->mShmInfo.shmid, NULL, 0);
+    if (this->mShmInfo.shmaddr == (void *)-1)
+    {
+        MLOGE("error attaching shm segment: %s\n", strerror(errno));
+        shmctl(this->mShmInfo.shmid, IPC_RMID, 0);
+        return -1;
+    }
+
+    this->mShmInfo.readOnly = False;
+
+    //
+    // inform server of shm
+    //
+    if (!XShmAttach(this->mXdpy, &this->mShmInfo))
+    {
+        MLOGE("error calling XShmAttach\n");
+        cleanup_shm(this->mShmInfo.shmaddr, this->mShmInfo.shmid);
+        return -1;
+    }
+
+    this->mShmSize = size;
+    return 0;
+}
+
+/**
+ * All copies assume 4 bytes per pixel to match the BGRA MBuffer.
+ */
+static int check_pixmap_format(Display *dpy)
+{
+    int screen = DefaultScreen(dpy);
+    int depth = DefaultDepth(dpy, screen);
+    int i, n, bpp = 0;
+
+    XPixmapFormatValues *formats = XListPixmapFormats(dpy, &n);
+    for (i = 0; formats != NULL && i < n; ++i)
+    {
+        if (formats[i].depth == depth)
+        {
+            bpp = formats[i].bits_per_pixel;
+        }
+    }
+    XFree(formats);
+
+    if (bpp != BYTES_PER_PIXEL * 8)
+    {
+        MLOGE("unsupported screen format: depth %d, %d bpp\n", depth, bpp);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int init_backend(struct MCapture *this, const struct MCaptureOps *ops)
+{
+    this->mOps = ops;
+    this->mPriv = NULL;
+    if (ops->init != NULL && ops->init(this) < 0)
+    {
+        MLOGW("%s capture backend unavailable\n", ops->name);
+        this->mOps = NULL;
+        return -1;
+    }
+
+    MLOGI("using %s capture backend\n", ops->name);
+    return 0;
+}
+
+int mcapture_init(struct MCapture *this, Display *dpy, Damage damage,
+                  const char *backend,
+                  uint32_t max_width, uint32_t max_height)
+{
+    memset(this, 0, sizeof(*this));
+    this->mXdpy = dpy;
+    this->mRoot = DefaultRootWindow(dpy);
+    this->mDamage = damage;
+
+    int xfixes_event_base, error;
+    if (!XFixesQueryExtension(dpy, &xfixes_event_base, &error))
+    {
+        MLOGE("Xfixes extension unavailable!\n");
+        return -1;
+    }
+
+    if (check_pixmap_format(dpy) < 0)
+    {
+        return -1;
+    }
+
+    update_size(this);
+    max_width = max_width > this->mWidth ? max_width : this->mWidth;
+    max_height = max_height > this->mHeight ? max_height : this->mHeight;
+    if (shm_init(this, max_width * max_height * BYTES_PER_PIXEL) < 0)
+    {
+        return -1;
+    }
+
+    this->mRegion = XFixesCreateRegion(dpy, NULL, 0);
+
+    size_t i;
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i)
+    {
+        if (backend != NULL && strcmp(backend, backends[i]->name) == 0 &&
+            init_backend(this, backends[i]) == 0)
+        {
+            break;
+        }
+    }
+
+    if (this->mOps == NULL && init_backend(this, &mcapture_xlib_ops) < 0)
+    {
+        XFixesDestroyRegion(dpy, this->mRegion);
+        shm_cleanup(this);
+        return -1;
+    }
+
+    /* the buffer starts out empty, so the first frame must be complete */
+    mcapture_damage_all(this);
+    return 0;
+}
+
+void mcapture_destroy(struct MCapture *this)
+{
+    if (this->mTrimmed)
+    {
+        XFixesDestroyRegion(this->mXdpy, this->mRegion);
+        return;
+    }
+
+    if (this->mOps->destroy != NULL)
+    {
+        this->mOps->destroy(this);
+    }
+
+    XFixesDestroyRegion(this->mXdpy, this->mRegion);
+    shm_cleanup(this);
+}
+
+int mcapture_resize(struct MCapture *this)
+{
+    int screen = DefaultScreen(this->mXdpy);
+    uint32_t xwidth = XDisplayWidth(this->mXdpy, screen);
+    uint32_t xheight = XDisplayHeight(this->mXdpy, screen);
+    int resize_needed = this->mWidth != xwidth ||
+                        this->mHeight != xheight;
+    if (!resize_needed)
+    {
+        return 0;
+    }
+
+    /* nothing to resize, the next fetch sizes everything afresh */
+    if (this->mTrimmed)
+    {
+        update_size(this);
+        return 0;
+    }
+
+    /* backends may hold server resources tied to the segment or size */
+    if (this->mOps->destroy != NULL)
+    {
+        this->mOps->destroy(this);
+    }
+
+    /* only a screen larger than ever before needs a new segment */
+    size_t size = xwidth * xheight * BYTES_PER_PIXEL;
+    if (size > this->mShmSize)
+    {
+        shm_cleanup(this);
+        if (shm_init(this, size) < 0)
+        {
+            return -1;
+        }
+    }
+    update_size(this);
+
+    if (this->mOps->init != NULL && this->mOps->init(this) < 0)
+    {
+        MLOGE("failed to re-initialize %s capture backend\n", this->mOps->name);
+        return -1;
+    }
+
+    mcapture_damage_all(this);
+    return 0;
+}
+
+void mcapture_trim(struct MCapture *this)
+{
+    if (this->mTrimmed)
+    {
+        return;
+    }
+
+    if (this->mOps->destroy != NULL)
+    {
+        this->mOps->destroy(this);
+    }
+    shm_cleanup(this);
+    this->mShmSize = 0;
+    this->mNumRects = 0;
+    this->mTrimmed = 1;
+}
+
+/**
+ * Undo mcapture_trim().
+ */
+static int untrim(struct MCapture *this)
+{
+    if (shm_init(this, this->mWidth * this->mHeight * BYTES_PER_PIXEL) < 0)
+    {
+        return -1;
+    }
+
+    if (this->mOps->init != NULL && this->mOps->init(this) < 0)
+    {
+        MLOGE("failed to re-initialize %s capture backend\n", this->mOps->name);
+        shm_cleanup(this);
+        this->mShmSize = 0;
+        return -1;
+    }
+
+    /* the old pixels went with the segment */
+    this->mTrimmed = 0;
+    mcapture_damage_all(this);
+    return 0;
+}
+
+void mcapture_damage_all(struct MCapture *this)
+{
+    this->mFullDamage = 1;
+}
+
+void mcapture_requeue_damage(struct MCapture *this)
+{
+    XRectangle rects[MCAPTURE_MAX_RECTS];
+    XserverRegion region;
+    int i;
+
+    for (i = 0; i < this->mNumRects; ++i)
+    {
+        rects[i].x = this->mRects[i].rect.x;
+        rects[i].y = this->mRects[i].rect.y;
+        rects[i].width = this->mRects[i].rect.width;
+        rects[i].height = this->mRects[i].rect.height;
+    }
+
+    /* notifies like any other damage, which schedules the next frame */
+    region = XFixesCreateRegion(this->mXdpy, rects, this->mNumRects);
+    XDamageAdd(this->mXdpy, this->mRoot, region);
+    XFixesDestroyRegion(this->mXdpy, region);
+}
+
+/**
+ * Place a rectangle in the segment.
+ * @param packed_offset where the next packed rectangle goes, advanced
+ * @return 0 on success, -1 if the rectangle does not fit the segment
+ */
+static int layout_rect(struct MCapture *this, struct MCaptureRect *cr,
+                       const MRect *r, uint32_t *packed_offset)
+{
+    uint64_t offset, bytes_per_line, end;
+    if (this->mOps->in_place)
+    {
+        bytes_per_line = (uint64_t)this->mWidth * BYTES_PER_PIXEL;
+        offset = r->y * bytes_per_line + (uint64_t)r->x * BYTES_PER_PIXEL;
+        end = offset + (r->height - 1) * bytes_per_line +
+              (uint64_t)r->width * BYTES_PER_PIXEL;
+    }
+    else
+    {
+        bytes_per_line = (uint64_t)r->width * BYTES_PER_PIXEL;
+        offset = *packed_offset;
+        end = offset + bytes_per_line * r->height;
+    }
+    if (end > this->mShmSize)
+    {
+        return -1;
+    }
+
+    cr->rect = *r;
+    cr->bytes_per_line = bytes_per_line;
+    cr->offset = offset;
+    if (!this->mOps->in_place)
+    {
+        *packed_offset = end;
+    }
+    return 0;
+}
+
+void mcapture_set_rect(struct MCapture *this, const MRect *rect)
+{
+    MRect screen = {0, 0, this->mWidth, this->mHeight};
+    MRect r = *rect;
+    uint32_t offset = 0;
+
+    this->mNumRects = 0;
+    if (mrect_intersect(&r, &screen) &&
+        layout_rect(this, &this->mRects[0], &r, &offset) == 0)
+    {
+        this->mNumRects = 1;
+    }
+}
+
+void mcapture_replace_rects(struct MCapture *this,
+                            const MRect *rects, int nrects)
+{
+    MRect screen = {0, 0, this->mWidth, this->mHeight};
+    MRect bounds = {0, 0, 0, 0};
+    uint32_t offset = 0;
+    int i, overflow = 0;
+
+    this->mNumRects = 0;
+    for (i = 0; i < nrects && i < MCAPTURE_MAX_RECTS; ++i)
+    {
+        MRect r = rects[i];
+        if (!mrect_intersect(&r, &screen))
+        {
+            continue;
+        }
+        mrect_union(&bounds, &r);
+
+        if (layout_rect(this, &this->mRects[this->mNumRects], &r, &offset) < 0)
+        {
+            overflow = 1;
+            continue;
+        }
+        this->mNumRects++;
+    }
+
+    /* overlapping rectangles can add up to more than the screen */
+    if (overflow)
+    {
+        mcapture_set_rect(this, &bounds);
+    }
+}
+
+void mcapture_set_rects(struct MCapture *this,
+                        const XRectangle *rects, int nrects,
+                        const XRectangle *bounds)
+{
+    if (nrects > MCAPTURE_MAX_RECTS)
+    {
+        MRect r = {bounds->x, bounds->y, bounds->width, bounds->height};
+        mcapture_set_rect(this, &r);
+        return;
+    }
+
+    MRect r[MCAPTURE_MAX_RECTS];
+    int i;
+    for (i = 0; i < nrects; ++i)
+    {
+        r[i].x = rects[i].x;
+        r[i].y = rects[i].y;
+        r[i].width = rects[i].width;
+        r[i].height = rects[i].height;
+    }
+    mcapture_replace_rects(this, r, nrects);
+}
+
+int mcapture_fetch_damage(struct MCapture *this)
+{
+    if (this->mTrimmed && untrim(this) < 0)
+    {
+        return -1;
+    }
+
+    if (this->mOps->fetch_damage(this) < 0)
+    {
+        return -1;
+    }
+
+    if (this->mFullDamage)
+    {
+        MRect r = {0, 0, this->mWidth, this->mHeight};
+        mcapture_set_rect(this, &r);
+        this->mFullDamage = 0;
+    }
+
+    return this->mNumRects;
+}
+
+void mcapture_bounds(struct MCapture *this, MRect *bounds)
+{
+    int i;
+    memset(bounds, 0, sizeof(*bounds));
+    for (i = 0; i < this->mNumRects; ++i)
+    {
+        mrect_union(bounds, &this->mRects[i].rect);
+    }
+}
+
+int mcapture_grab(struct MCapture *this)
+{
+    return this->mOps->grab(this);
+}
+
+/**
+ * Clip a grabbed rectangle to @param buf and find its first pixel on
+ * both sides.
+ * @return 0 if nothing of it is left to copy
+ */
+static int locate_rect(struct MCapture *this, const struct MCaptureRect *cr,
+                       MBuffer *buf, MRect *r,
+                       const uint8_t **src, uint8_t **dst)
+{
+    MRect bounds = {0, 0, buf->width, buf->height};
+
+    /* the buffer can briefly lag behind a screen resize */
+    *r = cr->rect;
+    if (!mrect_intersect(r, &bounds))
+    {
+        return 0;
+    }
+
+    *src = (const uint8_t *)this->mShmInfo.shmaddr +
+           cr->offset +
+           (r->y - cr->rect.y) * cr->bytes_per_line +
+           (r->x - cr->rect.x) * BYTES_PER_PIXEL;
+    *dst = (uint8_t *)buf->bits +
+           r->y * buf->stride * BYTES_PER_PIXEL +
+           r->x * BYTES_PER_PIXEL;
+    return 1;
+}
+
+int mcapture_copy_to_buffer_mlocked(struct MCapture *this, MBuffer *buf)
+{
+    uint32_t buf_bytes_per_line = buf->stride * BYTES_PER_PIXEL;
+    int i;
+
+    for (i = 0; i < this->mNumRects; ++i)
+    {
+        const struct MCaptureRect *cr = &this->mRects[i];
+        const uint8_t *src;
+        uint8_t *dst;
+        MRect r;
+
+        if (!locate_rect(this, cr, buf, &r, &src, &dst))
+        {
+            continue;
+        }
+
+        /* row-by-row copy to adjust for differing strides */
+        if (this->mCopy != NULL)
+        {
+            mcopy_rows(this->mCopy, dst, buf_bytes_per_line,
+                       src, cr->bytes_per_line,
+                       r.width * BYTES_PER_PIXEL, r.height);
+        }
+        else
+        {
+            mcopy_kernels[0].copy(dst, buf_bytes_per_line,
+                                  src, cr->bytes_per_line,
+                                  r.width * BYTES_PER_PIXEL, r.height);
+        }
+    }
+
+    return 0;
+}
+
+int mcapture_tune_copy(struct MCapture *this, MBuffer *buf)
+{
+    const uint8_t *src;
+    uint8_t *dst;
+    MRect r;
+
+    if (this->mCopy == NULL || this->mNumRects != 1 ||
+        !locate_rect(this, &this->mRects[0], buf, &r, &src, &dst) ||
+        r.width != this->mWidth || r.height != this->mHeight)
+    {
+        return -1;
+    }
+
+    mcopy_tune(this->mCopy, dst, buf->stride * BYTES_PER_PIXEL,
+               src, this->mRects[0].bytes_per_line,
+               r.width * BYTES_PER_PIXEL, r.height);
+    return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_CAPTURE_H
+#define M_CAPTURE_H
+
+#include <stdint.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/Xdamage.h>
+
+#include "mlib.h"
+#include "mcopy.h"
+
+/*
+ * Past this many damage rectangles we just grab their bounding box,
+ * per-rectangle overhead starts to outweigh the saved pixels.
+ */
+#define MCAPTURE_MAX_RECTS (32)
+
+/*
+ * A damaged rectangle and where its pixels land in the capture segment.
+ */
+struct MCaptureRect
+{
+    MRect rect;              /* position on screen */
+    uint32_t offset;         /* byte offset of the first pixel in the segment */
+    uint32_t bytes_per_line; /* segment stride of this rectangle */
+};
+
+struct MCapture;
+
+struct MCaptureOps
+{
+    const char *name;
+
+    /*
+     * The segment is a full-screen image and rectangles are found at
+     * their screen position instead of being packed.
+     */
+    int in_place;
+
+    int (*init)(struct MCapture *this);
+    void (*destroy)(struct MCapture *this);
+
+    /* pull (and clear) the damage accumulated on the server into mRects */
+    int (*fetch_damage)(struct MCapture *this);
+
+    /* copy the pixels of mRects from the screen into the segment */
+    int (*grab)(struct MCapture *this);
+};
+
+struct MCapture
+{
+    Display *mXdpy;
+    Window mRoot;
+    Damage mDamage;
+    XserverRegion mRegion; /* scratch region for damage fetches */
+
+    const struct MCaptureOps *mOps;
+    void *mPriv; /* backend private state */
+
+    /* SysV shm segment the X server writes captures into */
+    XShmSegmentInfo mShmInfo;
+    size_t mShmSize;  /* segment capacity in bytes */
+    uint32_t mWidth;  /* screen width the segment was sized for */
+    uint32_t mHeight; /* screen height the segment was sized for */
+
+    struct MCopy *mCopy; /* copy strategy for buffers, NULL = memcpy */
+    int mTrimmed;        /* segment and backend released while idle */
+
+    int mFullDamage; /* report the whole screen on the next fetch */
+    struct MCaptureRect mRects[MCAPTURE_MAX_RECTS];
+    int mNumRects;
+};
+
+/**
+ * @param backend name of the preferred backend, the Xlib backend is
+ * used as a fallback if it is unknown or fails to initialize
+ * @param max_width/@param max_height largest expected screen size, the
+ * segment is sized for it up front so resizes do not reallocate
+ */
+int mcapture_init(struct MCapture *this, Display *dpy, Damage damage,
+                  const char *backend,
+                  uint32_t max_width, uint32_t max_height);
+void mcapture_destroy(struct MCapture *this);
+
+/**
+ * Follow a screen size change, the capture segment is only re-created
+ * if it is too small for the new size.
+ */
+int mcapture_resize(struct MCapture *this);
+
+/**
+ * Release the segment and backend resources while the screen is idle.
+ * The next fetch re-creates them, sized for the current screen only,
+ * and reports the whole screen as damaged.
+ */
+void mcapture_trim(struct MCapture *this);
+
+/**
+ * Treat the whole screen as damaged on the next fetch.
+ */
+void mcapture_damage_all(struct MCapture *this);
+
+/**
+ * Hand the current rectangles back to the X server as damage, so a frame
+ * that could not be drawn now is fetched again with the next one.
+ */
+void mcapture_requeue_damage(struct MCapture *this);
+
+/**
+ * Fetch pending damage into mRects.
+ * @return number of damaged rectangles, -1 on error
+ */
+int mcapture_fetch_damage(struct MCapture *this);
+
+/**
+ * @param bounds set to the bounding box of the current rectangles
+ */
+void mcapture_bounds(struct MCapture *this, MRect *bounds);
+
+/**
+ * Replace the current rectangles with a single one.
+ */
+void mcapture_set_rect(struct MCapture *this, const MRect *rect);
+
+/**
+ * Replace the current rectangles with @param rects, at most
+ * MCAPTURE_MAX_RECTS of them.
+ */
+void mcapture_replace_rects(struct MCapture *this,
+                            const MRect *rects, int nrects);
+
+int mcapture_grab(struct MCapture *this);
+
+/**
+ * Copy the grabbed rectangles into a locked buffer.
+ */
+int mcapture_copy_to_buffer_mlocked(struct MCapture *this, MBuffer *buf);
+
+/**
+ * Calibrate mCopy on the grabbed frame, which must be a single
+ * full-screen rectangle so the timings are comparable.
+ * @return 0 if tuned, -1 if the frame is unsuitable
+ */
+int mcapture_tune_copy(struct MCapture *this, MBuffer *buf);
+
+//
+// Backend helpers
+//
+void mcapture_set_rects(struct MCapture *this,
+                        const XRectangle *rects, int nrects,
+                        const XRectangle *bounds);
+
+extern const struct MCaptureOps mcapture_xlib_ops;
+extern const struct MCaptureOps mcapture_xcb_ops;
+extern const struct MCaptureOps mcapture_pixmap_ops;
+
+#endif // M_CAPTURE_H
@@ -0,0 +1,140 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+
+#include "mcapture.h"
+#include "mlog.h"
+
+/*
+ * Shared pixmap capture backend.
+ *
+ * The capture segment backs an MIT-SHM pixmap the size of the screen, so
+ * it is a mirror of the root window that the X server updates with plain
+ * XCopyArea requests instead of one GetImage round trip per rectangle.
+ *
+ * Each frame the damage is moved into our region, the region is set as
+ * the GC clip and the root is copied into the pixmap in one request, so
+ * the server copies every damaged rectangle in one batch. The region is
+ * fetched last: requests are processed in order, so its reply doubles as
+ * the sync for the copy and the whole capture is a single round trip.
+ *
+ * Since all damage always lands in the mirror, it is complete at any
+ * time and any part of it can be copied into the buffer without a grab.
+ */
+
+struct pixmap_priv
+{
+    Pixmap pixmap;
+    GC gc;
+};
+
+static int pixmap_init(struct MCapture *this)
+{
+    Display *dpy = this->mXdpy;
+    int screen = DefaultScreen(dpy);
+    int major, minor;
+    Bool shared_pixmaps;
+
+    if (!XShmQueryVersion(dpy, &major, &minor, &shared_pixmaps) ||
+        !shared_pixmaps || XShmPixmapFormat(dpy) != ZPixmap)
+    {
+        MLOGE("X server does not support shared ZPixmaps\n");
+        return -1;
+    }
+
+    struct pixmap_priv *priv = calloc(1, sizeof(*priv));
+    if (priv == NULL)
+    {
+        return -1;
+    }
+
+    priv->pixmap = XShmCreatePixmap(dpy, this->mRoot,
+                                    this->mShmInfo.shmaddr, &this->mShmInfo,
+                                    this->mWidth, this->mHeight,
+                                    DefaultDepth(dpy, screen));
+
+    /*
+     * Copy what is on screen, including child windows, and don't ask for
+     * a NoExpose event per copy.
+     */
+    XGCValues values;
+    values.subwindow_mode = IncludeInferiors;
+    values.graphics_exposures = False;
+    priv->gc = XCreateGC(dpy, priv->pixmap,
+                         GCSubwindowMode | GCGraphicsExposures, &values);
+
+    this->mPriv = priv;
+    return 0;
+}
+
+static void pixmap_destroy(struct MCapture *this)
+{
+    struct pixmap_priv *priv = (struct pixmap_priv *)this->mPriv;
+
+    XFreeGC(this->mXdpy, priv->gc);
+    XFreePixmap(this->mXdpy, priv->pixmap);
+    free(priv);
+    this->mPriv = NULL;
+}
+
+static int pixmap_fetch_damage(struct MCapture *this)
+{
+    struct pixmap_priv *priv = (struct pixmap_priv *)this->mPriv;
+    Display *dpy = this->mXdpy;
+    int nrects;
+    XRectangle bounds;
+
+    XDamageSubtract(dpy, this->mDamage, None, this->mRegion);
+
+    /* a fresh mirror needs everything, otherwise only what changed */
+    XFixesSetGCClipRegion(dpy, priv->gc, 0, 0,
+                          this->mFullDamage ? None : this->mRegion);
+    XCopyArea(dpy, this->mRoot, priv->pixmap, priv->gc,
+              0, 0, this->mWidth, this->mHeight, 0, 0);
+
+    XRectangle *rects = XFixesFetchRegionAndBounds(dpy, this->mRegion,
+                                                   &nrects, &bounds);
+    if (rects == NULL && nrects != 0)
+    {
+        MLOGE("error fetching damage region\n");
+        return -1;
+    }
+
+    mcapture_set_rects(this, rects, nrects, &bounds);
+    XFree(rects);
+
+    return 0;
+}
+
+static int pixmap_grab(struct MCapture *this)
+{
+    /* already up to date, see above */
+    return 0;
+}
+
+const struct MCaptureOps mcapture_pixmap_ops = {
+    .name = "pixmap",
+    .in_place = 1,
+    .init = pixmap_init,
+    .destroy = pixmap_destroy,
+    .fetch_damage = pixmap_fetch_damage,
+    .grab = pixmap_grab,
+};
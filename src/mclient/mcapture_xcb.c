@@ -0,0 +1,142 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+#include <xcb/xfixes.h>
+#include <xcb/damage.h>
+
+#include "mcapture.h"
+#include "mlog.h"
+
+/*
+ * XCB capture backend.
+ *
+ * Requests are issued on the xcb connection underneath our Xlib Display,
+ * so they share XIDs (damage, region, shm segment) and stay ordered with
+ * everything else Xlib sends. Unlike Xlib, xcb hands out a cookie per
+ * request and lets us collect the replies later, so all image requests
+ * of a frame go out back to back and the frame costs one round trip for
+ * the damage and one for the images, no matter how many rectangles.
+ */
+
+static int xcb_capture_init(struct MCapture *this)
+{
+    xcb_connection_t *conn = XGetXCBConnection(this->mXdpy);
+    if (conn == NULL)
+    {
+        MLOGE("no xcb connection behind the X display\n");
+        return -1;
+    }
+
+    const xcb_query_extension_reply_t *shm = xcb_get_extension_data(conn, &xcb_shm_id);
+    if (shm == NULL || !shm->present)
+    {
+        MLOGE("MIT-SHM unavailable through xcb\n");
+        return -1;
+    }
+
+    this->mPriv = conn;
+    return 0;
+}
+
+static int xcb_fetch_damage(struct MCapture *this)
+{
+    xcb_connection_t *conn = (xcb_connection_t *)this->mPriv;
+    xcb_generic_error_t *error = NULL;
+
+    /* both requests go out in one flush */
+    xcb_damage_subtract(conn, this->mDamage, XCB_NONE, this->mRegion);
+    xcb_xfixes_fetch_region_cookie_t cookie = xcb_xfixes_fetch_region(conn, this->mRegion);
+
+    xcb_xfixes_fetch_region_reply_t *reply = xcb_xfixes_fetch_region_reply(conn, cookie, &error);
+    if (reply == NULL)
+    {
+        MLOGE("error fetching damage region: %d\n", error ? error->error_code : -1);
+        free(error);
+        return -1;
+    }
+
+    int i, nrects = xcb_xfixes_fetch_region_rectangles_length(reply);
+    xcb_rectangle_t *rects = xcb_xfixes_fetch_region_rectangles(reply);
+    XRectangle xrects[MCAPTURE_MAX_RECTS];
+    XRectangle bounds = {reply->extents.x, reply->extents.y,
+                         reply->extents.width, reply->extents.height};
+
+    /* only convert what we are going to use, too many collapse to bounds */
+    for (i = 0; i < nrects && i < MCAPTURE_MAX_RECTS; ++i)
+    {
+        xrects[i].x = rects[i].x;
+        xrects[i].y = rects[i].y;
+        xrects[i].width = rects[i].width;
+        xrects[i].height = rects[i].height;
+    }
+    mcapture_set_rects(this, xrects, nrects, &bounds);
+
+    free(reply);
+    return 0;
+}
+
+static int xcb_grab(struct MCapture *this)
+{
+    xcb_connection_t *conn = (xcb_connection_t *)this->mPriv;
+    xcb_shm_get_image_cookie_t cookies[MCAPTURE_MAX_RECTS];
+    int i, err = 0;
+
+    /* make sure nothing Xlib queued is stuck behind our requests */
+    XFlush(this->mXdpy);
+
+    for (i = 0; i < this->mNumRects; ++i)
+    {
+        const struct MCaptureRect *cr = &this->mRects[i];
+        cookies[i] = xcb_shm_get_image(conn, this->mRoot,
+                                       cr->rect.x, cr->rect.y,
+                                       cr->rect.width, cr->rect.height,
+                                       ~0, XCB_IMAGE_FORMAT_Z_PIXMAP,
+                                       this->mShmInfo.shmseg, cr->offset);
+    }
+
+    /* the first reply flushes all requests, the rest are already here */
+    for (i = 0; i < this->mNumRects; ++i)
+    {
+        xcb_generic_error_t *error = NULL;
+        xcb_shm_get_image_reply_t *reply = xcb_shm_get_image_reply(conn, cookies[i], &error);
+        if (reply == NULL)
+        {
+            MLOGE("error grabbing damage rectangle: %d\n", error ? error->error_code : -1);
+            free(error);
+            err = -1;
+            continue;
+        }
+        free(reply);
+    }
+
+    return err;
+}
+
+const struct MCaptureOps mcapture_xcb_ops = {
+    .name = "xcb",
+    .in_place = 0,
+    .init = xcb_capture_init,
+    .destroy = NULL,
+    .fetch_damage = xcb_fetch_damage,
+    .grab = xcb_grab,
+};
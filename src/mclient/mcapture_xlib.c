@@ -0,0 +1,100 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include "mcapture.h"
+#include "mlog.h"
+
+/*
+ * Plain Xlib capture backend, always available.
+ *
+ * Every call here is a synchronous round trip, so a frame costs one
+ * round trip for the damage plus one per damaged rectangle.
+ */
+
+static int xlib_fetch_damage(struct MCapture *this)
+{
+    int nrects;
+    XRectangle bounds;
+
+    /* move the damage into our region, clearing it on the server */
+    XDamageSubtract(this->mXdpy, this->mDamage, None, this->mRegion);
+
+    XRectangle *rects = XFixesFetchRegionAndBounds(this->mXdpy, this->mRegion,
+                                                   &nrects, &bounds);
+    if (rects == NULL && nrects != 0)
+    {
+        MLOGE("error fetching damage region\n");
+        return -1;
+    }
+
+    mcapture_set_rects(this, rects, nrects, &bounds);
+    XFree(rects);
+
+    return 0;
+}
+
+static int xlib_grab(struct MCapture *this)
+{
+    Display *dpy = this->mXdpy;
+    int screen = DefaultScreen(dpy);
+    int i, err = 0;
+
+    for (i = 0; i < this->mNumRects; ++i)
+    {
+        const struct MCaptureRect *cr = &this->mRects[i];
+
+        /* lightweight client-side image header over our slice of the segment */
+        XImage *ximg = XShmCreateImage(dpy,
+                                       DefaultVisual(dpy, screen),
+                                       DefaultDepth(dpy, screen),
+                                       ZPixmap,
+                                       this->mShmInfo.shmaddr + cr->offset,
+                                       &this->mShmInfo,
+                                       cr->rect.width, cr->rect.height);
+        if (ximg == NULL)
+        {
+            MLOGE("error creating XShm Ximage\n");
+            return -1;
+        }
+
+        if (!XShmGetImage(dpy, this->mRoot, ximg,
+                          cr->rect.x, cr->rect.y,
+                          AllPlanes))
+        {
+            MLOGE("error calling XShmGetImage\n");
+            err = -1;
+        }
+
+        /* the pixels belong to the segment, only free the header */
+        ximg->data = NULL;
+        XDestroyImage(ximg);
+    }
+
+    return err;
+}
+
+const struct MCaptureOps mcapture_xlib_ops = {
+    .name = "xlib",
+    .in_place = 0,
+    .init = NULL,
+    .destroy = NULL,
+    .fetch_damage = xlib_fetch_damage,
+    .grab = xlib_grab,
+};
@@ -21,12 +21,12 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <fcntl.h>
-#include <poll.h>
-#include <pthread.h>
+#include <signal.h>
 
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -38,12 +38,31 @@
 #include <linux/input.h>
 
 #include "mlib.h"
+#include "mbudget.h"
+#include "mcapture.h"
+#include "mconfig.h"
 #include "mcursor.h"
 #include "mcursor_cache.h"
+#include "mfanout.h"
+#include "mgovernor.h"
+#include "mcopy.h"
+#include "msched.h"
+#include "mhud.h"
+#include "mheatmap.h"
+#include "mloop.h"
+#include "mpacer.h"
+#include "mpresent.h"
+#include "mrect.h"
 #include "mlog.h"
 
 #define BUF_SIZE (1 << 8)
 
+/*
+ * How long damage may wait for a presenting client to finish its frame
+ * before we give up and capture anyway (two 60 Hz refreshes).
+ */
+#define PRESENT_HOLD_NS (34 * 1000000ull)
+
 /**
  * We use a custom error handler here for flexibility over the default handler
  * that just kills the process.
@@ -64,154 +83,6 @@ int x_error_handler(Display *dpy, XErrorEvent *ev)
     return 0;
 }
 
-int copy_ximg_rows_to_buffer_mlocked(MBuffer *buf, XImage *ximg,
-                                     uint32_t row_start, uint32_t row_end)
-{
-    /* TODO ximg->xoffset? */
-    uint32_t buf_bytes_per_line = buf->stride * 4;
-    uint32_t ximg_bytes_per_pixel = ximg->bits_per_pixel / 8;
-    uint32_t y;
-
-    /* row-by-row copy to adjust for differing strides */
-    uint32_t *buf_row, *ximg_row;
-    for (y = row_start; y < row_end; ++y)
-    {
-        buf_row = buf->bits + (y * buf_bytes_per_line);
-        ximg_row = (void *)ximg->data + (y * ximg->bytes_per_line);
-
-        /*
-         * we don't want to copy any extra XImage row padding
-         * so we just copy up to image width instead of bytes_per_line
-         */
-        memcpy(buf_row, ximg_row, ximg->width * ximg_bytes_per_pixel);
-    }
-
-    return 0;
-}
-
-int copy_ximg_to_buffer_mlocked(MBuffer *buf, XImage *ximg)
-{
-    return copy_ximg_rows_to_buffer_mlocked(buf, ximg, 0, ximg->height);
-}
-
-int render_root(Display *dpy, MDisplay *mdpy,
-                MBuffer *buf, XImage *ximg)
-{
-    int err;
-
-    err = MLockBuffer(mdpy, buf);
-    if (err < 0)
-    {
-        MLOGE("MLockBuffer failed!\n");
-        return -1;
-    }
-
-    Status status;
-    status = XShmGetImage(dpy,
-                          DefaultRootWindow(dpy),
-                          ximg,
-                          0, 0,
-                          AllPlanes);
-    if (!status)
-    {
-        MLOGE("error calling XShmGetImage\n");
-    }
-
-    copy_ximg_to_buffer_mlocked(buf, ximg);
-
-    err = MUnlockBuffer(mdpy, buf);
-    if (err < 0)
-    {
-        MLOGE("MUnlockBuffer failed!\n");
-        return -1;
-    }
-
-    return 0;
-}
-
-int cleanup_shm(const void *shmaddr, const int shmid)
-{
-    if (shmdt(shmaddr) < 0)
-    {
-        MLOGE("error detaching shm: %s\n", strerror(errno));
-        return -1;
-    }
-
-    if (shmctl(shmid, IPC_RMID, 0) < 0)
-    {
-        MLOGE("error destroying shm: %s\n", strerror(errno));
-        return -1;
-    }
-    return 0;
-}
-
-int xshm_cleanup(Display *dpy, XShmSegmentInfo *shminfo, XImage *ximg)
-{
-    int err = 0;
-    if (!XShmDetach(dpy, shminfo))
-    {
-        MLOGE("error detaching shm from X server\n");
-        err = -1;
-    }
-    XDestroyImage(ximg);
-
-    /* try to clean up shm even if X fails to detach to avoid leaks */
-    err |= cleanup_shm(shminfo->shmaddr, shminfo->shmid);
-
-    return err;
-}
-
-XImage *xshm_init(Display *dpy, XShmSegmentInfo *shminfo, int screen)
-{
-    /* create shared memory XImage structure */
-    XImage *ximg = XShmCreateImage(dpy,
-                                   DefaultVisual(dpy, screen),
-                                   DefaultDepth(dpy, screen),
-                                   ZPixmap,
-                                   NULL,
-                                   shminfo,
-                                   XDisplayWidth(dpy, screen),
-                                   XDisplayHeight(dpy, screen));
-    if (ximg == NULL)
-    {
-        MLOGE("error creating XShm Ximage\n");
-        return NULL;
-    }
-
-    //
-    // create a shared memory segment to store actual image data
-    //
-    shminfo->shmid = shmget(IPC_PRIVATE,
-                            ximg->bytes_per_line * ximg->height, IPC_CREAT | 0777);
-    if (shminfo->shmid < 0)
-    {
-        MLOGE("error creating shm segment: %s\n", strerror(errno));
-        return NULL;
-    }
-
-    shminfo->shmaddr = ximg->data = shmat(shminfo->shmid, NULL, 0);
-    if (shminfo->shmaddr < 0)
-    {
-        MLOGE("error attaching shm segment: %s\n", strerror(errno));
-        cleanup_shm(shminfo->shmaddr, shminfo->shmid);
-        return NULL;
-    }
-
-    shminfo->readOnly = False;
-
-    //
-    // inform server of shm
-    //
-    if (!XShmAttach(dpy, shminfo))
-    {
-        MLOGE("error calling XShmAttach\n");
-        cleanup_shm(shminfo->shmaddr, shminfo->shmid);
-        return NULL;
-    }
-
-    return ximg;
-}
-
 /**
  * @return only valid as long as @param screenr is not freed
  */
@@ -238,6 +109,39 @@ static XRRModeInfo *x_find_matching_mode(Display *dpy,
     return NULL;
 }
 
+/**
+ * Largest width and height over all modes, i.e. the most screen space a
+ * mode switch can ask for.
+ */
+static void x_max_mode_size(Display *dpy, uint32_t *width, uint32_t *height)
+{
+    int screen = DefaultScreen(dpy);
+    *width = XDisplayWidth(dpy, screen);
+    *height = XDisplayHeight(dpy, screen);
+
+    XRRScreenResources *screenr = XRRGetScreenResources(dpy,
+                                                        DefaultRootWindow(dpy));
+    if (screenr == NULL)
+    {
+        return;
+    }
+
+    int i;
+    for (i = 0; i < screenr->nmode; ++i)
+    {
+        if (screenr->modes[i].width > *width)
+        {
+            *width = screenr->modes[i].width;
+        }
+        if (screenr->modes[i].height > *height)
+        {
+            *height = screenr->modes[i].height;
+        }
+    }
+
+    XRRFreeScreenResources(screenr);
+}
+
 /**
  * Assumes only one crtc
  */
@@ -341,9 +245,11 @@ static int x_sync_mode(Display *dpy, XRRScreenResources *screenr,
 
 /**
  * Try to sync up MDisplay with XDisplay.
+ * @param rotate keep the X screen in the display's natural orientation
+ * and have mflinger turn it
  */
 static int sync_displays(Display *dpy, MDisplay *mdpy,
-                         const int xrandr_event_base)
+                         const int xrandr_event_base, int rotate)
 {
     if (dpy == NULL || mdpy == NULL)
     {
@@ -374,6 +280,21 @@ static int sync_displays(Display *dpy, MDisplay *mdpy,
     target_width = dinfo.width;
     target_height = dinfo.height;
 
+    /* turning the surfaces is free, turning the pixels is not */
+    if (rotate)
+    {
+        if (MSetRotation(mdpy, dinfo.orientation) < 0)
+        {
+            MLOGW("failed to set the display rotation\n");
+        }
+        else if (dinfo.orientation == M_ORIENTATION_90 ||
+                 dinfo.orientation == M_ORIENTATION_270)
+        {
+            target_width = dinfo.height;
+            target_height = dinfo.width;
+        }
+    }
+
     /*
      * Re-sync before our service grab in case the screen
      * config has changed since we connected to the X server.
@@ -453,22 +374,6 @@ static int sync_displays(Display *dpy, MDisplay *mdpy,
     return err;
 }
 
-static int resize_shm(Display *dpy, XImage *ximg, XShmSegmentInfo *shminfo)
-{
-    int screen = DefaultScreen(dpy);
-    int xwidth = XDisplayWidth(dpy, screen);
-    int xheight = XDisplayHeight(dpy, screen);
-    int shm_resize_needed = ximg->width != xwidth ||
-                            ximg->height != xheight;
-    if (shm_resize_needed)
-    {
-        xshm_cleanup(dpy, shminfo, ximg);
-        ximg = xshm_init(dpy, shminfo, screen);
-    }
-
-    return ximg == NULL ? -1 : 0;
-}
-
 static int resize_mbuffer(Display *dpy, MDisplay *mdpy, MBuffer *root)
 {
     int screen = DefaultScreen(dpy);
@@ -487,13 +392,875 @@ static int resize_mbuffer(Display *dpy, MDisplay *mdpy, MBuffer *root)
     return 0;
 }
 
-int main(void)
+/*
+ * Running totals, the HUD shows how they changed over the last second.
+ */
+struct MClientStats
+{
+    uint64_t frames;  /* root buffer posts, also numbers them */
+    uint64_t dropped; /* posts the compositor never latched */
+    uint64_t grab_ns; /* time spent in each stage of a frame */
+    uint64_t copy_ns;
+    uint64_t post_ns;
+    uint64_t copy_bytes;
+};
+
+/* the HUD redraws at most this often, in the top left corner */
+#define HUD_INTERVAL_NS (1000000000ull)
+#define HUD_X (8)
+#define HUD_Y (8)
+
+/*
+ * Posts to remember the damage time of, until the compositor
+ * reports back on them.
+ */
+#define FRAME_HISTORY (8)
+
+/*
+ * Everything the event loop callbacks need to get at.
+ */
+struct MClient
 {
     Display *dpy;
     MDisplay mdpy;
+    MBuffer root;
+    struct MCursor mcursor;
+
+    struct MCapture capture;
+    Damage damage;
+    int damaged; /* damage is pending since the last frame */
+
+    int xdamage_event_base;
+    int xrandr_event_base;
+
+    struct MLoop loop;
+    struct MLoopSource x_source;
+    struct MLoopSource m_source;
+    struct MLoopSource m_event_source;
+    struct MLoopTimer frame_timer;
+    struct MPacer pacer;
+
+    int governed; /* --min-fps, the frame cap follows the governor */
+    struct MGovernor governor;
+    struct MLoopTimer governor_timer;
+
+    int suspended;                /* the display is off, damage just piles up */
+    int present_sync;             /* time captures to Present completions */
+    int compositor_rotation;      /* mflinger turns our surfaces */
+    int present_hold;             /* the scheduled frame waits for a completion */
+    struct MPresent present;
+    struct MFanout fanout; /* only mapped with --fanout */
+
+    struct MCopy copy; /* strategy for copies into buffers */
+    int force_tune;    /* calibrate even if the cache has an entry */
+    int tune_pending;  /* calibrate on the next full-screen frame */
+    uint32_t buffer_count; /* root surface buffers in effect, 0 = unknown */
+    struct MBudget budget; /* --frame-budget */
+
+    struct MClientStats stats;
+    uint64_t damage_time; /* first damage of the pending frame */
+    uint64_t frame_damage[FRAME_HISTORY]; /* damage_time of post n at n % size */
+
+    int hud_on; /* only with --hud */
+    struct MHud hud;
+    struct MLoopTimer hud_timer;
+    struct MClientStats hud_last; /* totals at the last HUD update */
+    uint64_t hud_last_cursor;
+    uint64_t hud_last_time;
+
+    const char *heatmap_prefix; /* --heatmap output, NULL = not recording */
+    struct MHeatmap heatmap;
+
+    uint64_t idle_trim_ns; /* --idle-trim, 0 = never */
+    struct MLoopTimer idle_timer;
+    uint64_t last_frame_time;
+    int trimmed; /* capture and buffer memory was given back */
+    int err;
+};
+
+/* set from signal handlers, consumed on the loop thread */
+static volatile sig_atomic_t pending_signal;
+static volatile sig_atomic_t stats_requested;
+static volatile sig_atomic_t heatmap_requested;
+static struct MLoop *signal_loop;
+
+static void on_signal(int sig)
+{
+    if (sig == SIGUSR1)
+    {
+        stats_requested = 1;
+    }
+    else if (sig == SIGUSR2)
+    {
+        heatmap_requested = 1;
+    }
+    else
+    {
+        pending_signal = sig;
+    }
+    mloop_wake(signal_loop);
+}
+
+static double per_frame_ms(uint64_t ns, uint64_t frames)
+{
+    return frames ? ns / 1e6 / frames : 0.0;
+}
+
+/**
+ * Log what the client is doing, on SIGUSR1.
+ */
+static void dump_stats(struct MClient *c)
+{
+    struct MSchedPolicy sched;
+    char policy[64] = "unknown";
+    char cursor_policy[64] = "as the capture thread";
+
+    if (msched_current(&sched) == 0)
+    {
+        msched_format(&sched, policy, sizeof(policy));
+    }
+    if (c->mcursor.mSched != NULL)
+    {
+        msched_format(c->mcursor.mSched, cursor_policy, sizeof(cursor_policy));
+    }
+
+    MLOGI("stats: %llu frames, %s capture, copying with %s x%d\n",
+          (unsigned long long)c->stats.frames, c->capture.mOps->name,
+          c->copy.mKernel->name, c->copy.mThreads);
+    MLOGI("stats: capture thread %s, cursor thread %s\n", policy, cursor_policy);
+    if (c->buffer_count != 0)
+    {
+        MLOGI("stats: root surface has %u buffers\n", c->buffer_count);
+    }
+    if (mbudget_allowance(&c->budget) != 0)
+    {
+        MLOGI("stats: frame budget %llu KiB, %llu frames left damage for later\n",
+              (unsigned long long)(mbudget_allowance(&c->budget) / 1024),
+              (unsigned long long)c->budget.mDeferred);
+    }
+    if (c->governed)
+    {
+        const struct MGovernorSample *last = &c->governor.mLast;
+        char temp[32] = "unknown";
+        if (last->temp != MGOVERNOR_TEMP_UNKNOWN)
+        {
+            snprintf(temp, sizeof(temp), "%.1f C", last->temp / 1000.0);
+        }
+        MLOGI("stats: governor at %u fps (%s) of %u-%u, cpu %.2f ms/frame, "
+              "load %.2f per cpu, temperature %s\n",
+              c->governor.mFps, mgovernor_reason(c->governor.mReason),
+              c->governor.mMinFps, c->governor.mMaxFps,
+              per_frame_ms(last->cpu_ns, last->frames),
+              last->load / 1000.0, temp);
+    }
+    MLOGI("stats: damage-to-photon %.1f ms, compositor queue %.1f ms, "
+          "frame interval %.1f ms\n",
+          c->pacer.mLatency / 1e6, c->pacer.mQueueDelay / 1e6,
+          c->pacer.mInterval / 1e6);
+}
+
+static void on_wake(void *data, uint32_t events)
+{
+    struct MClient *c = (struct MClient *)data;
+    int sig = pending_signal;
+    pending_signal = 0;
+
+    if (stats_requested)
+    {
+        stats_requested = 0;
+        dump_stats(c);
+    }
+
+    if (heatmap_requested)
+    {
+        heatmap_requested = 0;
+        if (c->heatmap_prefix != NULL)
+        {
+            mheatmap_write(&c->heatmap, c->heatmap_prefix);
+        }
+    }
+
+    if (sig == SIGINT || sig == SIGTERM)
+    {
+        MLOGI("caught signal %d, shutting down\n", sig);
+        mloop_quit(&c->loop);
+    }
+}
+
+static int install_signal_handlers(struct MLoop *loop)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+
+    signal_loop = loop;
+    if (sigaction(SIGINT, &sa, NULL) < 0 ||
+        sigaction(SIGTERM, &sa, NULL) < 0 ||
+        sigaction(SIGUSR1, &sa, NULL) < 0 ||
+        sigaction(SIGUSR2, &sa, NULL) < 0)
+    {
+        MLOGE("error installing signal handlers: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @return number of grabbed rectangles stored in @param rects
+ */
+static int capture_rects(struct MClient *c, MRect *rects)
+{
+    int i;
+    for (i = 0; i < c->capture.mNumRects; ++i)
+    {
+        rects[i] = c->capture.mRects[i].rect;
+    }
+    return c->capture.mNumRects;
+}
+
+/**
+ * Pass the grabbed rectangles on to the fan-out ring.
+ */
+static void publish_frame(struct MClient *c, uint64_t timestamp,
+                          const MRect *rects, int nrects)
+{
+    MBuffer view;
+
+    if (mfanout_begin_frame(&c->fanout, c->capture.mWidth, c->capture.mHeight,
+                            rects, nrects, &view) < 0)
+    {
+        return;
+    }
+    mcapture_copy_to_buffer_mlocked(&c->capture, &view);
+    mfanout_end_frame(&c->fanout, timestamp);
+}
+
+/**
+ * Pick up the cached copy strategy for this CPU and resolution, or
+ * calibrate on the next full-screen frame.
+ */
+static void load_copy_tuning(struct MClient *c)
+{
+    struct MCopyTuning tuning;
+    char path[PATH_MAX];
+
+    memset(&tuning, 0, sizeof(tuning));
+    tuning.width = c->capture.mWidth;
+    tuning.height = c->capture.mHeight;
+    mcopy_cpu_model(tuning.cpu, sizeof(tuning.cpu));
+
+    c->tune_pending = 1;
+    if (!c->force_tune &&
+        mcopy_tuning_path(path, sizeof(path)) == 0 &&
+        mcopy_load_tuning(path, &tuning) == 0 &&
+        mcopy_set(&c->copy, tuning.kernel, tuning.threads) == 0)
+    {
+        MLOGI("copying with %s on %d thread(s) (cached)\n",
+              tuning.kernel, tuning.threads);
+        c->tune_pending = 0;
+    }
+}
+
+static void save_copy_tuning(struct MClient *c)
+{
+    struct MCopyTuning tuning;
+    char path[PATH_MAX];
+
+    memset(&tuning, 0, sizeof(tuning));
+    tuning.width = c->capture.mWidth;
+    tuning.height = c->capture.mHeight;
+    snprintf(tuning.kernel, sizeof(tuning.kernel), "%s", c->copy.mKernel->name);
+    tuning.threads = c->copy.mThreads;
+    mcopy_cpu_model(tuning.cpu, sizeof(tuning.cpu));
+
+    if (mcopy_tuning_path(path, sizeof(path)) < 0 ||
+        mcopy_save_tuning(path, &tuning) < 0)
+    {
+        MLOGW("copy tuning not cached\n");
+    }
+}
+
+static void schedule_frame(struct MClient *c)
+{
+    uint64_t now = mloop_now();
+
+    if (!c->damaged)
+    {
+        c->damage_time = now;
+    }
+    c->damaged = 1;
+
+    /* the X server keeps accumulating it until we resume */
+    if (c->suspended)
+    {
+        return;
+    }
+
+    uint64_t deadline = mpacer_request(&c->pacer, now);
+    if (!deadline)
+    {
+        return;
+    }
+
+    /*
+     * Damage from a presenting client (video, games) usually means it is
+     * halfway through a frame, so hold off until it completes rather than
+     * capture a torn frame and grab again right after.
+     */
+    if (c->present_sync && mpresent_is_active(&c->present, now))
+    {
+        c->present_hold = 1;
+        if (deadline < now + PRESENT_HOLD_NS)
+        {
+            deadline = now + PRESENT_HOLD_NS;
+        }
+    }
+
+    mloop_timer_set(&c->frame_timer, deadline, 0);
+}
+
+static int render_damage(struct MClient *c)
+{
+    int err, i;
+
+    int nrects = mcapture_fetch_damage(&c->capture);
+    if (nrects < 0)
+    {
+        return nrects;
+    }
+
+    /* the damage as reported, before the server grows it */
+    if (c->heatmap_prefix != NULL)
+    {
+        MRect damage[MCAPTURE_MAX_RECTS];
+        mheatmap_add(&c->heatmap, damage, capture_rects(c, damage));
+    }
+
+    /* huge damage goes up in parts, the rest is carried over */
+    if (mbudget_allowance(&c->budget) != 0)
+    {
+        MRect damage[MCAPTURE_MAX_RECTS], now[MBUDGET_MAX_RECTS];
+        int32_t px, py;
+        mcursor_position(&c->mcursor, &px, &py);
+        nrects = mbudget_split(&c->budget, damage, capture_rects(c, damage),
+                               px, py, now);
+        mcapture_replace_rects(&c->capture, now, nrects);
+        nrects = c->capture.mNumRects;
+    }
+    if (nrects == 0)
+    {
+        return 0;
+    }
+
+    MRect bounds, dirty;
+    mcapture_bounds(&c->capture, &bounds);
+    dirty = bounds;
+
+    /* the buffer may still be on screen, grab while it is released */
+    err = MLockBufferFenced(&c->mdpy, &c->root, &dirty);
+    if (err < 0)
+    {
+        MLOGE("MLockBufferFenced failed!\n");
+        return -1;
+    }
+    if (err > 0)
+    {
+        /* every buffer is busy, try again with the next frame */
+        mcapture_requeue_damage(&c->capture);
+        return 0;
+    }
+
+    /* the server could not preserve the old content, redraw all it asks */
+    if (!mrect_contains(&bounds, &dirty))
+    {
+        mcapture_set_rect(&c->capture, &dirty);
+        mbudget_drop(&c->budget, &dirty);
+    }
+
+    uint64_t timestamp = mloop_now();
+    if (mcapture_grab(&c->capture) < 0)
+    {
+        MLOGE("error grabbing damaged areas\n");
+    }
+    uint64_t grab_ns = mloop_now() - timestamp;
+    c->stats.grab_ns += grab_ns;
+
+    if (MWaitBuffer(&c->root, -1) < 0)
+    {
+        MLOGE("MWaitBuffer failed!\n");
+    }
+    uint64_t copy_start = mloop_now();
+
+    /* time the candidates on the real segment and buffer */
+    if (c->tune_pending && mcapture_tune_copy(&c->capture, &c->root) == 0)
+    {
+        c->tune_pending = 0;
+        save_copy_tuning(c);
+    }
+    mcapture_copy_to_buffer_mlocked(&c->capture, &c->root);
+
+    /* remote displays only transfer these */
+    MRect rects[MCAPTURE_MAX_RECTS];
+    nrects = capture_rects(c, rects);
+    uint64_t post_start = mloop_now();
+    c->stats.copy_ns += post_start - copy_start;
+    uint64_t bytes = 0;
+    for (i = 0; i < nrects; ++i)
+    {
+        bytes += (uint64_t)rects[i].width * rects[i].height * 4;
+    }
+    c->stats.copy_bytes += bytes;
+    mbudget_feedback(&c->budget, bytes, grab_ns + post_start - copy_start);
+
+    err = MUnlockBufferDamage(&c->mdpy, &c->root, rects, nrects);
+    if (err < 0)
+    {
+        MLOGE("MUnlockBufferDamage failed!\n");
+        return -1;
+    }
+    c->stats.post_ns += mloop_now() - post_start;
+    c->stats.frames++;
+    c->frame_damage[c->stats.frames % FRAME_HISTORY] = c->damage_time;
+
+    /* the segment stays intact until the next grab, the display goes first */
+    if (c->fanout.mRing != NULL)
+    {
+        publish_frame(c, timestamp, rects, nrects);
+    }
+
+    /* finish the carried over damage in the next frames */
+    if (c->budget.mNumPending > 0)
+    {
+        schedule_frame(c);
+    }
+
+    return 0;
+}
+
+static void on_frame(void *data, uint32_t events)
+{
+    struct MClient *c = (struct MClient *)data;
+    uint64_t now = mloop_now();
+
+    mpacer_begin_frame(&c->pacer, now);
+    c->present_hold = 0;
+    if (!c->damaged || c->suspended)
+    {
+        return;
+    }
+    c->damaged = 0;
+
+    /* the timer catches up with last_frame_time when it fires */
+    c->last_frame_time = now;
+    if (c->trimmed)
+    {
+        MLOGI("damage after idling, reallocating\n");
+        c->trimmed = 0;
+        mloop_timer_set(&c->idle_timer, now + c->idle_trim_ns, 0);
+    }
+
+    render_damage(c);
+}
+
+static void on_present_complete(void *data)
+{
+    struct MClient *c = (struct MClient *)data;
+
+    if (!c->present_hold)
+    {
+        return;
+    }
+    c->present_hold = 0;
+
+    /* capture now, or as soon as the frame cap allows */
+    uint64_t now = mloop_now();
+    uint64_t earliest = c->pacer.mLastFrame + c->pacer.mInterval;
+    mloop_timer_set(&c->frame_timer, earliest > now ? earliest : now, 0);
+}
+
+static void on_screen_change(struct MClient *c, XEvent *ev)
+{
+    /*
+     * Someone changed the screen configuration.
+     *
+     * Common reasons:
+     *
+     * (1) xfsettingsd applies xrandr config on startup based
+     * on the last setting selected in Settings > Display.
+     *
+     * (2) The user changed the display settings manually.
+     */
+    XRRScreenChangeNotifyEvent *rev = (XRRScreenChangeNotifyEvent *)ev;
+    MLOGW("[t=%lu] screen size changed to %dx%d %dmmx%dmm in main evloop\n",
+          rev->timestamp,
+          rev->width, rev->height,
+          rev->mwidth, rev->mheight);
+
+    if (XRRUpdateConfiguration(ev) == 0)
+    {
+        MLOGE("error updating xrandr configuration\n");
+    }
+
+    /*
+     * Attempt to sync XDisplay and MDisplay up again if possible.
+     *
+     * If we can determine the size of the real attached display, and
+     * it doesn't match this change, it will be overriden to correctly
+     * match. Otherwise, we just accept this change.
+     */
+    if (sync_displays(c->dpy, &c->mdpy, c->xrandr_event_base,
+                      c->compositor_rotation) < 0)
+    {
+        MLOGW("failed to sync X with mdisplay, re-configuring to match new size\n");
+    }
+
+    /*
+     * Make sure our buffer sizes match up with the display size.
+     */
+    if (mcapture_resize(&c->capture) < 0)
+    {
+        MLOGC("failed to resize screen capture\n");
+        c->err = -1;
+        mloop_quit(&c->loop);
+        return;
+    }
+    if (resize_mbuffer(c->dpy, &c->mdpy, &c->root) < 0)
+    {
+        MLOGC("failed to resize mbuffer\n");
+        c->err = -1;
+        mloop_quit(&c->loop);
+        return;
+    }
+    load_copy_tuning(c);
+
+    /* the root buffer content no longer matches the screen */
+    mcapture_damage_all(&c->capture);
+    schedule_frame(c);
+}
+
+static int on_x_prepare(void *data)
+{
+    struct MClient *c = (struct MClient *)data;
+
+    /* make sure queued requests (e.g. XDamageSubtract) hit the wire */
+    XFlush(c->dpy);
+    return XEventsQueued(c->dpy, QueuedAlready) > 0;
+}
+
+static void on_x_event(void *data, uint32_t events)
+{
+    struct MClient *c = (struct MClient *)data;
+    XEvent ev;
+
+    while (!c->loop.mQuit && XPending(c->dpy))
+    {
+        XNextEvent(c->dpy, &ev);
+        if (ev.type == c->xdamage_event_base + XDamageNotify)
+        {
+#ifdef DEBUG
+            XDamageNotifyEvent *dmg = (XDamageNotifyEvent *)&ev;
+
+            MLOGD("dmg>more = %d\n", dmg->more);
+            MLOGD("dmg->area pos (%d, %d)\n", dmg->area.x, dmg->area.y);
+            MLOGD("dmg->area dims %dx%d\n", dmg->area.width, dmg->area.height);
+#endif
+
+            schedule_frame(c);
+        }
+        else if (ev.type == c->xrandr_event_base + RRScreenChangeNotify)
+        {
+            on_screen_change(c, &ev);
+        }
+        else
+        {
+            MLOGW("unknown event %d\n", ev.type);
+        }
+    }
+}
+
+static void on_mdisplay_event(void *data, uint32_t events)
+{
+    struct MClient *c = (struct MClient *)data;
+    char byte;
+
+    /*
+     * Replies are consumed synchronously by the M* calls, so the socket
+     * only becomes readable between requests when the server goes away.
+     */
+    if ((events & (EPOLLHUP | EPOLLERR)) ||
+        recv(c->m_source.mFd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT) == 0)
+    {
+        MLOGC("lost connection to mflinger\n");
+        c->err = -1;
+        mloop_quit(&c->loop);
+        return;
+    }
+
+    MLOGW("discarding unexpected data from mflinger\n");
+    recv(c->m_source.mFd, &byte, sizeof(byte), MSG_DONTWAIT);
+}
+
+static void on_frame_timestamps(struct MClient *c,
+                                const MFrameTimestampsEvent *ev)
+{
+    /* the cursor buffer posts too, only captures count */
+    if (ev->id != MBufferId(&c->root) || ev->frame > c->stats.frames ||
+        c->stats.frames - ev->frame >= FRAME_HISTORY)
+    {
+        return;
+    }
+
+    if (!ev->latched)
+    {
+        c->stats.dropped++;
+    }
+
+    uint64_t damage = c->frame_damage[ev->frame % FRAME_HISTORY];
+    mpacer_feedback(&c->pacer, damage, ev->posted, ev->latched, ev->presented);
+    MLOGD("frame %u: damage-to-photon %.1f ms, posted-to-latch %.1f ms\n",
+          ev->frame,
+          ev->presented ? (ev->presented - damage) / 1e6 : -1.0,
+          ev->latched ? (ev->latched - ev->posted) / 1e6 : -1.0);
+}
+
+static void on_idle_timer(void *data, uint32_t events)
+{
+    struct MClient *c = (struct MClient *)data;
+    uint64_t now = mloop_now();
+    uint64_t deadline = c->last_frame_time + c->idle_trim_ns;
+
+    /* a frame is coming up, unless the display is off */
+    if (c->damaged && !c->suspended)
+    {
+        deadline = now + c->idle_trim_ns;
+    }
+
+    /* frames since arming just push the deadline out */
+    if (now < deadline)
+    {
+        mloop_timer_set(&c->idle_timer, deadline, 0);
+        return;
+    }
+
+    MLOGI("idle for %llus, giving back capture memory\n",
+          (unsigned long long)(c->idle_trim_ns / 1000000000ull));
+    mcapture_trim(&c->capture);
+    if (MTrimBuffer(&c->mdpy, &c->root) < 0)
+    {
+        MLOGW("could not trim the root buffer\n");
+    }
+    c->trimmed = 1;
+}
+
+static void on_governor_timer(void *data, uint32_t events)
+{
+    struct MClient *c = (struct MClient *)data;
+    struct MGovernorSample sample;
+    uint32_t fps = c->governor.mFps;
+
+    if (mgovernor_sample(&c->governor, mloop_now(), c->stats.frames, &sample) < 0)
+    {
+        return;
+    }
+
+    if (mgovernor_update(&c->governor, &sample) != fps)
+    {
+        MLOGI("governor: %u -> %u fps (%s)\n", fps, c->governor.mFps,
+              mgovernor_reason(c->governor.mReason));
+        mpacer_set_max_fps(&c->pacer, c->governor.mFps);
+    }
+}
+
+static void on_hud_timer(void *data, uint32_t events)
+{
+    struct MClient *c = (struct MClient *)data;
+    const struct MClientStats *now = &c->stats, *last = &c->hud_last;
+    char text[MHUD_LINES * (MHUD_COLUMNS + 1)];
+
+    /* nobody is looking, the next update covers the whole period */
+    if (c->suspended)
+    {
+        return;
+    }
+
+    uint64_t t = mloop_now();
+    double secs = (t - c->hud_last_time) / 1e9;
+    uint64_t frames = now->frames - last->frames;
+    uint64_t copy_ns = now->copy_ns - last->copy_ns;
+
+    snprintf(text, sizeof(text),
+             "FPS %.1f  DROP %llu\n"
+             "GRAB %.2f COPY %.2f MS\n"
+             "POST %.2f LAT %.1f MS\n"
+             "INTERVAL %.1f MS\n"
+             "COPY %.2f GB/S %s X%d\n"
+             "CURSOR %.0f/S",
+             frames / secs,
+             (unsigned long long)(now->dropped - last->dropped),
+             per_frame_ms(now->grab_ns - last->grab_ns, frames),
+             per_frame_ms(copy_ns, frames),
+             per_frame_ms(now->post_ns - last->post_ns, frames),
+             c->pacer.mLatency / 1e6,
+             c->pacer.mInterval / 1e6,
+             copy_ns ? (double)(now->copy_bytes - last->copy_bytes) / copy_ns : 0.0,
+             c->copy.mKernel->name, c->copy.mThreads,
+             (mcursor_updates(&c->mcursor) - c->hud_last_cursor) / secs);
+
+    mhud_show(&c->hud, text);
+
+    c->hud_last = *now;
+    c->hud_last_cursor = mcursor_updates(&c->mcursor);
+    c->hud_last_time = t;
+}
+
+static void on_mdisplay_notify(void *data, uint32_t events)
+{
+    struct MClient *c = (struct MClient *)data;
+    MEvent ev;
+    int n;
+
+    while ((n = MNextEvent(&c->mdpy, &ev)) > 0)
+    {
+        if (ev.type == M_EVENT_FRAME_TIMESTAMPS)
+        {
+            on_frame_timestamps(c, &ev.frame_timestamps);
+            continue;
+        }
+
+        if (ev.type != M_EVENT_DISPLAY_STATE ||
+            c->suspended == !ev.display_state.visible)
+        {
+            continue;
+        }
+
+        c->suspended = !ev.display_state.visible;
+        MLOGI("display %s, %s capture\n",
+              c->suspended ? "hidden" : "visible",
+              c->suspended ? "suspending" : "resuming");
+
+        /* catch up on everything that changed in one frame */
+        if (!c->suspended && c->damaged)
+        {
+            schedule_frame(c);
+        }
+    }
+
+    if (n < 0)
+    {
+        /* keep capturing rather than risk never resuming */
+        mloop_remove_source(&c->loop, &c->m_event_source);
+        c->m_event_source.mFd = -1;
+        c->suspended = 0;
+        schedule_frame(c);
+    }
+}
+
+static int add_sources(struct MClient *c)
+{
+    c->x_source.mFd = ConnectionNumber(c->dpy);
+    c->x_source.mEvents = EPOLLIN;
+    c->x_source.mCallback = on_x_event;
+    c->x_source.mPrepare = on_x_prepare;
+    c->x_source.mData = c;
+    if (mloop_add_source(&c->loop, &c->x_source) < 0)
+    {
+        return -1;
+    }
+
+    c->m_source.mFd = MConnectionNumber(&c->mdpy);
+    c->m_source.mEvents = EPOLLIN;
+    c->m_source.mCallback = on_mdisplay_event;
+    c->m_source.mData = c;
+    if (mloop_add_source(&c->loop, &c->m_source) < 0)
+    {
+        return -1;
+    }
+
+    c->m_event_source.mFd = -1;
+    if (MSelectEvents(&c->mdpy,
+                      M_EVENT_DISPLAY_STATE | M_EVENT_FRAME_TIMESTAMPS) < 0)
+    {
+        MLOGW("no display state events, capturing while the display is off\n");
+    }
+    else
+    {
+        c->m_event_source.mFd = MEventConnectionNumber(&c->mdpy);
+        c->m_event_source.mEvents = EPOLLIN;
+        c->m_event_source.mCallback = on_mdisplay_notify;
+        c->m_event_source.mData = c;
+        if (mloop_add_source(&c->loop, &c->m_event_source) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (mloop_timer_init(&c->loop, &c->frame_timer, on_frame, c) < 0)
+    {
+        return -1;
+    }
+
+    if (c->hud_on)
+    {
+        c->hud_last_time = mloop_now();
+        if (mloop_timer_init(&c->loop, &c->hud_timer, on_hud_timer, c) < 0 ||
+            mloop_timer_set(&c->hud_timer, c->hud_last_time + HUD_INTERVAL_NS,
+                            HUD_INTERVAL_NS) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (c->governed)
+    {
+        uint64_t now = mloop_now();
+        struct MGovernorSample sample;
+
+        /* the first sample is the baseline */
+        mgovernor_sample(&c->governor, now, c->stats.frames, &sample);
+        if (mloop_timer_init(&c->loop, &c->governor_timer, on_governor_timer, c) < 0 ||
+            mloop_timer_set(&c->governor_timer, now + MGOVERNOR_INTERVAL_NS,
+                            MGOVERNOR_INTERVAL_NS) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (c->idle_trim_ns > 0)
+    {
+        c->last_frame_time = mloop_now();
+        if (mloop_timer_init(&c->loop, &c->idle_timer, on_idle_timer, c) < 0 ||
+            mloop_timer_set(&c->idle_timer,
+                            c->last_frame_time + c->idle_trim_ns, 0) < 0)
+        {
+            return -1;
+        }
+    }
+
+    mloop_set_wake_callback(&c->loop, on_wake, c);
+    return install_signal_handlers(&c->loop);
+}
+
+int main(int argc, char **argv)
+{
+    static struct MClient client;
+    struct MClient *c = &client;
+    struct MConfig config;
+    Display *dpy;
     int err = 0;
 
-    /* TODO Ctrl-C handler to cleanup shm */
+    err = mconfig_parse(&config, argc, argv);
+    if (err != 0)
+    {
+        return err < 0 ? -1 : 0;
+    }
+
+    /* before any helper thread exists, so they all inherit it */
+    if (config.capture_sched_set && msched_apply(&config.capture_sched) < 0)
+    {
+        MLOGW("capture thread scheduling policy not fully applied\n");
+    }
 
     /* must be first Xlib call for multi-threaded programs */
     if (!XInitThreads())
@@ -509,6 +1276,7 @@ int main(void)
         MLOGE("error calling XOpenDisplay\n");
         return -1;
     }
+    c->dpy = dpy;
 
     //
     // check for necessary eXtensions
@@ -520,16 +1288,15 @@ int main(void)
         return -1;
     }
 
-    int xdamage_event_base, error;
-    if (!XDamageQueryExtension(dpy, &xdamage_event_base, &error))
+    int error;
+    if (!XDamageQueryExtension(dpy, &c->xdamage_event_base, &error))
     {
         MLOGE("XDamage extension unavailable!\n");
         XCloseDisplay(dpy);
         return -1;
     }
 
-    int xrandr_event_base;
-    if (!XRRQueryExtension(dpy, &xrandr_event_base, &error))
+    if (!XRRQueryExtension(dpy, &c->xrandr_event_base, &error))
     {
         MLOGE("Xrandr extension unavailable!\n");
         XCloseDisplay(dpy);
@@ -537,12 +1304,21 @@ int main(void)
     }
 
     /* connect to pionux display server */
-    if (MOpenDisplay(&mdpy) < 0)
+    if (MOpenDisplayWithFlags(&c->mdpy, config.display_flags) < 0)
+    {
+        MLOGE("error calling MOpenDisplayWithFlags\n");
+        XCloseDisplay(dpy);
+        return -1;
+    }
+
+    if (mloop_init(&c->loop) < 0)
     {
-        MLOGE("error calling MOpenDisplay\n");
+        MLOGE("error creating event loop\n");
+        MCloseDisplay(&c->mdpy);
         XCloseDisplay(dpy);
         return -1;
     }
+    mpacer_init(&c->pacer, config.max_fps);
 
     if (XSetErrorHandler(x_error_handler) < 0)
     {
@@ -556,7 +1332,9 @@ int main(void)
           XDisplayWidthMM(dpy, screen), XDisplayHeightMM(dpy, screen));
 
     XRRSelectInput(dpy, DefaultRootWindow(dpy), RRScreenChangeNotifyMask);
-    if (sync_displays(dpy, &mdpy, xrandr_event_base) < 0)
+    c->compositor_rotation = config.compositor_rotation;
+    if (sync_displays(dpy, &c->mdpy, c->xrandr_event_base,
+                      c->compositor_rotation) < 0)
     {
         MLOGW("couldn't sync resolution, using default mode\n");
     }
@@ -564,120 +1342,131 @@ int main(void)
     //
     // Create necessary buffers
     //
-    MBuffer root = {0};
-    root.width = XDisplayWidth(dpy, screen);
-    root.height = XDisplayHeight(dpy, screen);
-    if (MCreateBuffer(&mdpy, &root) < 0)
+    // Sized for the largest mode up front, so mode switches only
+    // adjust the visible area and never reallocate.
+    //
+    uint32_t max_width, max_height;
+    x_max_mode_size(dpy, &max_width, &max_height);
+    MLOGI("allocating for screen sizes up to %dx%d\n", max_width, max_height);
+
+    c->root.width = XDisplayWidth(dpy, screen);
+    c->root.height = XDisplayHeight(dpy, screen);
+    if (MCreateBufferWithMaxSize(&c->mdpy, &c->root,
+                                 max_width, max_height) < 0)
     {
         MLOGE("error creating root buffer\n");
         err = -1;
         goto cleanup_1;
     }
 
-    struct MCursor mcursor = {0};
-    if (mcursor_init(&mcursor, dpy, &mdpy) < 0)
+    if (config.buffer_count != M_BUFFER_COUNT_DEFAULT)
+    {
+        /* not fatal, the compositor default still works */
+        if (MSetBufferCount(&c->mdpy, &c->root, config.buffer_count,
+                            &c->buffer_count) < 0)
+        {
+            MLOGW("could not set %u root buffers\n", config.buffer_count);
+        }
+        else
+        {
+            MLOGI("root surface uses %u buffers\n", c->buffer_count);
+        }
+    }
+
+    if (mcursor_init(&c->mcursor, config.display_flags,
+                     config.cursor_sched_set ? &config.cursor_sched : NULL) < 0)
     {
         MLOGE("error creating cursor client\n");
         err = -1;
         goto cleanup_1;
     }
 
-    /* set up XShm */
-    XShmSegmentInfo shminfo;
-    XImage *ximg = xshm_init(dpy, &shminfo, screen);
-    if (ximg == NULL)
+    c->idle_trim_ns = config.idle_trim * 1000000000ull;
+    mbudget_init(&c->budget, config.frame_budget_bytes, config.frame_budget_ns);
+    c->governed = config.min_fps != 0;
+    mgovernor_init(&c->governor, config.min_fps, config.max_fps);
+
+    /* created last so it stacks on top of the cursor */
+    c->hud_on = config.hud;
+    if (c->hud_on && mhud_init(&c->hud, &c->mdpy, HUD_X, HUD_Y) < 0)
     {
-        MLOGC("failed to create xshm\n");
-        err = -1;
-        goto cleanup_1;
+        MLOGW("performance HUD unavailable\n");
+        c->hud_on = 0;
     }
 
     /* report a single damage event if the damage region is non-empty */
-    Damage damage = XDamageCreate(dpy, DefaultRootWindow(dpy),
-                                  XDamageReportNonEmpty);
+    c->damage = XDamageCreate(dpy, DefaultRootWindow(dpy),
+                              XDamageReportNonEmpty);
 
-    XEvent ev;
-    do
+    if (mcapture_init(&c->capture, dpy, c->damage, config.capture_backend,
+                      max_width, max_height) < 0)
     {
-        XNextEvent(dpy, &ev);
-        if (ev.type == xdamage_event_base + XDamageNotify)
-        {
-            XDamageNotifyEvent *dmg = (XDamageNotifyEvent *)&ev;
+        MLOGC("failed to set up screen capture\n");
+        err = -1;
+        goto cleanup_2;
+    }
 
-            /*
-             * clear out all the damage first so we
-             * don't miss a DamageNotify while rendering
-             */
-            XDamageSubtract(dpy, dmg->damage, None, None);
+    mcopy_init(&c->copy);
+    c->capture.mCopy = &c->copy;
+    c->force_tune = config.tune;
+    load_copy_tuning(c);
 
-            MLOGD("dmg>more = %d\n", dmg->more);
-            MLOGD("dmg->area pos (%d, %d)\n", dmg->area.x, dmg->area.y);
-            MLOGD("dmg->area dims %dx%d\n", dmg->area.width, dmg->area.height);
+    c->present_sync = config.present_sync;
+    if (c->present_sync &&
+        mpresent_init(&c->present, &c->loop, on_present_complete, c) < 0)
+    {
+        MLOGW("Present unavailable, capturing on damage only\n");
+        c->present_sync = 0;
+    }
 
-            /* TODO opt: only render damaged areas */
-            render_root(dpy, &mdpy, &root, ximg);
-        }
-        else if (ev.type == xrandr_event_base + RRScreenChangeNotify)
-        {
-            /*
-             * Someone changed the screen configuration.
-             *
-             * Common reasons:
-             *
-             * (1) xfsettingsd applies xrandr config on startup based
-             * on the last setting selected in Settings > Display.
-             *
-             * (2) The user changed the display settings manually.
-             */
-            XRRScreenChangeNotifyEvent *rev = (XRRScreenChangeNotifyEvent *)&ev;
-            MLOGW("[t=%lu] screen size changed to %dx%d %dmmx%dmm in main evloop\n",
-                  rev->timestamp,
-                  rev->width, rev->height,
-                  rev->mwidth, rev->mheight);
-
-            if (XRRUpdateConfiguration(&ev) == 0)
-            {
-                MLOGE("error updating xrandr configuration\n");
-            }
+    if (config.fanout &&
+        (mfanout_init(&c->fanout, max_width, max_height) < 0 ||
+         mfanout_listen(&c->fanout, &c->loop, M_FRAMES_SOCK_PATH) < 0))
+    {
+        MLOGW("frame fan-out unavailable\n");
+        mfanout_destroy(&c->fanout, &c->loop);
+    }
 
-            /*
-             * Attempt to sync XDisplay and MDisplay up again if possible.
-             *
-             * If we can determine the size of the real attached display, and
-             * it doesn't match this change, it will be overriden to correctly
-             * match. Otherwise, we just accept this change.
-             */
-            if (sync_displays(dpy, &mdpy, xrandr_event_base) < 0)
-            {
-                MLOGW("failed to sync X with mdisplay, re-configuring to match new size\n");
-            }
+    if (config.heatmap != NULL &&
+        mheatmap_init(&c->heatmap, max_width, max_height) == 0)
+    {
+        c->heatmap_prefix = config.heatmap;
+    }
 
-            /*
-             * Make sure our buffer sizes match up with the display size.
-             */
-            if (resize_shm(dpy, ximg, &shminfo) < 0)
-            {
-                MLOGC("failed to resize shm\n");
-                break;
-            }
-            if (resize_mbuffer(dpy, &mdpy, &root) < 0)
-            {
-                MLOGC("failed to resize mbuffer\n");
-                break;
-            }
-        }
-        else
+    if (add_sources(c) < 0)
+    {
+        MLOGC("failed to set up event loop\n");
+        err = -1;
+    }
+    else
+    {
+        /* fill the buffer right away instead of waiting for damage */
+        schedule_frame(c);
+
+        if (mloop_run(&c->loop) < 0 || c->err < 0)
         {
-            mcursor_on_event(&mcursor, &ev);
+            err = -1;
         }
-    } while (1);
+    }
+
+    if (c->heatmap_prefix != NULL)
+    {
+        mheatmap_write(&c->heatmap, c->heatmap_prefix);
+        mheatmap_destroy(&c->heatmap);
+    }
+    mfanout_destroy(&c->fanout, &c->loop);
+    mpresent_destroy(&c->present, &c->loop);
+    mcapture_destroy(&c->capture);
+    mcopy_destroy(&c->copy);
 
-    XDamageDestroy(dpy, damage);
-    xshm_cleanup(dpy, &shminfo, ximg);
+cleanup_2:
+    XDamageDestroy(dpy, c->damage);
+    mcursor_destroy(&c->mcursor);
 
 cleanup_1:
     cursor_cache_free();
-    MCloseDisplay(&mdpy);
+    mloop_destroy(&c->loop);
+    MCloseDisplay(&c->mdpy);
     XCloseDisplay(dpy);
 
     return err;
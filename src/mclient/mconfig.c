@@ -0,0 +1,260 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "mconfig.h"
+#include "mbudget.h"
+#include "mlib.h"
+#include "mlog.h"
+
+enum
+{
+    OPT_MAX_FPS = 256,
+    OPT_CAPTURE,
+    OPT_PRESENT_SYNC,
+    OPT_SEQPACKET,
+    OPT_URING,
+    OPT_FANOUT,
+    OPT_TUNE,
+    OPT_CAPTURE_SCHED,
+    OPT_CURSOR_SCHED,
+    OPT_HUD,
+    OPT_HEATMAP,
+    OPT_LATENCY,
+    OPT_IDLE_TRIM,
+    OPT_FRAME_BUDGET,
+    OPT_MIN_FPS,
+    OPT_COMPOSITOR_ROTATION,
+};
+
+static const struct option long_options[] = {
+    {"max-fps", required_argument, NULL, OPT_MAX_FPS},
+    {"capture", required_argument, NULL, OPT_CAPTURE},
+    {"present-sync", no_argument, NULL, OPT_PRESENT_SYNC},
+    {"seqpacket", no_argument, NULL, OPT_SEQPACKET},
+    {"uring", no_argument, NULL, OPT_URING},
+    {"fanout", no_argument, NULL, OPT_FANOUT},
+    {"tune", no_argument, NULL, OPT_TUNE},
+    {"capture-sched", required_argument, NULL, OPT_CAPTURE_SCHED},
+    {"cursor-sched", required_argument, NULL, OPT_CURSOR_SCHED},
+    {"hud", no_argument, NULL, OPT_HUD},
+    {"heatmap", required_argument, NULL, OPT_HEATMAP},
+    {"latency", required_argument, NULL, OPT_LATENCY},
+    {"idle-trim", required_argument, NULL, OPT_IDLE_TRIM},
+    {"frame-budget", required_argument, NULL, OPT_FRAME_BUDGET},
+    {"min-fps", required_argument, NULL, OPT_MIN_FPS},
+    {"compositor-rotation", no_argument, NULL, OPT_COMPOSITOR_ROTATION},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0},
+};
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "\n"
+            "  --max-fps=N        cap captured frames per second (default %d, 0 = uncapped)\n"
+            "  --min-fps=N        let the cap drop as low as N fps when CPU time per\n"
+            "                     frame, system load or temperature run high\n"
+            "  --capture=BACKEND  screen capture backend: xcb, pixmap, xlib (default %s)\n"
+            "  --present-sync     time captures to X Present completions to avoid tearing\n"
+            "  --seqpacket        talk to mflinger over SOCK_SEQPACKET\n"
+            "  --uring            submit buffer lock/unlock traffic through io_uring\n"
+            "  --fanout           share captured frames with local consumers (see mframes.h),\n"
+            "                     i.e. with any process running as the same user\n"
+            "  --tune             re-time the copy strategies instead of using cached results\n"
+            "  --capture-sched=POLICY[:VALUE][@CPUS]\n"
+            "                     scheduling of the capture thread: other:NICE, fifo:PRIO or\n"
+            "                     rr:PRIO, optionally pinned to CPUS (e.g. fifo:10@2,3)\n"
+            "  --cursor-sched=POLICY[:VALUE][@CPUS]\n"
+            "                     scheduling of the cursor thread, as --capture-sched\n"
+            "  --hud              overlay live fps, latencies and copy bandwidth\n"
+            "  --heatmap=PREFIX   record damage to PREFIX.pgm and PREFIX.csv on exit\n"
+            "                     and on SIGUSR2\n"
+            "  --latency=MODE     surface buffering: interactive (double buffered),\n"
+            "                     media (triple buffered) or a buffer count\n"
+            "  --idle-trim=SECS   free capture memory and spare buffers after SECS\n"
+            "                     without damage (default 0 = never)\n"
+            "  --frame-budget=N   upload at most N bytes (K and M suffixes) or Nms of\n"
+            "                     grab and copy per frame, large damage is finished\n"
+            "                     over the next frames, nearest the pointer first\n"
+            "  --compositor-rotation\n"
+            "                     on a rotated display, keep the X screen in the\n"
+            "                     display's natural orientation and have mflinger\n"
+            "                     turn it, instead of matching the rotated size\n"
+            "  -h, --help         show this help\n",
+            argv0, DEFAULT_MAX_FPS, DEFAULT_CAPTURE_BACKEND);
+}
+
+static int parse_uint(const char *arg, uint32_t *out)
+{
+    char *end;
+    unsigned long val = strtoul(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0')
+    {
+        return -1;
+    }
+
+    *out = val;
+    return 0;
+}
+
+static int parse_latency(const char *arg, uint32_t *count)
+{
+    if (strcmp(arg, "interactive") == 0)
+    {
+        *count = M_BUFFER_COUNT_LOW_LATENCY;
+        return 0;
+    }
+    if (strcmp(arg, "media") == 0)
+    {
+        *count = M_BUFFER_COUNT_THROUGHPUT;
+        return 0;
+    }
+
+    return parse_uint(arg, count);
+}
+
+int mconfig_parse(struct MConfig *config, int argc, char **argv)
+{
+    memset(config, 0, sizeof(*config));
+    config->max_fps = DEFAULT_MAX_FPS;
+    config->capture_backend = DEFAULT_CAPTURE_BACKEND;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case OPT_MAX_FPS:
+            if (parse_uint(optarg, &config->max_fps) < 0)
+            {
+                MLOGE("invalid --max-fps: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_CAPTURE:
+            config->capture_backend = optarg;
+            break;
+
+        case OPT_PRESENT_SYNC:
+            config->present_sync = 1;
+            break;
+
+        case OPT_SEQPACKET:
+            config->display_flags |= M_DISPLAY_SEQPACKET;
+            break;
+
+        case OPT_URING:
+            config->display_flags |= M_DISPLAY_URING;
+            break;
+
+        case OPT_FANOUT:
+            config->fanout = 1;
+            break;
+
+        case OPT_TUNE:
+            config->tune = 1;
+            break;
+
+        case OPT_CAPTURE_SCHED:
+            if (msched_parse(optarg, &config->capture_sched) < 0)
+            {
+                MLOGE("invalid --capture-sched: %s\n", optarg);
+                return -1;
+            }
+            config->capture_sched_set = 1;
+            break;
+
+        case OPT_CURSOR_SCHED:
+            if (msched_parse(optarg, &config->cursor_sched) < 0)
+            {
+                MLOGE("invalid --cursor-sched: %s\n", optarg);
+                return -1;
+            }
+            config->cursor_sched_set = 1;
+            break;
+
+        case OPT_HUD:
+            config->hud = 1;
+            break;
+
+        case OPT_HEATMAP:
+            config->heatmap = optarg;
+            break;
+
+        case OPT_LATENCY:
+            if (parse_latency(optarg, &config->buffer_count) < 0)
+            {
+                MLOGE("invalid --latency: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_IDLE_TRIM:
+            if (parse_uint(optarg, &config->idle_trim) < 0)
+            {
+                MLOGE("invalid --idle-trim: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_FRAME_BUDGET:
+            if (mbudget_parse(optarg, &config->frame_budget_bytes,
+                              &config->frame_budget_ns) < 0)
+            {
+                MLOGE("invalid --frame-budget: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_MIN_FPS:
+            if (parse_uint(optarg, &config->min_fps) < 0)
+            {
+                MLOGE("invalid --min-fps: %s\n", optarg);
+                return -1;
+            }
+            break;
+
+        case OPT_COMPOSITOR_ROTATION:
+            config->compositor_rotation = 1;
+            break;
+
+        case 'h':
+            usage(argv[0]);
+            return 1;
+
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (config->min_fps != 0 &&
+        (config->max_fps == 0 || config->min_fps > config->max_fps))
+    {
+        MLOGE("--min-fps needs a --max-fps at least as high\n");
+        return -1;
+    }
+
+    return 0;
+}
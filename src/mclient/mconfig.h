@@ -0,0 +1,59 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_CONFIG_H
+#define M_CONFIG_H
+
+#include <stdint.h>
+
+#include "msched.h"
+
+#define DEFAULT_MAX_FPS (60)
+#define DEFAULT_CAPTURE_BACKEND "xcb"
+
+struct MConfig
+{
+    uint32_t max_fps;            /* upper bound on captured frames per second */
+    uint32_t min_fps;            /* governor floor, 0 = fixed cap at max_fps */
+    const char *capture_backend; /* preferred mcapture backend name */
+    int present_sync;            /* time captures to X Present completions */
+    int compositor_rotation;     /* keep X unrotated, mflinger turns the surfaces */
+    uint32_t display_flags;      /* M_DISPLAY_* flags for MOpenDisplayWithFlags() */
+    int fanout;                  /* publish frames to other local consumers */
+    int tune;                    /* re-run the copy calibration, ignoring the cache */
+    int hud;                     /* show the performance overlay */
+    const char *heatmap;         /* damage heatmap output prefix, NULL = off */
+    uint32_t buffer_count;       /* surface buffer count, M_BUFFER_COUNT_DEFAULT = as is */
+    uint32_t idle_trim;          /* seconds without damage before freeing memory, 0 = never */
+    uint64_t frame_budget_bytes; /* upload budget per frame, 0 = unlimited */
+    uint64_t frame_budget_ns;    /* upload time budget per frame, 0 = unlimited */
+    int capture_sched_set;       /* apply capture_sched, otherwise leave as is */
+    int cursor_sched_set;        /* apply cursor_sched, otherwise inherit */
+
+    /* capture thread, inherited by the copy workers */
+    struct MSchedPolicy capture_sched;
+    struct MSchedPolicy cursor_sched;
+};
+
+/**
+ * Fill @param config from the command line.
+ * @return 0 on success, 1 if the caller should exit (e.g. --help),
+ * -1 on a bad option
+ */
+int mconfig_parse(struct MConfig *config, int argc, char **argv);
+
+#endif // M_CONFIG_H
@@ -0,0 +1,570 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "mcopy.h"
+#include "mloop.h"
+#include "mlog.h"
+
+/* best of this many timed copies per candidate */
+#define TUNE_RUNS (3)
+
+#define TUNING_FILE "mclient/copy-tuning"
+
+//
+// Kernels
+//
+static void copy_memcpy(uint8_t *dst, size_t dst_stride,
+                        const uint8_t *src, size_t src_stride,
+                        size_t row_bytes, uint32_t rows)
+{
+    /* full-width rectangles are one contiguous block */
+    if (dst_stride == row_bytes && src_stride == row_bytes)
+    {
+        memcpy(dst, src, row_bytes * rows);
+        return;
+    }
+
+    uint32_t y;
+    for (y = 0; y < rows; ++y)
+    {
+        memcpy(dst, src, row_bytes);
+        src += src_stride;
+        dst += dst_stride;
+    }
+}
+
+#if defined(__SSE2__)
+static void copy_sse2(uint8_t *dst, size_t dst_stride,
+                      const uint8_t *src, size_t src_stride,
+                      size_t row_bytes, uint32_t rows)
+{
+    uint32_t y;
+    for (y = 0; y < rows; ++y)
+    {
+        const uint8_t *s = src + y * src_stride;
+        uint8_t *d = dst + y * dst_stride;
+        size_t i;
+        for (i = 0; i + 64 <= row_bytes; i += 64)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *)(s + i + 32));
+            __m128i e = _mm_loadu_si128((const __m128i *)(s + i + 48));
+            _mm_storeu_si128((__m128i *)(d + i), a);
+            _mm_storeu_si128((__m128i *)(d + i + 16), b);
+            _mm_storeu_si128((__m128i *)(d + i + 32), c);
+            _mm_storeu_si128((__m128i *)(d + i + 48), e);
+        }
+        memcpy(d + i, s + i, row_bytes - i);
+    }
+}
+
+/*
+ * Non-temporal stores bypass the cache, which pays off when the
+ * destination is write-combined or uncached memory nobody reads back.
+ */
+static void copy_stream(uint8_t *dst, size_t dst_stride,
+                        const uint8_t *src, size_t src_stride,
+                        size_t row_bytes, uint32_t rows)
+{
+    uint32_t y;
+    for (y = 0; y < rows; ++y)
+    {
+        const uint8_t *s = src + y * src_stride;
+        uint8_t *d = dst + y * dst_stride;
+
+        /* streaming stores need an aligned destination */
+        size_t i = (16 - ((uintptr_t)d & 15)) & 15;
+        if (i > row_bytes)
+        {
+            i = row_bytes;
+        }
+        memcpy(d, s, i);
+
+        for (; i + 64 <= row_bytes; i += 64)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 16));
+            __m128i c = _mm_loadu_si128((const __m128i *)(s + i + 32));
+            __m128i e = _mm_loadu_si128((const __m128i *)(s + i + 48));
+            _mm_stream_si128((__m128i *)(d + i), a);
+            _mm_stream_si128((__m128i *)(d + i + 16), b);
+            _mm_stream_si128((__m128i *)(d + i + 32), c);
+            _mm_stream_si128((__m128i *)(d + i + 48), e);
+        }
+        memcpy(d + i, s + i, row_bytes - i);
+    }
+
+    /* order the streaming stores before whatever posts the buffer */
+    _mm_sfence();
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void copy_neon(uint8_t *dst, size_t dst_stride,
+                      const uint8_t *src, size_t src_stride,
+                      size_t row_bytes, uint32_t rows)
+{
+    uint32_t y;
+    for (y = 0; y < rows; ++y)
+    {
+        const uint8_t *s = src + y * src_stride;
+        uint8_t *d = dst + y * dst_stride;
+        size_t i;
+        for (i = 0; i + 64 <= row_bytes; i += 64)
+        {
+            uint8x16_t a = vld1q_u8(s + i);
+            uint8x16_t b = vld1q_u8(s + i + 16);
+            uint8x16_t c = vld1q_u8(s + i + 32);
+            uint8x16_t e = vld1q_u8(s + i + 48);
+            vst1q_u8(d + i, a);
+            vst1q_u8(d + i + 16, b);
+            vst1q_u8(d + i + 32, c);
+            vst1q_u8(d + i + 48, e);
+        }
+        memcpy(d + i, s + i, row_bytes - i);
+    }
+}
+#endif
+
+const struct MCopyKernel mcopy_kernels[] = {
+    {"memcpy", copy_memcpy},
+#if defined(__SSE2__)
+    {"sse2", copy_sse2},
+    {"stream", copy_stream},
+#endif
+#if defined(__ARM_NEON)
+    {"neon", copy_neon},
+#endif
+};
+const int mcopy_num_kernels = sizeof(mcopy_kernels) / sizeof(mcopy_kernels[0]);
+
+const struct MCopyKernel *mcopy_find_kernel(const char *name)
+{
+    int i;
+    for (i = 0; i < mcopy_num_kernels; ++i)
+    {
+        if (strcmp(mcopy_kernels[i].name, name) == 0)
+        {
+            return &mcopy_kernels[i];
+        }
+    }
+    return NULL;
+}
+
+//
+// Striped copies
+//
+static void copy_stripe(struct MCopy *this, int index)
+{
+    uint32_t per = (this->mRows + this->mThreads - 1) / this->mThreads;
+    uint32_t first = index * per;
+    if (first >= this->mRows)
+    {
+        return;
+    }
+
+    uint32_t rows = this->mRows - first < per ? this->mRows - first : per;
+    this->mKernel->copy(this->mDst + first * this->mDstStride,
+                        this->mDstStride,
+                        this->mSrc + first * this->mSrcStride,
+                        this->mSrcStride,
+                        this->mRowBytes, rows);
+}
+
+static void *worker_main(void *data)
+{
+    struct MCopyWorker *worker = (struct MCopyWorker *)data;
+    struct MCopy *this = worker->mCopy;
+
+    pthread_mutex_lock(&this->mLock);
+    for (;;)
+    {
+        while (!this->mQuit && this->mGeneration == worker->mSeen)
+        {
+            pthread_cond_wait(&this->mStart, &this->mLock);
+        }
+        if (this->mQuit)
+        {
+            break;
+        }
+        worker->mSeen = this->mGeneration;
+
+        /* workers past the current thread count sit this one out */
+        if (worker->mIndex < this->mThreads)
+        {
+            pthread_mutex_unlock(&this->mLock);
+            copy_stripe(this, worker->mIndex);
+            pthread_mutex_lock(&this->mLock);
+
+            if (--this->mPending == 0)
+            {
+                pthread_cond_signal(&this->mDone);
+            }
+        }
+    }
+    pthread_mutex_unlock(&this->mLock);
+
+    return NULL;
+}
+
+int mcopy_init(struct MCopy *this)
+{
+    memset(this, 0, sizeof(*this));
+    this->mKernel = &mcopy_kernels[0];
+    this->mThreads = 1;
+
+    pthread_mutex_init(&this->mLock, NULL);
+    pthread_cond_init(&this->mStart, NULL);
+    pthread_cond_init(&this->mDone, NULL);
+    return 0;
+}
+
+void mcopy_destroy(struct MCopy *this)
+{
+    int i;
+
+    pthread_mutex_lock(&this->mLock);
+    this->mQuit = 1;
+    pthread_cond_broadcast(&this->mStart);
+    pthread_mutex_unlock(&this->mLock);
+
+    for (i = 0; i < this->mNumWorkers; ++i)
+    {
+        pthread_join(this->mWorkers[i].mThread, NULL);
+    }
+    this->mNumWorkers = 0;
+
+    pthread_cond_destroy(&this->mDone);
+    pthread_cond_destroy(&this->mStart);
+    pthread_mutex_destroy(&this->mLock);
+}
+
+int mcopy_set(struct MCopy *this, const char *kernel, int threads)
+{
+    const struct MCopyKernel *k = mcopy_find_kernel(kernel);
+    if (k == NULL || threads < 1 || threads > MCOPY_MAX_THREADS)
+    {
+        return -1;
+    }
+
+    /* stripe 0 is copied by the caller */
+    while (this->mNumWorkers < threads - 1)
+    {
+        struct MCopyWorker *w = &this->mWorkers[this->mNumWorkers];
+        w->mCopy = this;
+        w->mIndex = this->mNumWorkers + 1;
+        /* a job may be posted before the thread gets to run */
+        w->mSeen = this->mGeneration;
+        int err = pthread_create(&w->mThread, NULL, worker_main, w);
+        if (err != 0)
+        {
+            MLOGE("error starting copy thread: %s\n", strerror(err));
+            return -1;
+        }
+        this->mNumWorkers++;
+    }
+
+    /* no job is running, workers only look at these during one */
+    this->mKernel = k;
+    this->mThreads = threads;
+    return 0;
+}
+
+void mcopy_rows(struct MCopy *this,
+                uint8_t *dst, size_t dst_stride,
+                const uint8_t *src, size_t src_stride,
+                size_t row_bytes, uint32_t rows)
+{
+    if (this->mThreads < 2 || rows < (uint32_t)this->mThreads ||
+        row_bytes * rows < MCOPY_MT_MIN_BYTES)
+    {
+        this->mKernel->copy(dst, dst_stride, src, src_stride, row_bytes, rows);
+        return;
+    }
+
+    pthread_mutex_lock(&this->mLock);
+    this->mDst = dst;
+    this->mDstStride = dst_stride;
+    this->mSrc = src;
+    this->mSrcStride = src_stride;
+    this->mRowBytes = row_bytes;
+    this->mRows = rows;
+    this->mPending = this->mThreads - 1;
+    this->mGeneration++;
+    pthread_cond_broadcast(&this->mStart);
+    pthread_mutex_unlock(&this->mLock);
+
+    copy_stripe(this, 0);
+
+    pthread_mutex_lock(&this->mLock);
+    while (this->mPending > 0)
+    {
+        pthread_cond_wait(&this->mDone, &this->mLock);
+    }
+    pthread_mutex_unlock(&this->mLock);
+}
+
+void mcopy_tune(struct MCopy *this,
+                uint8_t *dst, size_t dst_stride,
+                const uint8_t *src, size_t src_stride,
+                size_t row_bytes, uint32_t rows)
+{
+    const struct MCopyKernel *best = this->mKernel;
+    int best_threads = this->mThreads;
+    uint64_t best_ns = UINT64_MAX;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, threads, run;
+
+    for (i = 0; i < mcopy_num_kernels; ++i)
+    {
+        for (threads = 1; threads <= MCOPY_MAX_THREADS && threads <= cpus;
+             threads *= 2)
+        {
+            if (mcopy_set(this, mcopy_kernels[i].name, threads) < 0)
+            {
+                continue;
+            }
+
+            uint64_t ns = UINT64_MAX;
+            for (run = 0; run < TUNE_RUNS; ++run)
+            {
+                uint64_t start = mloop_now();
+                mcopy_rows(this, dst, dst_stride, src, src_stride,
+                           row_bytes, rows);
+                uint64_t t = mloop_now() - start;
+                ns = t < ns ? t : ns;
+            }
+
+            MLOGD("copy %s x%d: %llu us\n", mcopy_kernels[i].name, threads,
+                  (unsigned long long)ns / 1000);
+            if (ns < best_ns)
+            {
+                best = &mcopy_kernels[i];
+                best_threads = threads;
+                best_ns = ns;
+            }
+        }
+    }
+
+    mcopy_set(this, best->name, best_threads);
+    MLOGI("copying with %s on %d thread(s), %.2f GB/s\n", best->name,
+          best_threads, best_ns ? (double)row_bytes * rows / best_ns : 0.0);
+}
+
+//
+// Tuning cache
+//
+static void trim(char *s)
+{
+    size_t n = strlen(s);
+    while (n > 0 && (s[n - 1] == '\n' || s[n - 1] == ' ' || s[n - 1] == '\t'))
+    {
+        s[--n] = '\0';
+    }
+}
+
+int mcopy_parse_tuning(const char *line, struct MCopyTuning *tuning)
+{
+    int n = 0;
+
+    memset(tuning, 0, sizeof(*tuning));
+    if (sscanf(line, "%ux%u %31s %d %n", &tuning->width, &tuning->height,
+               tuning->kernel, &tuning->threads, &n) != 4 ||
+        n == 0)
+    {
+        return -1;
+    }
+
+    snprintf(tuning->cpu, sizeof(tuning->cpu), "%s", line + n);
+    trim(tuning->cpu);
+    if (tuning->cpu[0] == '\0' || tuning->threads < 1 ||
+        tuning->threads > MCOPY_MAX_THREADS)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+void mcopy_cpu_model(char *cpu, size_t len)
+{
+    static const char *keys[] = {"model name", "Hardware", "CPU part"};
+    char line[256];
+    int best = sizeof(keys) / sizeof(keys[0]);
+
+    snprintf(cpu, len, "unknown");
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f == NULL)
+    {
+        return;
+    }
+
+    /* x86 has model names, ARM at most a board name or part number */
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *value = strchr(line, ':');
+        int i;
+        if (value == NULL)
+        {
+            continue;
+        }
+
+        for (i = 0; i < best; ++i)
+        {
+            if (strncmp(line, keys[i], strlen(keys[i])) == 0)
+            {
+                value++;
+                value += strspn(value, " \t");
+                trim(value);
+                if (*value != '\0')
+                {
+                    snprintf(cpu, len, "%s", value);
+                    best = i;
+                }
+                break;
+            }
+        }
+    }
+    fclose(f);
+}
+
+int mcopy_load_tuning(const char *path, struct MCopyTuning *tuning)
+{
+    struct MCopyTuning entry;
+    char line[256];
+    int found = -1;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        return -1;
+    }
+
+    while (found < 0 && fgets(line, sizeof(line), f) != NULL)
+    {
+        if (mcopy_parse_tuning(line, &entry) == 0 &&
+            entry.width == tuning->width && entry.height == tuning->height &&
+            strcmp(entry.cpu, tuning->cpu) == 0)
+        {
+            memcpy(tuning->kernel, entry.kernel, sizeof(tuning->kernel));
+            tuning->threads = entry.threads;
+            found = 0;
+        }
+    }
+    fclose(f);
+
+    return found;
+}
+
+int mcopy_save_tuning(const char *path, const struct MCopyTuning *tuning)
+{
+    struct MCopyTuning entry;
+    char tmp[PATH_MAX];
+    char line[256];
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL)
+    {
+        MLOGW("error writing %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    /* keep the entries of other CPUs and resolutions */
+    FILE *in = fopen(path, "r");
+    while (in != NULL && fgets(line, sizeof(line), in) != NULL)
+    {
+        if (mcopy_parse_tuning(line, &entry) == 0 &&
+            !(entry.width == tuning->width && entry.height == tuning->height &&
+              strcmp(entry.cpu, tuning->cpu) == 0))
+        {
+            fputs(line, out);
+        }
+    }
+    if (in != NULL)
+    {
+        fclose(in);
+    }
+
+    fprintf(out, "%ux%u %s %d %s\n", tuning->width, tuning->height,
+            tuning->kernel, tuning->threads, tuning->cpu);
+    if (fclose(out) != 0 || rename(tmp, path) < 0)
+    {
+        MLOGW("error saving %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+int mcopy_tuning_path(char *path, size_t len)
+{
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int n;
+
+    if (cache != NULL && cache[0] != '\0')
+    {
+        n = snprintf(path, len, "%s/%s", cache, TUNING_FILE);
+    }
+    else if (home != NULL && home[0] != '\0')
+    {
+        n = snprintf(path, len, "%s/.cache/%s", home, TUNING_FILE);
+    }
+    else
+    {
+        return -1;
+    }
+    if (n < 0 || (size_t)n >= len)
+    {
+        return -1;
+    }
+
+    /* create the cache and mclient directories on the way */
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    char *parent = strrchr(path, '/');
+    if (parent != NULL)
+    {
+        *parent = '\0';
+        mkdir(path, 0700);
+        *parent = '/';
+    }
+    int err = mkdir(path, 0700) < 0 && errno != EEXIST ? -1 : 0;
+    *slash = '/';
+
+    return err;
+}
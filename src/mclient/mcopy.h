@@ -0,0 +1,159 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_COPY_H
+#define M_COPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+/*
+ * Strided row copies from the capture segment into buffers.
+ *
+ * Which strategy is fastest (plain memcpy, SIMD, non-temporal stores,
+ * striping rows across threads) depends on the board, so mclient times
+ * the candidates once per CPU model and resolution and caches the winner.
+ */
+
+/*
+ * Copies smaller than this stay on the calling thread, waking the
+ * workers costs more than it saves.
+ */
+#define MCOPY_MT_MIN_BYTES (256 * 1024)
+#define MCOPY_MAX_THREADS (4)
+
+typedef void (*mcopy_fn)(uint8_t *dst, size_t dst_stride,
+                         const uint8_t *src, size_t src_stride,
+                         size_t row_bytes, uint32_t rows);
+
+struct MCopyKernel
+{
+    const char *name;
+    mcopy_fn copy;
+};
+
+/* kernels built for this target, memcpy first */
+extern const struct MCopyKernel mcopy_kernels[];
+extern const int mcopy_num_kernels;
+
+struct MCopy;
+
+struct MCopyWorker
+{
+    struct MCopy *mCopy;
+    pthread_t mThread;
+    int mIndex;     /* stripe handled by this worker, 0 = the caller */
+    uint64_t mSeen; /* generation of the last job picked up */
+};
+
+struct MCopy
+{
+    const struct MCopyKernel *mKernel;
+    int mThreads; /* stripes per copy, including the calling thread */
+
+    /* the job workers pick their stripe from */
+    pthread_mutex_t mLock;
+    pthread_cond_t mStart;
+    pthread_cond_t mDone;
+    uint64_t mGeneration; /* bumped per job */
+    int mPending;         /* stripes still running */
+    int mQuit;
+    uint8_t *mDst;
+    const uint8_t *mSrc;
+    size_t mDstStride, mSrcStride, mRowBytes;
+    uint32_t mRows;
+
+    struct MCopyWorker mWorkers[MCOPY_MAX_THREADS];
+    int mNumWorkers; /* started worker threads */
+};
+
+/**
+ * Start out with memcpy on the calling thread.
+ */
+int mcopy_init(struct MCopy *this);
+void mcopy_destroy(struct MCopy *this);
+
+const struct MCopyKernel *mcopy_find_kernel(const char *name);
+
+/**
+ * Switch strategy, starting worker threads as needed.
+ * @return 0, -1 if the kernel is unknown or threads cannot be started
+ */
+int mcopy_set(struct MCopy *this, const char *kernel, int threads);
+
+void mcopy_rows(struct MCopy *this,
+                uint8_t *dst, size_t dst_stride,
+                const uint8_t *src, size_t src_stride,
+                size_t row_bytes, uint32_t rows);
+
+/**
+ * Time every kernel and thread count on a real copy, then switch to the
+ * fastest. Every candidate copies the same pixels, so @param dst ends up
+ * with the right content.
+ */
+void mcopy_tune(struct MCopy *this,
+                uint8_t *dst, size_t dst_stride,
+                const uint8_t *src, size_t src_stride,
+                size_t row_bytes, uint32_t rows);
+
+//
+// Tuning cache
+//
+// One line per CPU model and resolution:
+//     WIDTHxHEIGHT KERNEL THREADS CPU MODEL...
+//
+
+struct MCopyTuning
+{
+    uint32_t width;
+    uint32_t height;
+    char kernel[32];
+    int threads;
+    char cpu[128];
+};
+
+/**
+ * @return 0 if @param line is a valid cache entry
+ */
+int mcopy_parse_tuning(const char *line, struct MCopyTuning *tuning);
+
+/**
+ * @param cpu set to a name of the CPU model, "unknown" if there is none
+ */
+void mcopy_cpu_model(char *cpu, size_t len);
+
+/**
+ * @param tuning width, height and cpu select the entry, the rest is filled
+ * @return 0 if found in the cache at @param path
+ */
+int mcopy_load_tuning(const char *path, struct MCopyTuning *tuning);
+
+/**
+ * Add or replace the entry for @param tuning.
+ */
+int mcopy_save_tuning(const char *path, const struct MCopyTuning *tuning);
+
+/**
+ * @param path set to the cache file under $XDG_CACHE_HOME (~/.cache),
+ * its directory is created if needed
+ * @return 0, -1 if there is no place for it
+ */
+int mcopy_tuning_path(char *path, size_t len);
+
+#endif // M_COPY_H
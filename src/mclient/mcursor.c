@@ -18,6 +18,8 @@
 #include <string.h>
 #include <pthread.h>
 
+#include <sys/epoll.h>
+
 #include <X11/Xlib.h>
 #include <X11/extensions/Xfixes.h>
 #include <X11/extensions/XInput2.h>
@@ -30,22 +32,23 @@
 /*
  * All cursor-related logic belongs here.
  *
- * There is a dedicated thread created just to handle cursor motion events.
- * Empirically, this improves performance over a single thread processing
- * all events, especially when the mouse moves around a lot while there is
- * continuous damage to the screen (e.g. a video playing).
+ * The cursor lives on its own thread with its own event loop, X
+ * connections and mflinger connection (mflinger adds it to the session
+ * of the capture connection). A cursor shape change means a round trip
+ * to X for the image and another to mflinger to lock the cursor buffer,
+ * which used to hold up screen capture. Now both run side by side.
  *
- * Concurrency needs to be handled carefully here. Any calls to X on the motion
- * thread need to happen with a separate Display connection. Any calls to
- * MDisplay cannot wait for a response because this may call racing issues
- * with the main thread. In short, only MUpdateCursor can be called, no
- * MLock/MUnlock. That is why we keep the cursor image update handling on the
- * main thread.
+ * Cursor motion events are received on a dedicated Display connection.
+ * Empirically, keeping motion on its own connection improves performance
+ * over a single connection processing all events, especially when the
+ * mouse moves around a lot while the cursor shape changes too: raw
+ * motion never queues up behind shape notifications.
  *
- * TODO: Ideally, all socket operations should be serialized to avoid races.
+ * The cursor cache is only touched by the cursor thread once it runs.
  *
- * NOTE: For some reason, moving XISelectEvents to the main thread causes no
- * motion events to be delivered unless XIAllDevices is used...no idea why.
+ * NOTE: For some reason, moving XISelectEvents to the main connection
+ * causes no motion events to be delivered unless XIAllDevices is used...
+ * no idea why.
  */
 
 static int copy_xcursor_to_buffer(MDisplay *mdpy, MBuffer *buf,
@@ -99,13 +102,17 @@ static int copy_xcursor_to_buffer(MDisplay *mdpy, MBuffer *buf,
     return 0;
 }
 
-static int update_cursor(Display *dpy,
-                         MDisplay *mdpy, MBuffer *cursor,
-                         int root_x, int root_y)
+/**
+ * @param force send the position even if it did not change, e.g. for a
+ * new shape with a different hotspot
+ * @return 1 if the position was sent
+ */
+static int update_cursor(MDisplay *mdpy, MBuffer *cursor,
+                         int root_x, int root_y, int force)
 {
     int last_x, last_y;
     cursor_cache_get_last_pos(&last_x, &last_y);
-    if (root_x != last_x || root_y != last_y)
+    if (force || root_x != last_x || root_y != last_y)
     {
         XFixesCursorImage *xcursor = cursor_cache_get_cur();
 
@@ -129,11 +136,18 @@ static int update_cursor(Display *dpy,
         }
 
         cursor_cache_set_last_pos(root_x, root_y);
+        return 1;
     }
 
     return 0;
 }
 
+static void store_position(struct MCursor *this, int root_x, int root_y)
+{
+    uint64_t pos = (uint64_t)(uint32_t)root_x << 32 | (uint32_t)root_y;
+    __atomic_store_n(&this->mPosition, pos, __ATOMIC_RELAXED);
+}
+
 static void select_image_events(Display *xdpy)
 {
     /* let me know when the cursor image changes */
@@ -183,81 +197,245 @@ static void select_events(Display *dpy, Window win)
     XFlush(dpy);
 }
 
-void *cursor_motion_thread(void *targs)
+static int on_motion_prepare(void *data)
 {
+    struct MCursor *this = (struct MCursor *)data;
+    XFlush(this->mMotionXdpy);
+    return XEventsQueued(this->mMotionXdpy, QueuedAlready) > 0;
+}
 
-    struct MCursor *this = (struct MCursor *)targs;
+static void on_motion(void *data, uint32_t events)
+{
+    struct MCursor *this = (struct MCursor *)data;
+    Display *dpy = this->mMotionXdpy;
+    XEvent ev;
+    int moved = 0;
 
-    Display *dpy;
-    int xi_opcode, event, error;
+    /*
+     * Drain everything that is queued and only query the pointer once,
+     * a burst of raw motion events only needs the latest position.
+     */
+    while (XPending(dpy))
+    {
+        XGenericEventCookie *cookie = &ev.xcookie;
+
+        XNextEvent(dpy, &ev);
+
+        if (cookie->type == GenericEvent && cookie->extension == this->mXiOpcode && XGetEventData(dpy, cookie))
+        {
+            if (cookie->evtype == XI_RawMotion)
+            {
+                moved = 1;
+            }
+
+            XFreeEventData(dpy, cookie);
+        }
+    }
+
+    if (moved)
+    {
+        Window root_ret, child_ret;
+        int root_x, root_y;
+        int win_x, win_y;
+        unsigned int mask;
+
+        XQueryPointer(dpy, DefaultRootWindow(dpy), &root_ret, &child_ret, &root_x, &root_y, &win_x, &win_y, &mask);
+        store_position(this, root_x, root_y);
+        if (update_cursor(&this->mMdpy, &this->mBuffer, root_x, root_y, 0))
+        {
+            __atomic_add_fetch(&this->mUpdates, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void on_shape_change(struct MCursor *this,
+                            XFixesCursorNotifyEvent *cev)
+{
+    int x, y;
+
+    MLOGD("cursor_serial: %lu\n", cev->cursor_serial);
+
+    /* first, check if we have the new cursor in our cache... */
+    XFixesCursorImage *xcursor = cursor_cache_get(cev->cursor_serial);
+
+    /* ...if not, make the server request */
+    if (xcursor == NULL)
+    {
+        xcursor = XFixesGetCursorImage(this->mXdpy);
+        cursor_cache_add(xcursor);
+    }
+
+    /* without a position page, sprite and hotspot land in one transaction */
+    MBeginBatch(&this->mMdpy);
+    if (copy_xcursor_to_buffer(&this->mMdpy, &this->mBuffer, xcursor) < 0)
+    {
+        MLOGE("failed to render cursor sprite\n");
+    }
+
+    cursor_cache_set_cur(xcursor);
+    cursor_cache_get_last_pos(&x, &y);
+    update_cursor(&this->mMdpy, &this->mBuffer, x, y, 1);
+    if (MFlushBatch(&this->mMdpy) < 0)
+    {
+        MLOGE("error sending cursor update\n");
+    }
+}
+
+static int on_shape_prepare(void *data)
+{
+    struct MCursor *this = (struct MCursor *)data;
+    XFlush(this->mXdpy);
+    return XEventsQueued(this->mXdpy, QueuedAlready) > 0;
+}
+
+static void on_shape(void *data, uint32_t events)
+{
+    struct MCursor *this = (struct MCursor *)data;
     XEvent ev;
 
+    while (XPending(this->mXdpy))
+    {
+        XNextEvent(this->mXdpy, &ev);
+        if (ev.type == this->mXFixesEventBase + XFixesCursorNotify)
+        {
+            MLOGD("XFixesCursorNotifyEvent!\n");
+            on_shape_change(this, (XFixesCursorNotifyEvent *)&ev);
+        }
+        else
+        {
+            MLOGW("unknown event %d\n", ev.type);
+        }
+    }
+}
+
+static int open_motion_display(struct MCursor *this)
+{
+    Display *dpy;
+    int event, error;
+
     dpy = XOpenDisplay(NULL);
 
     if (!dpy)
     {
         MLOGE("Failed to open display.\n");
-        return (void *)-1;
+        return -1;
     }
 
-    if (!XQueryExtension(dpy, "XInputExtension", &xi_opcode, &event, &error))
+    if (!XQueryExtension(dpy, "XInputExtension", &this->mXiOpcode, &event, &error))
     {
         MLOGE("X Input extension not available.\n");
         XCloseDisplay(dpy);
-        return (void *)-1;
+        return -1;
     }
 
     if (!has_xi2(dpy))
     {
         XCloseDisplay(dpy);
-        return (void *)-1;
+        return -1;
     }
 
     /* select for XI2 events */
     select_events(dpy, DefaultRootWindow(dpy));
 
-    while (1)
+    this->mMotionXdpy = dpy;
+    this->mMotionSource.mFd = ConnectionNumber(dpy);
+    this->mMotionSource.mEvents = EPOLLIN;
+    this->mMotionSource.mCallback = on_motion;
+    this->mMotionSource.mPrepare = on_motion_prepare;
+    this->mMotionSource.mData = this;
+    if (mloop_add_source(&this->mLoop, &this->mMotionSource) < 0)
     {
-        XGenericEventCookie *cookie = &ev.xcookie;
-        Window root_ret, child_ret;
-        int root_x, root_y;
-        int win_x, win_y;
-        unsigned int mask;
+        XCloseDisplay(dpy);
+        this->mMotionXdpy = NULL;
+        return -1;
+    }
 
-        XNextEvent(dpy, &ev);
+    return 0;
+}
 
-        if (cookie->type == GenericEvent && cookie->extension == xi_opcode && XGetEventData(dpy, cookie))
-        {
+static void on_quit(void *data, uint32_t events)
+{
+    struct MCursor *this = (struct MCursor *)data;
+    mloop_quit(&this->mLoop);
+}
 
-            if (cookie->evtype == XI_RawMotion)
-            {
-                XQueryPointer(dpy, DefaultRootWindow(dpy), &root_ret, &child_ret, &root_x, &root_y, &win_x, &win_y, &mask);
-                update_cursor(dpy, this->mMdpy, &this->mBuffer, root_x, root_y);
-            }
+static void *cursor_main(void *data)
+{
+    struct MCursor *this = (struct MCursor *)data;
 
-            XFreeEventData(dpy, cookie);
-        }
+    if (this->mSched != NULL && msched_apply(this->mSched) < 0)
+    {
+        MLOGW("cursor thread scheduling policy not fully applied\n");
     }
 
-    XCloseDisplay(dpy);
+    if (mloop_run(&this->mLoop) < 0)
+    {
+        MLOGE("cursor thread stopped, the cursor is frozen\n");
+    }
     return NULL;
 }
 
-static void spawn_motion_thread(struct MCursor *this)
+/**
+ * Everything but the thread, undone by close_connections().
+ */
+static int open_connections(struct MCursor *this, uint32_t display_flags)
 {
-    pthread_create(&this->mMotionThread, NULL,
-                   &cursor_motion_thread, (void *)this);
-}
+    int error;
 
-int mcursor_init(struct MCursor *this, Display *xdpy, MDisplay *mdpy)
-{
-    this->mXdpy = xdpy;
-    this->mMdpy = mdpy;
+    this->mXdpy = XOpenDisplay(NULL);
+    if (this->mXdpy == NULL)
+    {
+        MLOGE("error opening cursor X connection\n");
+        return -1;
+    }
 
-    int error;
     if (!XFixesQueryExtension(this->mXdpy, &this->mXFixesEventBase, &error))
     {
         MLOGE("Xfixes extension unavailable!\n");
+        XCloseDisplay(this->mXdpy);
+        return -1;
+    }
+
+    if (MOpenDisplayWithFlags(&this->mMdpy, display_flags) < 0)
+    {
+        MLOGE("error opening cursor mflinger connection\n");
+        XCloseDisplay(this->mXdpy);
+        return -1;
+    }
+
+    if (mloop_init(&this->mLoop) < 0)
+    {
+        MCloseDisplay(&this->mMdpy);
+        XCloseDisplay(this->mXdpy);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void close_connections(struct MCursor *this)
+{
+    if (this->mMotionXdpy != NULL)
+    {
+        mloop_remove_source(&this->mLoop, &this->mMotionSource);
+        XCloseDisplay(this->mMotionXdpy);
+        this->mMotionXdpy = NULL;
+    }
+
+    mloop_destroy(&this->mLoop);
+    MCloseDisplay(&this->mMdpy);
+    XCloseDisplay(this->mXdpy);
+    this->mXdpy = NULL;
+}
+
+int mcursor_init(struct MCursor *this, uint32_t display_flags,
+                 const struct MSchedPolicy *sched)
+{
+    memset(this, 0, sizeof(*this));
+    this->mSched = sched;
+
+    if (open_connections(this, display_flags) < 0)
+    {
         return -1;
     }
 
@@ -265,57 +443,82 @@ int mcursor_init(struct MCursor *this, Display *xdpy, MDisplay *mdpy)
     cursor_cache_add(xcursor);
     cursor_cache_set_cur(xcursor);
 
+    /* created before the caller goes on, so surfaces stack in order */
     this->mBuffer.width = CURSOR_WIDTH;
     this->mBuffer.height = CURSOR_HEIGHT;
-    if (MCreateBuffer(this->mMdpy, &this->mBuffer) < 0)
+    if (MCreateBuffer(&this->mMdpy, &this->mBuffer) < 0)
     {
         MLOGE("error creating cursor buffer\n");
+        close_connections(this);
         return -1;
     }
 
-    if (copy_xcursor_to_buffer(this->mMdpy, &this->mBuffer, xcursor) < 0)
+    /* moves become a memory store, mflinger picks them up on vsync */
+    if (MMapBufferPosition(&this->mMdpy, &this->mBuffer) < 0)
+    {
+        MLOGI("no cursor position page, sending moves as requests\n");
+    }
+
+    if (copy_xcursor_to_buffer(&this->mMdpy, &this->mBuffer, xcursor) < 0)
     {
         MLOGE("failed to render cursor sprite\n");
     }
 
     /* place the cursor at the right starting position */
-    update_cursor(this->mXdpy, this->mMdpy, &this->mBuffer, xcursor->x, xcursor->y);
+    update_cursor(&this->mMdpy, &this->mBuffer, xcursor->x, xcursor->y, 1);
+    store_position(this, xcursor->x, xcursor->y);
 
     select_image_events(this->mXdpy);
+    this->mShapeSource.mFd = ConnectionNumber(this->mXdpy);
+    this->mShapeSource.mEvents = EPOLLIN;
+    this->mShapeSource.mCallback = on_shape;
+    this->mShapeSource.mPrepare = on_shape_prepare;
+    this->mShapeSource.mData = this;
+    if (mloop_add_source(&this->mLoop, &this->mShapeSource) < 0)
+    {
+        close_connections(this);
+        return -1;
+    }
 
-    spawn_motion_thread(this);
+    if (open_motion_display(this) < 0)
+    {
+        MLOGE("cursor motion tracking unavailable\n");
+    }
+
+    mloop_set_wake_callback(&this->mLoop, on_quit, this);
+    if (pthread_create(&this->mThread, NULL, cursor_main, this) != 0)
+    {
+        MLOGE("error starting cursor thread\n");
+        close_connections(this);
+        return -1;
+    }
+    this->mRunning = 1;
 
     return 0;
 }
 
-void mcursor_on_event(struct MCursor *this, XEvent *ev)
+void mcursor_destroy(struct MCursor *this)
 {
-    if (ev->type == this->mXFixesEventBase + XFixesCursorNotify)
+    if (!this->mRunning)
     {
-        MLOGD("XFixesCursorNotifyEvent!\n");
-        XFixesCursorNotifyEvent *cev = (XFixesCursorNotifyEvent *)ev;
-        MLOGD("cursor_serial: %lu\n", cev->cursor_serial);
+        return;
+    }
 
-        /* first, check if we have the new cursor in our cache... */
-        XFixesCursorImage *xcursor = cursor_cache_get(cev->cursor_serial);
+    mloop_wake(&this->mLoop);
+    pthread_join(this->mThread, NULL);
+    this->mRunning = 0;
 
-        /* ...if not, make the server request */
-        if (xcursor == NULL)
-        {
-            xcursor = XFixesGetCursorImage(this->mXdpy);
-            cursor_cache_add(xcursor);
-        }
+    close_connections(this);
+}
 
-        /* render the new cursor */
-        if (copy_xcursor_to_buffer(this->mMdpy, &this->mBuffer, xcursor) < 0)
-        {
-            MLOGE("failed to render cursor sprite\n");
-        }
+uint64_t mcursor_updates(struct MCursor *this)
+{
+    return __atomic_load_n(&this->mUpdates, __ATOMIC_RELAXED);
+}
 
-        cursor_cache_set_cur(xcursor);
-    }
-    else
-    {
-        MLOGW("unknown event %d\n", ev->type);
-    }
+void mcursor_position(struct MCursor *this, int32_t *x, int32_t *y)
+{
+    uint64_t pos = __atomic_load_n(&this->mPosition, __ATOMIC_RELAXED);
+    *x = (int32_t)(pos >> 32);
+    *y = (int32_t)(uint32_t)pos;
 }
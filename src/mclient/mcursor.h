@@ -17,9 +17,13 @@
 #ifndef M_CURSOR_H
 #define M_CURSOR_H
 
+#include <stdint.h>
 #include <pthread.h>
+
 #include <X11/Xlib.h>
 #include "mlib.h"
+#include "mloop.h"
+#include "msched.h"
 
 /*
  * Empirically, these appear to be the max dims
@@ -28,16 +32,48 @@
 #define CURSOR_WIDTH (24)
 #define CURSOR_HEIGHT (24)
 
+/*
+ * The cursor runs on its own thread, with its own X and mflinger
+ * connections and event loop, so neither side ever waits on the other.
+ */
 struct MCursor
 {
-    Display *mXdpy;
-    MDisplay *mMdpy;
+    Display *mXdpy;       /* cursor shape notifications and images */
+    Display *mMotionXdpy; /* dedicated connection for XI2 raw motion */
+    MDisplay mMdpy;
     MBuffer mBuffer;
-    pthread_t mMotionThread;
+    struct MLoop mLoop;
+    struct MLoopSource mShapeSource;
+    struct MLoopSource mMotionSource;
     int mXFixesEventBase;
+    int mXiOpcode;
+
+    pthread_t mThread;
+    int mRunning;
+    const struct MSchedPolicy *mSched; /* NULL = inherit the creator's */
+
+    uint64_t mUpdates; /* position updates sent, read with mcursor_updates() */
+    uint64_t mPosition; /* pointer x << 32 | y, read with mcursor_position() */
 };
 
-int mcursor_init(struct MCursor *this, Display *xdpy, MDisplay *mdpy);
-void mcursor_on_event(struct MCursor *this, XEvent *ev);
+/**
+ * Set up the cursor surface and start the cursor thread.
+ * @param display_flags M_DISPLAY_* flags for its mflinger connection
+ * @param sched scheduling of the cursor thread, NULL = inherit, must
+ * outlive the cursor
+ */
+int mcursor_init(struct MCursor *this, uint32_t display_flags,
+                 const struct MSchedPolicy *sched);
+void mcursor_destroy(struct MCursor *this);
+
+/**
+ * Safe to call from any thread.
+ */
+uint64_t mcursor_updates(struct MCursor *this);
+
+/**
+ * Last known pointer position on screen, safe to call from any thread.
+ */
+void mcursor_position(struct MCursor *this, int32_t *x, int32_t *y);
 
 #endif // M_CURSOR_H
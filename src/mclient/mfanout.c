@@ -0,0 +1,342 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+
+#include "mfanout.h"
+#include "mrect.h"
+#include "mlog.h"
+
+/*
+ * Frame fan-out to other local processes.
+ *
+ * Captured frames are published into a ring of complete frames in a memfd
+ * that consumers map read-only, so e.g. a screen recorder gets every frame
+ * without grabbing the X server again. The writer only ever copies damage:
+ * a slot's content is brought up to date by copying what changed since
+ * the slot was last written from the previous slot, then the caller draws
+ * the new damage on top.
+ *
+ * Consumers synchronize through the per-slot seqlock and never hold
+ * anything the writer waits on, a stalled consumer only misses frames.
+ */
+
+#define BYTES_PER_PIXEL (4)
+
+/* header, slot headers and pixels each start on their own page */
+#define RING_ALIGN (4096)
+#define ALIGN_UP(n) (((n) + RING_ALIGN - 1) & ~((uint64_t)RING_ALIGN - 1))
+
+static int seal_ring(int fd)
+{
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+    /* our own mapping stays writable, consumers can only map read-only */
+    if (fcntl(fd, F_ADD_SEALS, seals | F_SEAL_FUTURE_WRITE) == 0)
+    {
+        return 0;
+    }
+#endif
+    return fcntl(fd, F_ADD_SEALS, seals);
+}
+
+int mfanout_init(struct MFanout *this, uint32_t max_width, uint32_t max_height)
+{
+    memset(this, 0, sizeof(*this));
+    this->mListenSource.mFd = -1;
+
+    uint64_t pixels_offset = ALIGN_UP(sizeof(struct MFrameSlot));
+    uint64_t slot_size = ALIGN_UP(pixels_offset + (uint64_t)max_width *
+                                                      max_height *
+                                                      BYTES_PER_PIXEL);
+    uint64_t slots_offset = ALIGN_UP(sizeof(struct MFramesHeader));
+    this->mSize = slots_offset + MFANOUT_NUM_SLOTS * slot_size;
+
+    this->mFd = memfd_create("mclient-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (this->mFd < 0)
+    {
+        MLOGE("error creating frame ring: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(this->mFd, this->mSize) < 0)
+    {
+        MLOGE("error sizing frame ring: %s\n", strerror(errno));
+        close(this->mFd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, this->mSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     this->mFd, 0);
+    if (map == MAP_FAILED)
+    {
+        MLOGE("error mapping frame ring: %s\n", strerror(errno));
+        close(this->mFd);
+        return -1;
+    }
+    this->mRing = (struct MFramesHeader *)map;
+
+    if (seal_ring(this->mFd) < 0)
+    {
+        MLOGW("error sealing frame ring: %s\n", strerror(errno));
+    }
+
+    /* a fresh memfd reads as zeros, i.e. no frames and even seqlocks */
+    struct MFramesHeader *hdr = this->mRing;
+    hdr->num_slots = MFANOUT_NUM_SLOTS;
+    hdr->max_width = max_width;
+    hdr->max_height = max_height;
+    hdr->slots_offset = slots_offset;
+    hdr->slot_size = slot_size;
+    hdr->pixels_offset = pixels_offset;
+    __atomic_store_n(&hdr->magic, MFRAMES_MAGIC, __ATOMIC_RELEASE);
+
+    this->mValidFrom = 1;
+    return 0;
+}
+
+void mfanout_destroy(struct MFanout *this, struct MLoop *loop)
+{
+    if (this->mRing == NULL)
+    {
+        return;
+    }
+
+    if (this->mListenSource.mFd >= 0)
+    {
+        mloop_remove_source(loop, &this->mListenSource);
+        close(this->mListenSource.mFd);
+        this->mListenSource.mFd = -1;
+    }
+
+    munmap(this->mRing, this->mSize);
+    close(this->mFd);
+    this->mRing = NULL;
+}
+
+static void on_accept(void *data, uint32_t events)
+{
+    struct MFanout *this = (struct MFanout *)data;
+
+    int cfd = accept4(this->mListenSource.mFd, NULL, NULL, SOCK_CLOEXEC);
+    if (cfd < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+        {
+            MLOGE("error accepting frame consumer: %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    /* the screen contents are as private as the X session they come from */
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0)
+    {
+        MLOGE("error checking frame consumer: %s\n", strerror(errno));
+        close(cfd);
+        return;
+    }
+    if (cred.uid != geteuid())
+    {
+        MLOGW("refusing frame consumer pid %d of uid %d\n",
+              (int)cred.pid, (int)cred.uid);
+        close(cfd);
+        return;
+    }
+
+    struct MFramesHello hello = {MFRAMES_MAGIC, 0, this->mSize};
+    struct iovec iov = {&hello, sizeof(hello)};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msgh = {0};
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+    msgh.msg_control = control.buf;
+    msgh.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &this->mFd, sizeof(int));
+
+    /* the consumer keeps the ring through the fd, no need to stay connected */
+    if (sendmsg(cfd, &msgh, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    {
+        MLOGW("error sending frame ring: %s\n", strerror(errno));
+    }
+    close(cfd);
+}
+
+int mfanout_listen(struct MFanout *this, struct MLoop *loop, const char *name)
+{
+    struct sockaddr_un local;
+    int fd, len;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        MLOGE("error opening frame socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    local.sun_path[0] = '\0'; // abstract namespace indicator
+    strncpy(local.sun_path + 1, name, sizeof(local.sun_path) - 2);
+    len = 1 + strlen(local.sun_path + 1) + sizeof(local.sun_family);
+
+    if (bind(fd, (struct sockaddr *)&local, len) < 0 || listen(fd, 4) < 0)
+    {
+        MLOGE("error listening on frame socket: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    this->mListenSource.mFd = fd;
+    this->mListenSource.mEvents = EPOLLIN;
+    this->mListenSource.mCallback = on_accept;
+    this->mListenSource.mData = this;
+    if (mloop_add_source(loop, &this->mListenSource) < 0)
+    {
+        close(fd);
+        this->mListenSource.mFd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void copy_rect(const struct MFramesHeader *hdr, struct MFrameSlot *dst,
+                      const struct MFrameSlot *src, const MRect *r)
+{
+    uint32_t bytes_per_line = hdr->max_width * BYTES_PER_PIXEL;
+    uint64_t offset = r->y * bytes_per_line + r->x * BYTES_PER_PIXEL;
+    const uint8_t *from = mframes_pixels(hdr, src) + offset;
+    uint8_t *to = mframes_pixels(hdr, dst) + offset;
+
+    uint32_t y;
+    for (y = 0; y < r->height; ++y)
+    {
+        memcpy(to, from, r->width * BYTES_PER_PIXEL);
+        from += bytes_per_line;
+        to += bytes_per_line;
+    }
+}
+
+int mfanout_begin_frame(struct MFanout *this, uint32_t width, uint32_t height,
+                        const MRect *damage, int ndamage, MBuffer *view)
+{
+    struct MFramesHeader *hdr = this->mRing;
+    if (width > hdr->max_width || height > hdr->max_height)
+    {
+        return -1;
+    }
+
+    /* we are the only writer of latest */
+    uint64_t n = hdr->latest + 1;
+    struct MFrameSlot *slot = mframes_slot(hdr, n);
+    struct MFrameSlot *prev = mframes_slot(hdr, n - 1);
+    MRect frame = {0, 0, width, height};
+    MRect bounds = {0};
+    int i;
+
+    for (i = 0; i < ndamage; ++i)
+    {
+        mrect_union(&bounds, &damage[i]);
+    }
+
+    mseqlock_write_begin(&slot->seq);
+
+    if (n > 1 && (prev->width != width || prev->height != height))
+    {
+        this->mValidFrom = n;
+    }
+
+    if (n > this->mValidFrom)
+    {
+        /* catch up on the frames written to the other slots */
+        MRect missed = {0};
+        uint64_t k = slot->frame + 1;
+        if (slot->frame < this->mValidFrom)
+        {
+            /* never written at this size */
+            missed = frame;
+            k = n;
+        }
+        for (; k < n; ++k)
+        {
+            mrect_union(&missed, &this->mDamage[k % MFANOUT_NUM_SLOTS]);
+        }
+
+        if (mrect_intersect(&missed, &frame) &&
+            !(ndamage == 1 && mrect_contains(&damage[0], &missed)))
+        {
+            copy_rect(hdr, slot, prev, &missed);
+        }
+    }
+
+    slot->frame = n;
+    slot->width = width;
+    slot->height = height;
+    if (ndamage > MFRAMES_MAX_RECTS)
+    {
+        slot->rects[0] = bounds;
+        slot->num_rects = 1;
+    }
+    else
+    {
+        memcpy(slot->rects, damage, ndamage * sizeof(MRect));
+        slot->num_rects = ndamage;
+    }
+    this->mDamage[n % MFANOUT_NUM_SLOTS] = bounds;
+
+    memset(view, 0, sizeof(*view));
+    view->width = width;
+    view->height = height;
+    view->stride = hdr->max_width;
+    view->bits = mframes_pixels(hdr, slot);
+    view->__fd = -1;
+    view->__fence_fd = -1;
+    return 0;
+}
+
+void mfanout_end_frame(struct MFanout *this, uint64_t timestamp)
+{
+    struct MFramesHeader *hdr = this->mRing;
+    uint64_t n = hdr->latest + 1;
+    struct MFrameSlot *slot = mframes_slot(hdr, n);
+
+    slot->timestamp = timestamp;
+    mseqlock_write_end(&slot->seq);
+    __atomic_store_n(&hdr->latest, n, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_FANOUT_H
+#define M_FANOUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mlib.h"
+#include "mframes.h"
+#include "mloop.h"
+
+/*
+ * Three slots let a reader take up to one full frame interval to copy
+ * the latest frame before the writer comes back around to it.
+ */
+#define MFANOUT_NUM_SLOTS (3)
+
+/*
+ * Writer side of the frame ring described in mframes.h.
+ */
+struct MFanout
+{
+    int mFd;                     /* memfd backing the ring */
+    struct MFramesHeader *mRing; /* writable mapping of the whole ring */
+    size_t mSize;                /* ring size in bytes */
+    struct MLoopSource mListenSource;
+
+    uint64_t mValidFrom;              /* first frame at the current size */
+    MRect mDamage[MFANOUT_NUM_SLOTS]; /* damage bounds of frame n at n % slots */
+};
+
+/**
+ * Create an empty ring for frames up to @param max_width x @param max_height.
+ */
+int mfanout_init(struct MFanout *this, uint32_t max_width, uint32_t max_height);
+void mfanout_destroy(struct MFanout *this, struct MLoop *loop);
+
+/**
+ * Hand the ring to every consumer that connects to the abstract
+ * socket @param name.
+ */
+int mfanout_listen(struct MFanout *this, struct MLoop *loop, const char *name);
+
+/**
+ * Start writing the next frame. Everything outside of @param damage is
+ * carried over from the previous frame, so after a size change the
+ * damage must cover the whole frame.
+ * @param damage rectangles the caller is about to draw
+ * @param view set up to address the slot's pixels like a locked MBuffer
+ * @return 0 on success, -1 if the frame does not fit the ring
+ */
+int mfanout_begin_frame(struct MFanout *this, uint32_t width, uint32_t height,
+                        const MRect *damage, int ndamage, MBuffer *view);
+
+/**
+ * Publish the frame started by mfanout_begin_frame().
+ * @param timestamp CLOCK_MONOTONIC capture time in ns
+ */
+void mfanout_end_frame(struct MFanout *this, uint64_t timestamp);
+
+#endif // M_FANOUT_H
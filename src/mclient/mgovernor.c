@@ -0,0 +1,229 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "mgovernor.h"
+
+#define THERMAL_DIR "/sys/class/thermal"
+#define LOADAVG_PATH "/proc/loadavg"
+
+void mgovernor_init(struct MGovernor *this, uint32_t min_fps, uint32_t max_fps)
+{
+    memset(this, 0, sizeof(*this));
+    this->mMinFps = min_fps;
+    this->mMaxFps = max_fps;
+    this->mFps = max_fps;
+    this->mReason = MGOVERNOR_STEADY;
+    this->mLast.temp = MGOVERNOR_TEMP_UNKNOWN;
+}
+
+static uint64_t cpu_time(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) < 0)
+    {
+        return 0;
+    }
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @return the 1 minute load average per CPU in 1/1000, 0 if unknown
+ */
+static uint32_t read_load(void)
+{
+    FILE *f = fopen(LOADAVG_PATH, "r");
+    double load;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (f == NULL)
+    {
+        return 0;
+    }
+    if (fscanf(f, "%lf", &load) != 1)
+    {
+        load = 0;
+    }
+    fclose(f);
+
+    return (uint32_t)(load * 1000 / (cpus > 0 ? cpus : 1));
+}
+
+/**
+ * @return the hottest thermal zone in millidegrees C
+ */
+static int32_t read_temp(void)
+{
+    int32_t hottest = MGOVERNOR_TEMP_UNKNOWN;
+    DIR *dir = opendir(THERMAL_DIR);
+    struct dirent *ent;
+    char path[sizeof(THERMAL_DIR) + NAME_MAX + sizeof("/temp")];
+
+    if (dir == NULL)
+    {
+        return hottest;
+    }
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        FILE *f;
+        long temp;
+
+        if (strncmp(ent->d_name, "thermal_zone", 12) != 0)
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), THERMAL_DIR "/%s/temp", ent->d_name);
+        f = fopen(path, "r");
+        if (f == NULL)
+        {
+            continue;
+        }
+        /* disabled zones fail to read */
+        if (fscanf(f, "%ld", &temp) == 1 && temp > hottest)
+        {
+            hottest = (int32_t)temp;
+        }
+        fclose(f);
+    }
+    closedir(dir);
+
+    return hottest;
+}
+
+int mgovernor_sample(struct MGovernor *this, uint64_t now, uint64_t frames,
+                     struct MGovernorSample *sample)
+{
+    uint64_t cpu = cpu_time();
+    int first = this->mTime == 0;
+
+    sample->cpu_ns = cpu - this->mCpuTime;
+    sample->period_ns = now - this->mTime;
+    sample->frames = frames - this->mFrames;
+    sample->load = read_load();
+    sample->temp = read_temp();
+
+    this->mCpuTime = cpu;
+    this->mTime = now;
+    this->mFrames = frames;
+    return first ? -1 : 0;
+}
+
+/**
+ * @return the highest rate our frames can run at within
+ * MGOVERNOR_CPU_SHARE of a core, 0 if unknown
+ */
+static uint64_t cpu_fps(const struct MGovernorSample *sample)
+{
+    if (sample->frames == 0 || sample->cpu_ns == 0)
+    {
+        return 0;
+    }
+
+    uint64_t per_frame = sample->cpu_ns / sample->frames;
+    return per_frame ? 1000000ull * MGOVERNOR_CPU_SHARE / per_frame : 0;
+}
+
+static uint32_t step(uint32_t fps, uint32_t divisor)
+{
+    return fps / divisor > 1 ? fps / divisor : 1;
+}
+
+uint32_t mgovernor_update(struct MGovernor *this,
+                          const struct MGovernorSample *sample)
+{
+    int known_temp = sample->temp != MGOVERNOR_TEMP_UNKNOWN;
+    uint64_t sustainable = cpu_fps(sample);
+    int64_t target = this->mFps;
+    enum MGovernorReason reason = MGOVERNOR_STEADY;
+
+    this->mLast = *sample;
+
+    if (known_temp && sample->temp >= MGOVERNOR_HOT)
+    {
+        target -= step(this->mFps, 4);
+        reason = MGOVERNOR_THERMAL;
+    }
+    else if (sample->load > MGOVERNOR_LOAD_HIGH)
+    {
+        target -= step(this->mFps, 8);
+        reason = MGOVERNOR_LOAD;
+    }
+    else if (sustainable != 0 && sustainable < this->mFps)
+    {
+        target = sustainable;
+        reason = MGOVERNOR_CPU;
+    }
+    else if ((!known_temp || sample->temp < MGOVERNOR_COOL) &&
+             sample->load < MGOVERNOR_LOAD_LOW &&
+             this->mFps < this->mMaxFps)
+    {
+        target += step(this->mFps, 8);
+        if (sustainable != 0 && target > (int64_t)sustainable)
+        {
+            target = sustainable;
+        }
+        reason = MGOVERNOR_HEADROOM;
+    }
+
+    if (target < this->mMinFps)
+    {
+        target = this->mMinFps;
+    }
+    if (target > this->mMaxFps)
+    {
+        target = this->mMaxFps;
+    }
+
+    /* pinned at a bound by pressure still reports the pressure */
+    if (target != this->mFps ||
+        (reason != MGOVERNOR_STEADY && reason != MGOVERNOR_HEADROOM))
+    {
+        this->mReason = reason;
+    }
+    else if (this->mFps == this->mMaxFps)
+    {
+        this->mReason = MGOVERNOR_STEADY;
+    }
+    this->mFps = (uint32_t)target;
+    return this->mFps;
+}
+
+const char *mgovernor_reason(enum MGovernorReason reason)
+{
+    switch (reason)
+    {
+    case MGOVERNOR_HEADROOM:
+        return "headroom";
+    case MGOVERNOR_THERMAL:
+        return "thermal";
+    case MGOVERNOR_LOAD:
+        return "load";
+    case MGOVERNOR_CPU:
+        return "cpu";
+    default:
+        return "steady";
+    }
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_GOVERNOR_H
+#define M_GOVERNOR_H
+
+#include <stdint.h>
+
+/*
+ * Frame rate governor: every interval, look at how much CPU our frames
+ * cost, how loaded the system is and how hot the board runs, and move
+ * the frame cap between a floor and a ceiling. Heat and load step the
+ * rate down quickly, headroom brings it back up gradually.
+ */
+#define MGOVERNOR_INTERVAL_NS (1000000000ull)
+
+#define MGOVERNOR_HOT (80000)  /* millidegrees C, throttle at and above */
+#define MGOVERNOR_COOL (75000) /* millidegrees C, room to speed up below */
+#define MGOVERNOR_LOAD_HIGH (1000) /* runnable tasks per CPU, in 1/1000 */
+#define MGOVERNOR_LOAD_LOW (700)
+#define MGOVERNOR_CPU_SHARE (500) /* most of a core frames may use, in 1/1000 */
+
+#define MGOVERNOR_TEMP_UNKNOWN (INT32_MIN)
+
+enum MGovernorReason
+{
+    MGOVERNOR_STEADY,
+    MGOVERNOR_HEADROOM,
+    MGOVERNOR_THERMAL,
+    MGOVERNOR_LOAD,
+    MGOVERNOR_CPU,
+};
+
+/*
+ * What happened over one interval.
+ */
+struct MGovernorSample
+{
+    uint64_t cpu_ns;    /* CPU time of the whole process */
+    uint64_t period_ns; /* wall time */
+    uint64_t frames;    /* frames captured */
+    uint32_t load;      /* 1 minute load average per CPU, in 1/1000 */
+    int32_t temp;       /* hottest thermal zone in millidegrees C */
+};
+
+struct MGovernor
+{
+    uint32_t mMinFps;
+    uint32_t mMaxFps;
+    uint32_t mFps; /* current frame cap */
+    enum MGovernorReason mReason; /* why mFps is what it is */
+    struct MGovernorSample mLast;
+
+    /* totals at the last sample */
+    uint64_t mCpuTime;
+    uint64_t mTime;
+    uint64_t mFrames;
+};
+
+/**
+ * Start at @param max_fps.
+ */
+void mgovernor_init(struct MGovernor *this, uint32_t min_fps, uint32_t max_fps);
+
+/**
+ * Measure the interval since the last call.
+ * @param frames total frames captured so far
+ * @return 0 if @param sample was filled, -1 on the first call
+ */
+int mgovernor_sample(struct MGovernor *this, uint64_t now, uint64_t frames,
+                     struct MGovernorSample *sample);
+
+/**
+ * Pick the frame cap for the next interval.
+ * @return the new cap in fps
+ */
+uint32_t mgovernor_update(struct MGovernor *this,
+                          const struct MGovernorSample *sample);
+
+const char *mgovernor_reason(enum MGovernorReason reason);
+
+#endif // M_GOVERNOR_H
@@ -0,0 +1,184 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "mheatmap.h"
+#include "mlog.h"
+
+int mheatmap_init(struct MHeatmap *this,
+                  uint32_t max_width, uint32_t max_height)
+{
+    memset(this, 0, sizeof(*this));
+    this->mCols = (max_width + MHEATMAP_TILE - 1) / MHEATMAP_TILE;
+    this->mRows = (max_height + MHEATMAP_TILE - 1) / MHEATMAP_TILE;
+
+    this->mCounts = calloc((size_t)this->mCols * this->mRows,
+                           sizeof(this->mCounts[0]));
+    if (this->mCounts == NULL)
+    {
+        MLOGE("error allocating damage heatmap\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void mheatmap_destroy(struct MHeatmap *this)
+{
+    free(this->mCounts);
+    this->mCounts = NULL;
+}
+
+static int size_bucket(uint64_t area)
+{
+    int bucket = 63 - __builtin_clzll(area);
+    return bucket < MHEATMAP_SIZE_BUCKETS ? bucket : MHEATMAP_SIZE_BUCKETS - 1;
+}
+
+void mheatmap_add(struct MHeatmap *this, const MRect *rects, int nrects)
+{
+    int i;
+    uint32_t col, row;
+
+    if (nrects <= 0)
+    {
+        return;
+    }
+    this->mFrames++;
+
+    for (i = 0; i < nrects; ++i)
+    {
+        const MRect *r = &rects[i];
+        if (r->width == 0 || r->height == 0 || r->x < 0 || r->y < 0)
+        {
+            continue;
+        }
+
+        this->mRects++;
+        this->mSizes[size_bucket((uint64_t)r->width * r->height)]++;
+
+        /*
+         * Non-overlapping rectangles can still share a tile, which then
+         * counts twice. Close enough for a frequency map.
+         */
+        uint32_t col_end = (r->x + r->width - 1) / MHEATMAP_TILE;
+        uint32_t row_end = (r->y + r->height - 1) / MHEATMAP_TILE;
+        col_end = col_end < this->mCols ? col_end : this->mCols - 1;
+        row_end = row_end < this->mRows ? row_end : this->mRows - 1;
+        for (row = r->y / MHEATMAP_TILE; row <= row_end; ++row)
+        {
+            for (col = r->x / MHEATMAP_TILE; col <= col_end; ++col)
+            {
+                this->mCounts[row * this->mCols + col]++;
+            }
+        }
+    }
+}
+
+static int write_pgm(struct MHeatmap *this, const char *path)
+{
+    uint32_t i, n = this->mCols * this->mRows, max = 0;
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+    {
+        MLOGE("error writing %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < n; ++i)
+    {
+        max = this->mCounts[i] > max ? this->mCounts[i] : max;
+    }
+
+    fprintf(f, "P5\n# %llu damaged frames, hottest tile %u\n%u %u\n255\n",
+            (unsigned long long)this->mFrames, max, this->mCols, this->mRows);
+    for (i = 0; i < n; ++i)
+    {
+        fputc(max ? (int)((uint64_t)this->mCounts[i] * 255 / max) : 0, f);
+    }
+
+    if (fclose(f) != 0)
+    {
+        MLOGE("error writing %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int write_csv(struct MHeatmap *this, const char *path)
+{
+    int i;
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        MLOGE("error writing %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "min_area,max_area,rects\n");
+    for (i = 0; i < MHEATMAP_SIZE_BUCKETS; ++i)
+    {
+        uint64_t min = 1ull << i;
+        uint64_t max = i < MHEATMAP_SIZE_BUCKETS - 1 ? (min << 1) - 1 : 0;
+        if (max)
+        {
+            fprintf(f, "%llu,%llu,%llu\n", (unsigned long long)min,
+                    (unsigned long long)max,
+                    (unsigned long long)this->mSizes[i]);
+        }
+        else
+        {
+            /* the last bucket is open ended */
+            fprintf(f, "%llu,,%llu\n", (unsigned long long)min,
+                    (unsigned long long)this->mSizes[i]);
+        }
+    }
+
+    if (fclose(f) != 0)
+    {
+        MLOGE("error writing %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int mheatmap_write(struct MHeatmap *this, const char *prefix)
+{
+    char path[PATH_MAX];
+    int err = 0;
+
+    snprintf(path, sizeof(path), "%s.pgm", prefix);
+    err |= write_pgm(this, path);
+    snprintf(path, sizeof(path), "%s.csv", prefix);
+    err |= write_csv(this, path);
+
+    if (err == 0)
+    {
+        MLOGI("damage heatmap of %llu frames, %llu rects written to %s.*\n",
+              (unsigned long long)this->mFrames,
+              (unsigned long long)this->mRects, prefix);
+    }
+    return err;
+}
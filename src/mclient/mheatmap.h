@@ -0,0 +1,64 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_HEATMAP_H
+#define M_HEATMAP_H
+
+#include <stdint.h>
+
+#include "mlib.h"
+
+/*
+ * Damage statistics over a session: how often each tile of the screen
+ * was damaged and how large the damage rectangles were, to tell what
+ * kind of updates the desktop actually produces.
+ */
+#define MHEATMAP_TILE (32) /* tile side in px */
+
+/* rectangle areas in power-of-two buckets, [2^n, 2^(n+1)) px */
+#define MHEATMAP_SIZE_BUCKETS (24)
+
+struct MHeatmap
+{
+    uint32_t mCols;
+    uint32_t mRows;
+    uint32_t *mCounts; /* damaged frames per tile, row major */
+
+    uint64_t mSizes[MHEATMAP_SIZE_BUCKETS];
+    uint64_t mFrames; /* frames with damage */
+    uint64_t mRects;
+};
+
+/**
+ * Size the map for the largest expected screen.
+ */
+int mheatmap_init(struct MHeatmap *this,
+                  uint32_t max_width, uint32_t max_height);
+void mheatmap_destroy(struct MHeatmap *this);
+
+/**
+ * Count the damage of one frame. Rectangles must not overlap.
+ */
+void mheatmap_add(struct MHeatmap *this, const MRect *rects, int nrects);
+
+/**
+ * Write PREFIX.pgm (tile counts scaled to 0-255) and PREFIX.csv (size
+ * histogram).
+ */
+int mheatmap_write(struct MHeatmap *this, const char *prefix);
+
+#endif // M_HEATMAP_H
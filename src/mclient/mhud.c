@@ -0,0 +1,192 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "mhud.h"
+#include "mlog.h"
+
+/* premultiplied BGRA */
+#define BACKGROUND (0xc0000000)
+#define FOREGROUND (0xffffffff)
+
+#define PADDING (4)
+#define ADVANCE ((MHUD_GLYPH_WIDTH + 1) * MHUD_SCALE)
+#define LINE_HEIGHT ((MHUD_GLYPH_HEIGHT + 2) * MHUD_SCALE)
+
+static const char glyph_chars[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ.:/-%";
+
+/* one row of 3 bits per line, most significant bit on the left */
+static const uint8_t glyphs[][MHUD_GLYPH_HEIGHT] = {
+    {7, 5, 5, 5, 7}, /* 0 */
+    {2, 6, 2, 2, 7}, /* 1 */
+    {7, 1, 7, 4, 7}, /* 2 */
+    {7, 1, 7, 1, 7}, /* 3 */
+    {5, 5, 7, 1, 1}, /* 4 */
+    {7, 4, 7, 1, 7}, /* 5 */
+    {7, 4, 7, 5, 7}, /* 6 */
+    {7, 1, 1, 1, 1}, /* 7 */
+    {7, 5, 7, 5, 7}, /* 8 */
+    {7, 5, 7, 1, 7}, /* 9 */
+    {2, 5, 7, 5, 5}, /* A */
+    {6, 5, 6, 5, 6}, /* B */
+    {3, 4, 4, 4, 3}, /* C */
+    {6, 5, 5, 5, 6}, /* D */
+    {7, 4, 6, 4, 7}, /* E */
+    {7, 4, 6, 4, 4}, /* F */
+    {3, 4, 5, 5, 3}, /* G */
+    {5, 5, 7, 5, 5}, /* H */
+    {7, 2, 2, 2, 7}, /* I */
+    {1, 1, 1, 5, 2}, /* J */
+    {5, 5, 6, 5, 5}, /* K */
+    {4, 4, 4, 4, 7}, /* L */
+    {5, 7, 7, 5, 5}, /* M */
+    {6, 5, 5, 5, 5}, /* N */
+    {2, 5, 5, 5, 2}, /* O */
+    {6, 5, 6, 4, 4}, /* P */
+    {2, 5, 5, 6, 3}, /* Q */
+    {6, 5, 6, 5, 5}, /* R */
+    {3, 4, 2, 1, 6}, /* S */
+    {7, 2, 2, 2, 2}, /* T */
+    {5, 5, 5, 5, 7}, /* U */
+    {5, 5, 5, 5, 2}, /* V */
+    {5, 5, 7, 7, 5}, /* W */
+    {5, 5, 2, 5, 5}, /* X */
+    {5, 5, 2, 2, 2}, /* Y */
+    {7, 1, 2, 4, 7}, /* Z */
+    {0, 0, 0, 0, 2}, /* . */
+    {0, 2, 0, 2, 0}, /* : */
+    {1, 1, 2, 4, 4}, /* / */
+    {0, 0, 7, 0, 0}, /* - */
+    {5, 1, 2, 4, 5}, /* % */
+};
+
+static const uint8_t *find_glyph(char c)
+{
+    const char *p;
+    if (c == '\0' || (p = strchr(glyph_chars, toupper((unsigned char)c))) == NULL)
+    {
+        return NULL;
+    }
+    return glyphs[p - glyph_chars];
+}
+
+void mhud_draw_text(uint32_t *pixels, uint32_t stride,
+                    uint32_t width, uint32_t height,
+                    int x, int y, int scale,
+                    const char *text, uint32_t color)
+{
+    int gx, gy;
+
+    for (; *text != '\0'; ++text, x += (MHUD_GLYPH_WIDTH + 1) * scale)
+    {
+        const uint8_t *glyph = find_glyph(*text);
+        if (glyph == NULL)
+        {
+            continue;
+        }
+
+        for (gy = 0; gy < MHUD_GLYPH_HEIGHT * scale; ++gy)
+        {
+            uint8_t row = glyph[gy / scale];
+            for (gx = 0; gx < MHUD_GLYPH_WIDTH * scale; ++gx)
+            {
+                int px = x + gx, py = y + gy;
+                if (!(row & (4 >> (gx / scale))) ||
+                    px < 0 || py < 0 ||
+                    (uint32_t)px >= width || (uint32_t)py >= height)
+                {
+                    continue;
+                }
+                pixels[py * stride + px] = color;
+            }
+        }
+    }
+}
+
+int mhud_init(struct MHud *this, MDisplay *mdpy, uint32_t x, uint32_t y)
+{
+    memset(this, 0, sizeof(*this));
+    this->mMdpy = mdpy;
+
+    this->mBuffer.width = MHUD_COLUMNS * ADVANCE + 2 * PADDING;
+    this->mBuffer.height = MHUD_LINES * LINE_HEIGHT + 2 * PADDING;
+    if (MCreateBuffer(mdpy, &this->mBuffer) < 0)
+    {
+        MLOGE("error creating HUD buffer\n");
+        return -1;
+    }
+
+    if (MUpdateBuffer(mdpy, &this->mBuffer, x, y) < 0)
+    {
+        MLOGE("error placing HUD buffer\n");
+        return -1;
+    }
+
+    return mhud_show(this, "");
+}
+
+int mhud_show(struct MHud *this, const char *text)
+{
+    MBuffer *buf = &this->mBuffer;
+    char line[MHUD_COLUMNS + 1];
+    uint32_t x, y;
+    int i;
+
+    if (MLockBuffer(this->mMdpy, buf) < 0)
+    {
+        MLOGE("MLockBuffer failed!\n");
+        return -1;
+    }
+
+    uint32_t *pixels = (uint32_t *)buf->bits;
+    for (y = 0; y < buf->height; ++y)
+    {
+        for (x = 0; x < buf->width; ++x)
+        {
+            pixels[y * buf->stride + x] = BACKGROUND;
+        }
+    }
+
+    for (i = 0; i < MHUD_LINES && *text != '\0'; ++i)
+    {
+        size_t n = strcspn(text, "\n");
+        size_t len = n < MHUD_COLUMNS ? n : MHUD_COLUMNS;
+        memcpy(line, text, len);
+        line[len] = '\0';
+
+        mhud_draw_text(pixels, buf->stride, buf->width, buf->height,
+                       PADDING, PADDING + i * LINE_HEIGHT, MHUD_SCALE,
+                       line, FOREGROUND);
+
+        text += n;
+        if (*text == '\n')
+        {
+            text++;
+        }
+    }
+
+    if (MUnlockBuffer(this->mMdpy, buf) < 0)
+    {
+        MLOGE("MUnlockBuffer failed!\n");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_HUD_H
+#define M_HUD_H
+
+#include <stdint.h>
+
+#include "mlib.h"
+
+/*
+ * Performance overlay: a small surface on top of everything showing a
+ * few lines of text, drawn with a built-in 3x5 bitmap font.
+ */
+#define MHUD_GLYPH_WIDTH (3)
+#define MHUD_GLYPH_HEIGHT (5)
+#define MHUD_SCALE (2)
+
+#define MHUD_COLUMNS (28)
+#define MHUD_LINES (6)
+
+struct MHud
+{
+    MDisplay *mMdpy;
+    MBuffer mBuffer;
+};
+
+/**
+ * Create the overlay surface at @param x, @param y on screen.
+ */
+int mhud_init(struct MHud *this, MDisplay *mdpy, uint32_t x, uint32_t y);
+
+/**
+ * Replace the overlay content, lines of @param text are separated by
+ * newlines and clipped to MHUD_COLUMNS x MHUD_LINES.
+ */
+int mhud_show(struct MHud *this, const char *text);
+
+/**
+ * Draw @param text (single line, case-insensitive) into BGRA pixels.
+ * Characters without a glyph are left blank.
+ */
+void mhud_draw_text(uint32_t *pixels, uint32_t stride,
+                    uint32_t width, uint32_t height,
+                    int x, int y, int scale,
+                    const char *text, uint32_t color);
+
+#endif // M_HUD_H
@@ -0,0 +1,313 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "mloop.h"
+#include "mlog.h"
+
+/*
+ * A tiny epoll based event loop.
+ *
+ * Everything mclient waits on (X connections, the mflinger socket, frame
+ * timers and internal wakeups) is a file descriptor, so a single thread
+ * can sleep on all of them at once instead of parking a thread inside
+ * each blocking call.
+ *
+ * The loop is level-triggered. Sources that buffer data in userspace
+ * (Xlib!) must provide a prepare callback, otherwise events that were
+ * already read off the socket would sit in the queue until the next
+ * unrelated wakeup.
+ */
+
+#define MAX_EVENTS (16)
+
+uint64_t mloop_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void on_wake(void *data, uint32_t events)
+{
+    struct MLoop *this = (struct MLoop *)data;
+    uint64_t count;
+
+    /* reset the eventfd counter */
+    if (read(this->mWakeSource.mFd, &count, sizeof(count)) < 0 &&
+        errno != EAGAIN)
+    {
+        MLOGE("error reading wake eventfd: %s\n", strerror(errno));
+    }
+
+    if (this->mWakeCallback != NULL)
+    {
+        this->mWakeCallback(this->mWakeData, events);
+    }
+}
+
+int mloop_init(struct MLoop *this)
+{
+    memset(this, 0, sizeof(*this));
+
+    this->mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->mEpollFd < 0)
+    {
+        MLOGE("error creating epoll instance: %s\n", strerror(errno));
+        return -1;
+    }
+
+    this->mWakeSource.mFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->mWakeSource.mFd < 0)
+    {
+        MLOGE("error creating wake eventfd: %s\n", strerror(errno));
+        close(this->mEpollFd);
+        return -1;
+    }
+    this->mWakeSource.mEvents = EPOLLIN;
+    this->mWakeSource.mCallback = on_wake;
+    this->mWakeSource.mData = this;
+
+    if (mloop_add_source(this, &this->mWakeSource) < 0)
+    {
+        close(this->mWakeSource.mFd);
+        close(this->mEpollFd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void mloop_destroy(struct MLoop *this)
+{
+    mloop_remove_source(this, &this->mWakeSource);
+    close(this->mWakeSource.mFd);
+    close(this->mEpollFd);
+    this->mEpollFd = -1;
+}
+
+int mloop_add_source(struct MLoop *this, struct MLoopSource *src)
+{
+    struct epoll_event ev = {0};
+    ev.events = src->mEvents;
+    ev.data.ptr = src;
+
+    if (epoll_ctl(this->mEpollFd, EPOLL_CTL_ADD, src->mFd, &ev) < 0)
+    {
+        MLOGE("error adding fd %d to epoll: %s\n", src->mFd, strerror(errno));
+        return -1;
+    }
+
+    src->mNext = this->mSources;
+    this->mSources = src;
+    return 0;
+}
+
+void mloop_remove_source(struct MLoop *this, struct MLoopSource *src)
+{
+    struct MLoopSource **it;
+    for (it = &this->mSources; *it != NULL; it = &(*it)->mNext)
+    {
+        if (*it == src)
+        {
+            *it = src->mNext;
+            break;
+        }
+    }
+
+    /* the fd may already be closed, so failure here is fine */
+    epoll_ctl(this->mEpollFd, EPOLL_CTL_DEL, src->mFd, NULL);
+    src->mNext = NULL;
+}
+
+static void on_timer(void *data, uint32_t events)
+{
+    struct MLoopTimer *timer = (struct MLoopTimer *)data;
+    uint64_t expirations;
+
+    if (read(timer->mSource.mFd, &expirations, sizeof(expirations)) < 0)
+    {
+        /* EAGAIN: the timer was re-armed after it became readable */
+        if (errno != EAGAIN)
+        {
+            MLOGE("error reading timerfd: %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    timer->mCallback(timer->mData, events);
+}
+
+int mloop_timer_init(struct MLoop *this, struct MLoopTimer *timer,
+                     mloop_callback callback, void *data)
+{
+    memset(timer, 0, sizeof(*timer));
+
+    timer->mSource.mFd = timerfd_create(CLOCK_MONOTONIC,
+                                        TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer->mSource.mFd < 0)
+    {
+        MLOGE("error creating timerfd: %s\n", strerror(errno));
+        return -1;
+    }
+    timer->mSource.mEvents = EPOLLIN;
+    timer->mSource.mCallback = on_timer;
+    timer->mSource.mData = timer;
+    timer->mCallback = callback;
+    timer->mData = data;
+
+    if (mloop_add_source(this, &timer->mSource) < 0)
+    {
+        close(timer->mSource.mFd);
+        return -1;
+    }
+
+    return 0;
+}
+
+void mloop_timer_destroy(struct MLoop *this, struct MLoopTimer *timer)
+{
+    mloop_remove_source(this, &timer->mSource);
+    close(timer->mSource.mFd);
+    timer->mSource.mFd = -1;
+}
+
+static void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / 1000000000ull;
+    ts->tv_nsec = ns % 1000000000ull;
+}
+
+int mloop_timer_set(struct MLoopTimer *timer,
+                    uint64_t deadline_ns, uint64_t interval_ns)
+{
+    struct itimerspec its = {{0}};
+    ns_to_timespec(deadline_ns, &its.it_value);
+    ns_to_timespec(interval_ns, &its.it_interval);
+
+    if (timerfd_settime(timer->mSource.mFd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+    {
+        MLOGE("error arming timerfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int mloop_wake(struct MLoop *this)
+{
+    uint64_t one = 1;
+
+    /* EAGAIN means the counter is saturated, i.e. a wakeup is pending */
+    if (write(this->mWakeSource.mFd, &one, sizeof(one)) < 0 &&
+        errno != EAGAIN)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+void mloop_set_wake_callback(struct MLoop *this,
+                             mloop_callback callback, void *data)
+{
+    this->mWakeCallback = callback;
+    this->mWakeData = data;
+}
+
+void mloop_quit(struct MLoop *this)
+{
+    this->mQuit = 1;
+}
+
+/**
+ * @return non-zero if any source already has work queued
+ */
+static int prepare_sources(struct MLoop *this)
+{
+    int pending = 0;
+    struct MLoopSource *src;
+    for (src = this->mSources; src != NULL; src = src->mNext)
+    {
+        if (src->mPrepare != NULL && src->mPrepare(src->mData))
+        {
+            pending = 1;
+        }
+    }
+
+    return pending;
+}
+
+static void dispatch_pending(struct MLoop *this)
+{
+    struct MLoopSource *src, *next;
+    for (src = this->mSources; src != NULL && !this->mQuit; src = next)
+    {
+        /* callbacks may unregister themselves */
+        next = src->mNext;
+        if (src->mPrepare != NULL && src->mPrepare(src->mData))
+        {
+            src->mCallback(src->mData, EPOLLIN);
+        }
+    }
+}
+
+int mloop_run(struct MLoop *this)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int i, n;
+
+    this->mQuit = 0;
+    while (!this->mQuit)
+    {
+        /* never sleep while a source has work buffered in userspace */
+        if (prepare_sources(this))
+        {
+            dispatch_pending(this);
+            continue;
+        }
+
+        n = epoll_wait(this->mEpollFd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            MLOGE("epoll_wait error: %s\n", strerror(errno));
+            return -1;
+        }
+
+        for (i = 0; i < n && !this->mQuit; ++i)
+        {
+            struct MLoopSource *src = (struct MLoopSource *)events[i].data.ptr;
+            src->mCallback(src->mData, events[i].events);
+        }
+    }
+
+    return 0;
+}
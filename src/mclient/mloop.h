@@ -0,0 +1,106 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_LOOP_H
+#define M_LOOP_H
+
+#include <stdint.h>
+
+/**
+ * Called when a source's fd becomes ready.
+ * @param events the epoll event mask that fired
+ */
+typedef void (*mloop_callback)(void *data, uint32_t events);
+
+/**
+ * Called before the loop goes to sleep.
+ * @return non-zero if the source already has queued work (e.g. events
+ * Xlib read off the wire while handling a reply) and must be dispatched
+ * without waiting on its fd.
+ */
+typedef int (*mloop_prepare)(void *data);
+
+struct MLoopSource
+{
+    int mFd;
+    uint32_t mEvents; /* epoll events to watch for */
+    mloop_callback mCallback;
+    mloop_prepare mPrepare; /* optional */
+    void *mData;
+
+    struct MLoopSource *mNext;
+};
+
+struct MLoopTimer
+{
+    struct MLoopSource mSource; /* backed by its own timerfd */
+    mloop_callback mCallback;
+    void *mData;
+};
+
+struct MLoop
+{
+    int mEpollFd;
+    int mQuit;
+    struct MLoopSource *mSources;
+
+    /* eventfd for waking the loop from signal handlers or other threads */
+    struct MLoopSource mWakeSource;
+    mloop_callback mWakeCallback;
+    void *mWakeData;
+};
+
+int mloop_init(struct MLoop *this);
+void mloop_destroy(struct MLoop *this);
+
+/*
+ * Sources and timers are owned by the caller and must
+ * outlive their registration with the loop.
+ */
+int mloop_add_source(struct MLoop *this, struct MLoopSource *src);
+void mloop_remove_source(struct MLoop *this, struct MLoopSource *src);
+
+int mloop_timer_init(struct MLoop *this, struct MLoopTimer *timer,
+                     mloop_callback callback, void *data);
+void mloop_timer_destroy(struct MLoop *this, struct MLoopTimer *timer);
+
+/**
+ * Arm a timer to fire at an absolute CLOCK_MONOTONIC deadline, then every
+ * @param interval_ns (0 = one-shot). A @param deadline_ns of 0 disarms.
+ */
+int mloop_timer_set(struct MLoopTimer *timer,
+                    uint64_t deadline_ns, uint64_t interval_ns);
+
+/**
+ * Async-signal-safe and thread-safe. The wake callback runs on the
+ * loop thread on its next iteration.
+ */
+int mloop_wake(struct MLoop *this);
+void mloop_set_wake_callback(struct MLoop *this,
+                             mloop_callback callback, void *data);
+
+/**
+ * Dispatch events until mloop_quit() is called.
+ * @return 0 on a clean quit, -1 on error
+ */
+int mloop_run(struct MLoop *this);
+void mloop_quit(struct MLoop *this);
+
+/* CLOCK_MONOTONIC in ns */
+uint64_t mloop_now(void);
+
+#endif // M_LOOP_H
@@ -0,0 +1,113 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mpacer.h"
+
+/* backlog is measured in frames of this length when uncapped */
+#define DEFAULT_FRAME_NS (16666667ull)
+
+/* never back off to less than this fraction of the frame cap */
+#define MAX_BACKOFF (4)
+
+void mpacer_init(struct MPacer *this, uint32_t max_fps)
+{
+    this->mInterval = max_fps ? 1000000000ull / max_fps : 0;
+    this->mMinInterval = this->mInterval;
+    this->mLastFrame = 0;
+    this->mDeadline = 0;
+    this->mLatency = 0;
+    this->mQueueDelay = 0;
+}
+
+void mpacer_set_max_fps(struct MPacer *this, uint32_t max_fps)
+{
+    uint64_t interval = max_fps ? 1000000000ull / max_fps : 0;
+
+    /* not backed off, follow the cap directly */
+    if (this->mInterval == this->mMinInterval || this->mInterval < interval)
+    {
+        this->mInterval = interval;
+    }
+    this->mMinInterval = interval;
+}
+
+uint64_t mpacer_request(struct MPacer *this, uint64_t now)
+{
+    if (this->mDeadline)
+    {
+        /* already scheduled, the pending frame picks up this damage too */
+        return 0;
+    }
+
+    uint64_t next = this->mLastFrame + this->mInterval;
+    if (this->mLastFrame == 0 || next < now)
+    {
+        /* idle for at least one interval, render right away */
+        next = now;
+    }
+
+    this->mDeadline = next;
+    return next;
+}
+
+void mpacer_begin_frame(struct MPacer *this, uint64_t now)
+{
+    this->mLastFrame = now;
+    this->mDeadline = 0;
+}
+
+/* exponentially weighted moving average, 1/8 weight for new samples */
+static uint64_t smooth(uint64_t avg, uint64_t sample)
+{
+    return avg ? avg - avg / 8 + sample / 8 : sample;
+}
+
+void mpacer_feedback(struct MPacer *this, uint64_t damage, uint64_t posted,
+                     uint64_t latched, uint64_t presented)
+{
+    uint64_t frame = this->mMinInterval ? this->mMinInterval : DEFAULT_FRAME_NS;
+
+    if (presented && presented >= damage)
+    {
+        this->mLatency = smooth(this->mLatency, presented - damage);
+    }
+    if (latched && latched >= posted)
+    {
+        this->mQueueDelay = smooth(this->mQueueDelay, latched - posted);
+    }
+
+    if (!latched || this->mQueueDelay > frame)
+    {
+        /* frames pile up or get replaced unseen, slow down */
+        uint64_t step = this->mInterval / 8 > frame / 16 ? this->mInterval / 8
+                                                         : frame / 16;
+        this->mInterval += step;
+        if (this->mInterval > frame * MAX_BACKOFF)
+        {
+            this->mInterval = frame * MAX_BACKOFF;
+        }
+    }
+    else if (this->mQueueDelay < frame / 2 && this->mInterval > this->mMinInterval)
+    {
+        /* the compositor keeps up, creep back towards the cap */
+        this->mInterval -= this->mInterval / 16 + 1;
+        if (this->mInterval < this->mMinInterval)
+        {
+            this->mInterval = this->mMinInterval;
+        }
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_PACER_H
+#define M_PACER_H
+
+#include <stdint.h>
+
+/*
+ * Frame pacing: coalesces bursts of damage into at most
+ * one capture per frame interval.
+ *
+ * With compositor feedback the interval also backs off while posted
+ * frames queue up in front of the compositor (or get dropped), there
+ * is no point in capturing faster than they reach the screen.
+ */
+struct MPacer
+{
+    uint64_t mInterval;    /* minimum ns between frames */
+    uint64_t mMinInterval; /* from the frame cap */
+    uint64_t mLastFrame;   /* start of the last frame in ns, 0 = never */
+    uint64_t mDeadline;    /* scheduled frame in ns, 0 = none */
+
+    uint64_t mLatency;    /* smoothed damage-to-photon ns, 0 = unknown */
+    uint64_t mQueueDelay; /* smoothed post-to-latch ns */
+};
+
+void mpacer_init(struct MPacer *this, uint32_t max_fps);
+
+/**
+ * Change the frame cap, e.g. from the governor. Backoff above the new
+ * cap is kept.
+ */
+void mpacer_set_max_fps(struct MPacer *this, uint32_t max_fps);
+
+/**
+ * Request a frame.
+ * @return the deadline at which the frame should be rendered, or 0 if a
+ * frame is already scheduled and the caller has nothing to do
+ */
+uint64_t mpacer_request(struct MPacer *this, uint64_t now);
+
+/**
+ * Mark the scheduled frame as started.
+ */
+void mpacer_begin_frame(struct MPacer *this, uint64_t now);
+
+/**
+ * Feed back what happened to a posted frame, all in CLOCK_MONOTONIC ns.
+ * @param damage when the frame's first damage arrived
+ * @param latched/@param presented 0 if the frame never made it
+ */
+void mpacer_feedback(struct MPacer *this, uint64_t damage, uint64_t posted,
+                     uint64_t latched, uint64_t presented);
+
+#endif // M_PACER_H
@@ -0,0 +1,215 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xpresent.h>
+
+#include "mpresent.h"
+#include "mlog.h"
+
+/*
+ * Tracks X Present activity so captures can be timed to the moment a
+ * client finished presenting a frame.
+ *
+ * Present events are only reported to selections on the window that was
+ * presented to, so we select on every top-level window and, since window
+ * managers reparent client windows into frames, on their children too.
+ * New windows are picked up through SubstructureNotify on the root.
+ *
+ * This runs on its own X connection so the flood of structure events
+ * never gets in the way of damage processing on the capture connection.
+ */
+
+static int is_present_event(struct MPresent *this, XEvent *ev)
+{
+    return ev->xcookie.type == GenericEvent &&
+           ev->xcookie.extension == this->mOpcode;
+}
+
+static void select_window(struct MPresent *this, Window win)
+{
+    XPresentSelectInput(this->mXdpy, win,
+                        PresentCompleteNotifyMask | PresentIdleNotifyMask);
+}
+
+static void select_tree(struct MPresent *this, Window win, int depth)
+{
+    Window root_ret, parent_ret, *children = NULL;
+    unsigned int i, n = 0;
+
+    select_window(this, win);
+    if (depth == 0)
+    {
+        return;
+    }
+
+    if (XQueryTree(this->mXdpy, win, &root_ret, &parent_ret, &children, &n))
+    {
+        for (i = 0; i < n; ++i)
+        {
+            select_tree(this, children[i], depth - 1);
+        }
+        XFree(children);
+    }
+}
+
+/* Xlib error handlers are process-wide, so chain to whoever was first */
+static Display *present_dpy;
+static XErrorHandler chained_error_handler;
+
+static int on_x_error(Display *dpy, XErrorEvent *ev)
+{
+    /* windows routinely vanish between notification and selection */
+    if (dpy == present_dpy)
+    {
+        return 0;
+    }
+
+    return chained_error_handler != NULL ? chained_error_handler(dpy, ev) : 0;
+}
+
+static void on_event(struct MPresent *this, XEvent *ev)
+{
+    Display *dpy = this->mXdpy;
+
+    switch (ev->type)
+    {
+    case CreateNotify:
+        select_window(this, ev->xcreatewindow.window);
+        return;
+
+    case ReparentNotify:
+        /* a client window moving into a window manager frame */
+        select_window(this, ev->xreparent.window);
+        return;
+
+    default:
+        break;
+    }
+
+    if (!is_present_event(this, ev) || !XGetEventData(dpy, &ev->xcookie))
+    {
+        return;
+    }
+
+    this->mLastEvent = mloop_now();
+    if (ev->xcookie.evtype == PresentCompleteNotify)
+    {
+        XPresentCompleteNotifyEvent *cev =
+            (XPresentCompleteNotifyEvent *)ev->xcookie.data;
+
+        /* NotifyMSC completions are timers, not frames */
+        if (cev->kind == PresentCompleteKindPixmap &&
+            this->mOnComplete != NULL)
+        {
+            this->mOnComplete(this->mData);
+        }
+    }
+
+    XFreeEventData(dpy, &ev->xcookie);
+}
+
+static int on_prepare(void *data)
+{
+    struct MPresent *this = (struct MPresent *)data;
+    XFlush(this->mXdpy);
+    return XEventsQueued(this->mXdpy, QueuedAlready) > 0;
+}
+
+static void on_readable(void *data, uint32_t events)
+{
+    struct MPresent *this = (struct MPresent *)data;
+    XEvent ev;
+
+    while (XPending(this->mXdpy))
+    {
+        XNextEvent(this->mXdpy, &ev);
+        on_event(this, &ev);
+    }
+}
+
+int mpresent_init(struct MPresent *this, struct MLoop *loop,
+                  mpresent_callback on_complete, void *data)
+{
+    memset(this, 0, sizeof(*this));
+    this->mOnComplete = on_complete;
+    this->mData = data;
+
+    this->mXdpy = XOpenDisplay(NULL);
+    if (this->mXdpy == NULL)
+    {
+        MLOGE("Failed to open display.\n");
+        return -1;
+    }
+
+    int event_base, error_base;
+    if (!XPresentQueryExtension(this->mXdpy, &this->mOpcode,
+                                &event_base, &error_base))
+    {
+        MLOGE("Present extension unavailable!\n");
+        XCloseDisplay(this->mXdpy);
+        this->mXdpy = NULL;
+        return -1;
+    }
+
+    present_dpy = this->mXdpy;
+    chained_error_handler = XSetErrorHandler(on_x_error);
+
+    Window root = DefaultRootWindow(this->mXdpy);
+    XSelectInput(this->mXdpy, root, SubstructureNotifyMask);
+    select_tree(this, root, 2);
+
+    this->mSource.mFd = ConnectionNumber(this->mXdpy);
+    this->mSource.mEvents = EPOLLIN;
+    this->mSource.mCallback = on_readable;
+    this->mSource.mPrepare = on_prepare;
+    this->mSource.mData = this;
+    if (mloop_add_source(loop, &this->mSource) < 0)
+    {
+        XCloseDisplay(this->mXdpy);
+        this->mXdpy = NULL;
+        present_dpy = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void mpresent_destroy(struct MPresent *this, struct MLoop *loop)
+{
+    if (this->mXdpy == NULL)
+    {
+        return;
+    }
+
+    mloop_remove_source(loop, &this->mSource);
+    XCloseDisplay(this->mXdpy);
+    this->mXdpy = NULL;
+    present_dpy = NULL;
+}
+
+int mpresent_is_active(struct MPresent *this, uint64_t now)
+{
+    return this->mXdpy != NULL &&
+           this->mLastEvent != 0 &&
+           now - this->mLastEvent < MPRESENT_ACTIVE_NS;
+}
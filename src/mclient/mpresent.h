@@ -0,0 +1,59 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_PRESENT_H
+#define M_PRESENT_H
+
+#include <stdint.h>
+#include <X11/Xlib.h>
+
+#include "mloop.h"
+
+/*
+ * How long after the last Present event a client still counts
+ * as presenting, i.e. worth waiting for.
+ */
+#define MPRESENT_ACTIVE_NS (500 * 1000000ull)
+
+typedef void (*mpresent_callback)(void *data);
+
+struct MPresent
+{
+    Display *mXdpy; /* dedicated connection for Present events */
+    int mOpcode;    /* Present major opcode */
+    struct MLoopSource mSource;
+
+    uint64_t mLastEvent; /* time of the last Present event in ns */
+    mpresent_callback mOnComplete;
+    void *mData;
+};
+
+/**
+ * Start tracking presentations of all top-level windows.
+ * @param on_complete called whenever a client finished presenting a frame
+ */
+int mpresent_init(struct MPresent *this, struct MLoop *loop,
+                  mpresent_callback on_complete, void *data);
+void mpresent_destroy(struct MPresent *this, struct MLoop *loop);
+
+/**
+ * @return 1 if some client presented recently, so damage is likely
+ * followed by a PresentCompleteNotify worth waiting for
+ */
+int mpresent_is_active(struct MPresent *this, uint64_t now);
+
+#endif // M_PRESENT_H
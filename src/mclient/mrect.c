@@ -0,0 +1,135 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mrect.h"
+
+int mrect_is_empty(const MRect *r)
+{
+    return r->width == 0 || r->height == 0;
+}
+
+void mrect_union(MRect *dst, const MRect *src)
+{
+    if (mrect_is_empty(src))
+    {
+        return;
+    }
+    if (mrect_is_empty(dst))
+    {
+        *dst = *src;
+        return;
+    }
+
+    int32_t left = dst->x < src->x ? dst->x : src->x;
+    int32_t top = dst->y < src->y ? dst->y : src->y;
+    int32_t right = dst->x + (int32_t)dst->width;
+    int32_t bottom = dst->y + (int32_t)dst->height;
+    if (src->x + (int32_t)src->width > right)
+    {
+        right = src->x + src->width;
+    }
+    if (src->y + (int32_t)src->height > bottom)
+    {
+        bottom = src->y + src->height;
+    }
+
+    dst->x = left;
+    dst->y = top;
+    dst->width = right - left;
+    dst->height = bottom - top;
+}
+
+int mrect_intersect(MRect *dst, const MRect *clip)
+{
+    int32_t left = dst->x > clip->x ? dst->x : clip->x;
+    int32_t top = dst->y > clip->y ? dst->y : clip->y;
+    int32_t right = dst->x + (int32_t)dst->width;
+    int32_t bottom = dst->y + (int32_t)dst->height;
+    if (clip->x + (int32_t)clip->width < right)
+    {
+        right = clip->x + clip->width;
+    }
+    if (clip->y + (int32_t)clip->height < bottom)
+    {
+        bottom = clip->y + clip->height;
+    }
+
+    if (right <= left || bottom <= top)
+    {
+        dst->width = dst->height = 0;
+        return 0;
+    }
+
+    dst->x = left;
+    dst->y = top;
+    dst->width = right - left;
+    dst->height = bottom - top;
+    return 1;
+}
+
+int mrect_contains(const MRect *outer, const MRect *inner)
+{
+    return inner->x >= outer->x &&
+           inner->y >= outer->y &&
+           inner->x + (int32_t)inner->width <= outer->x + (int32_t)outer->width &&
+           inner->y + (int32_t)inner->height <= outer->y + (int32_t)outer->height;
+}
+
+int mrect_subtract(const MRect *r, const MRect *cut, MRect *out)
+{
+    MRect overlap = *cut;
+    int n = 0;
+
+    if (!mrect_intersect(&overlap, r))
+    {
+        if (!mrect_is_empty(r))
+        {
+            out[n++] = *r;
+        }
+        return n;
+    }
+
+    /* full-width bands above and below, then what is left beside it */
+    int32_t r_bottom = r->y + (int32_t)r->height;
+    int32_t o_right = overlap.x + (int32_t)overlap.width;
+    int32_t o_bottom = overlap.y + (int32_t)overlap.height;
+    if (overlap.y > r->y)
+    {
+        MRect above = {r->x, r->y, r->width, (uint32_t)(overlap.y - r->y)};
+        out[n++] = above;
+    }
+    if (o_bottom < r_bottom)
+    {
+        MRect below = {r->x, o_bottom, r->width, (uint32_t)(r_bottom - o_bottom)};
+        out[n++] = below;
+    }
+    if (overlap.x > r->x)
+    {
+        MRect left = {r->x, overlap.y, (uint32_t)(overlap.x - r->x),
+                      overlap.height};
+        out[n++] = left;
+    }
+    if (o_right < r->x + (int32_t)r->width)
+    {
+        MRect right = {o_right, overlap.y,
+                       (uint32_t)(r->x + (int32_t)r->width - o_right),
+                       overlap.height};
+        out[n++] = right;
+    }
+
+    return n;
+}
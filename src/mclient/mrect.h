@@ -0,0 +1,49 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_RECT_H
+#define M_RECT_H
+
+#include <stdint.h>
+#include "mlib.h"
+
+int mrect_is_empty(const MRect *r);
+
+/**
+ * Grow @param dst to also cover @param src.
+ */
+void mrect_union(MRect *dst, const MRect *src);
+
+/**
+ * Shrink @param dst to its overlap with @param clip.
+ * @return 1 if anything is left, 0 if the result is empty
+ */
+int mrect_intersect(MRect *dst, const MRect *clip);
+
+/**
+ * @return 1 if @param outer fully covers @param inner
+ */
+int mrect_contains(const MRect *outer, const MRect *inner);
+
+/**
+ * Cut @param cut out of @param r.
+ * @param out receives the rest as up to 4 disjoint rectangles
+ * @return number of rectangles in @param out
+ */
+int mrect_subtract(const MRect *r, const MRect *cut, MRect *out);
+
+#endif // M_RECT_H
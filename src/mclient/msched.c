@@ -0,0 +1,280 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "msched.h"
+#include "mlog.h"
+
+#define MAX_CPUS (64)
+
+static const struct
+{
+    const char *name;
+    int policy;
+} policies[] = {
+    {"other", SCHED_OTHER},
+    {"fifo", SCHED_FIFO},
+    {"rr", SCHED_RR},
+};
+
+static int parse_int(const char *s, const char **end, long *out)
+{
+    char *e;
+    errno = 0;
+    *out = strtol(s, &e, 10);
+    if (e == s || errno != 0)
+    {
+        return -1;
+    }
+    *end = e;
+    return 0;
+}
+
+static int parse_cpus(const char *s, uint64_t *cpus)
+{
+    *cpus = 0;
+    for (;;)
+    {
+        long first, last;
+        if (parse_int(s, &s, &first) < 0)
+        {
+            return -1;
+        }
+        last = first;
+        if (*s == '-' && parse_int(s + 1, &s, &last) < 0)
+        {
+            return -1;
+        }
+        if (first < 0 || last < first || last >= MAX_CPUS)
+        {
+            return -1;
+        }
+
+        for (; first <= last; ++first)
+        {
+            *cpus |= 1ull << first;
+        }
+
+        if (*s == '\0')
+        {
+            return 0;
+        }
+        if (*s++ != ',')
+        {
+            return -1;
+        }
+    }
+}
+
+int msched_parse(const char *spec, struct MSchedPolicy *policy)
+{
+    size_t i, n = strcspn(spec, ":@");
+
+    memset(policy, 0, sizeof(*policy));
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i)
+    {
+        if (strlen(policies[i].name) == n &&
+            strncmp(spec, policies[i].name, n) == 0)
+        {
+            break;
+        }
+    }
+    if (i == sizeof(policies) / sizeof(policies[0]))
+    {
+        return -1;
+    }
+    policy->policy = policies[i].policy;
+    spec += n;
+
+    if (*spec == ':')
+    {
+        long value;
+        if (parse_int(spec + 1, &spec, &value) < 0)
+        {
+            return -1;
+        }
+
+        if (policy->policy == SCHED_OTHER)
+        {
+            if (value < -20 || value > 19)
+            {
+                return -1;
+            }
+            policy->nice = value;
+        }
+        else
+        {
+            if (value < sched_get_priority_min(policy->policy) ||
+                value > sched_get_priority_max(policy->policy))
+            {
+                return -1;
+            }
+            policy->priority = value;
+        }
+    }
+    else if (policy->policy != SCHED_OTHER)
+    {
+        /* the lowest real-time priority still beats every normal thread */
+        policy->priority = sched_get_priority_min(policy->policy);
+    }
+
+    if (*spec == '@')
+    {
+        return parse_cpus(spec + 1, &policy->cpus);
+    }
+
+    return *spec == '\0' ? 0 : -1;
+}
+
+void msched_format(const struct MSchedPolicy *policy, char *buf, size_t len)
+{
+    const char *name = "?";
+    size_t i;
+    int n;
+
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i)
+    {
+        if (policies[i].policy == policy->policy)
+        {
+            name = policies[i].name;
+        }
+    }
+
+    n = snprintf(buf, len, "%s:%d", name,
+                 policy->policy == SCHED_OTHER ? policy->nice
+                                               : policy->priority);
+
+    /* CPU list, with runs collapsed into ranges */
+    char sep = '@';
+    int cpu = 0;
+    while (cpu < MAX_CPUS && n >= 0 && (size_t)n < len)
+    {
+        if (!(policy->cpus & (1ull << cpu)))
+        {
+            cpu++;
+            continue;
+        }
+
+        int last = cpu;
+        while (last + 1 < MAX_CPUS && (policy->cpus & (1ull << (last + 1))))
+        {
+            last++;
+        }
+
+        n += last == cpu
+                 ? snprintf(buf + n, len - n, "%c%d", sep, cpu)
+                 : snprintf(buf + n, len - n, "%c%d-%d", sep, cpu, last);
+        sep = ',';
+        cpu = last + 1;
+    }
+}
+
+static pid_t current_tid(void)
+{
+    return syscall(SYS_gettid);
+}
+
+int msched_apply(const struct MSchedPolicy *policy)
+{
+    struct sched_param param = {0};
+    int err = 0, cpu;
+
+    param.sched_priority = policy->priority;
+    if (sched_setscheduler(0, policy->policy, &param) < 0)
+    {
+        MLOGW("error setting scheduling policy: %s\n", strerror(errno));
+        err = -1;
+    }
+
+    /* nice is per thread on Linux */
+    if (policy->policy == SCHED_OTHER &&
+        setpriority(PRIO_PROCESS, current_tid(), policy->nice) < 0)
+    {
+        MLOGW("error setting nice level: %s\n", strerror(errno));
+        err = -1;
+    }
+
+    if (policy->cpus != 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (cpu = 0; cpu < MAX_CPUS; ++cpu)
+        {
+            if (policy->cpus & (1ull << cpu))
+            {
+                CPU_SET(cpu, &set);
+            }
+        }
+
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        {
+            MLOGW("error setting CPU affinity: %s\n", strerror(errno));
+            err = -1;
+        }
+    }
+
+    return err;
+}
+
+int msched_current(struct MSchedPolicy *policy)
+{
+    struct sched_param param;
+    cpu_set_t set;
+    int cpu;
+
+    memset(policy, 0, sizeof(*policy));
+    policy->policy = sched_getscheduler(0);
+    if (policy->policy < 0 || sched_getparam(0, &param) < 0)
+    {
+        return -1;
+    }
+    policy->priority = param.sched_priority;
+
+    errno = 0;
+    policy->nice = getpriority(PRIO_PROCESS, current_tid());
+    if (errno != 0)
+    {
+        return -1;
+    }
+
+    /* a thread allowed on every online CPU is not pinned */
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 &&
+        CPU_COUNT(&set) < sysconf(_SC_NPROCESSORS_ONLN))
+    {
+        for (cpu = 0; cpu < MAX_CPUS; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                policy->cpus |= 1ull << cpu;
+            }
+        }
+    }
+
+    return 0;
+}
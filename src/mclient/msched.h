@@ -0,0 +1,62 @@
+/*
+ * Copyright KOOMPI Co., LTD.
+ * Copyright 2016 The PIONUX OS Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef M_SCHED_H
+#define M_SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Scheduling policy and CPU affinity of an mclient thread, written as
+ *
+ *     POLICY[:VALUE][@CPUS]
+ *
+ * where POLICY is "other" (VALUE = nice level), "fifo" or "rr" (VALUE =
+ * real-time priority) and CPUS is a list like "2,3" or "0-1,4".
+ */
+struct MSchedPolicy
+{
+    int policy;    /* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+    int priority;  /* real-time priority, FIFO and RR only */
+    int nice;      /* SCHED_OTHER only */
+    uint64_t cpus; /* bit per CPU to pin to, 0 = not pinned */
+};
+
+/**
+ * @return 0, -1 if @param spec is malformed or out of range
+ */
+int msched_parse(const char *spec, struct MSchedPolicy *policy);
+
+/**
+ * Write @param policy in the form msched_parse() takes.
+ */
+void msched_format(const struct MSchedPolicy *policy, char *buf, size_t len);
+
+/**
+ * Apply @param policy to the calling thread. Threads it creates later
+ * inherit it.
+ * @return 0, -1 if any part was refused (e.g. no CAP_SYS_NICE)
+ */
+int msched_apply(const struct MSchedPolicy *policy);
+
+/**
+ * @param policy set to what the calling thread actually runs with
+ */
+int msched_current(struct MSchedPolicy *policy);
+
+#endif // M_SCHED_H
@@ -15,15 +15,29 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/un.h>
 #include <sys/uio.h>
 
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/vm_sockets.h>
+
 #include <binder/IBinder.h>
 #include <ui/DisplayInfo.h>
 #include <ui/Rect.h>
@@ -31,14 +45,20 @@
 #include <gui/ISurfaceComposer.h>
 // #include <gui/ISurfaceComposerClient.h> createSurface() flags
 #include <gui/SurfaceComposerClient.h>
+#include <gui/DisplayEventReceiver.h>
 
 #include <android/native_window.h> // ANativeWindow_Buffer full def
+#include <system/window.h>
+#include <hardware/gralloc.h>
 
+#include <cutils/ashmem.h>
 #include <cutils/log.h>
 #include <utils/Errors.h>
 
 #include "mlib.h"
 #include "mlib-protocol.h"
+#include "mseqlock.h"
+#include "mcodec.h"
 
 #define DEBUG (0)
 
@@ -61,20 +81,153 @@ using namespace android;
 static const int DEFAULT_DISPLAY = 0;
 static const int DEFAULT_EXTERNAL_DISPLAY = 1;
 
+/*
+ * Hotplug events tell us about the HDMI display coming and going, but
+ * not about it being turned off. Where the kernel exposes the DPMS state
+ * we poll it, otherwise a connected display is assumed to be on.
+ */
+static const char HDMI_DPMS_PATH[] = "/sys/class/drm/card0-HDMI-A-1/dpms";
+static const int DISPLAY_POLL_MS = 1000;
+
 /*
  * Currently we only support a single client with
- * two surfaces that are usually:
+ * up to three surfaces that are usually:
  *      1. root window surface
  *      2. cursor sprite surface
+ *      3. performance HUD (optional)
+ */
+static const int MAX_SURFACES = 3;
+
+/*
+ * Fenced locks dequeue buffers straight from the ANativeWindow instead of
+ * going through Surface::lock(), which waits for the buffer's acquire
+ * fence and then copies the previous frame back into it.
+ *
+ * That copy needs the buffer to be idle, so the client redraws instead.
+ * We remember which frame each buffer last held and the damage of recent
+ * frames, and grow the dirty region by whatever the buffer missed (the
+ * same idea as EGL_EXT_buffer_age).
+ */
+static const int MAX_BUFFER_SLOTS = 8;
+static const int MAX_DAMAGE_HISTORY = 4;
+
+struct buffer_slot
+{
+    ANativeWindowBuffer *buffer;
+    uint64_t frame; /* frame the buffer holds, 0 = unknown */
+};
+
+struct fenced_surface
+{
+    ANativeWindowBuffer *dequeued;    /* buffer locked by the client */
+    MRect pending;                    /* damage of the frame being drawn */
+    uint64_t frame;                   /* last queued frame */
+    int connected;                    /* connected as a CPU producer */
+    struct buffer_slot slots[MAX_BUFFER_SLOTS];
+    MRect damage[MAX_DAMAGE_HISTORY]; /* damage of frame n at n % size */
+};
+
+/*
+ * Posted frames are remembered until the compositor has latched and
+ * presented them, then their timestamps go out as an
+ * M_EVENT_FRAME_TIMESTAMPS event. Where the compositor does not record
+ * frame timestamps (older releases, host builds) they are simulated as
+ * latched on the next refresh and presented one refresh later.
+ */
+static const int MAX_PENDING_FRAMES = 8;
+static const int FRAME_TIMESTAMPS_POLL_MS = 4;
+static const int64_t FRAME_TIMESTAMPS_TIMEOUT_NS = 500000000;
+static const int64_t DEFAULT_REFRESH_NS = 16666667;
+
+struct pending_frame
+{
+    uint64_t id;    /* compositor frame id */
+    uint32_t frame; /* post number reported to the client */
+    int64_t posted;
+};
+
+struct frame_timing
+{
+    int native;     /* the compositor records timestamps */
+    uint32_t posts; /* frames posted on the surface */
+    struct pending_frame pending[MAX_PENDING_FRAMES];
+    int num_pending;
+};
+
+/*
+ * Clients can publish a surface's position in a shared page instead of
+ * sending M_UPDATE_BUFFER requests. While any page is mapped we ask for
+ * every vsync and apply whatever changed in one transaction.
+ */
+static const int POSITION_READ_TRIES = 4;
+
+struct position_page
+{
+    MPositionPage *page; /* NULL = positions come as requests */
+    uint32_t seq;        /* sequence of the last applied position */
+};
+
+/*
+ * Surfaces can be allocated larger than they are shown, with the excess
+ * cropped away, so that resizing is just a matter of moving the crop.
  */
-static const int MAX_SURFACES = 2;
+struct surface_size
+{
+    uint32_t width;        /* visible size */
+    uint32_t height;
+    uint32_t alloc_width;  /* size of the buffers */
+    uint32_t alloc_height;
+};
+
+/*
+ * With M_SET_ROTATION the compositor turns every surface, and positions
+ * from the client, given in its unrotated coordinates, are mapped onto
+ * the display. The matrices are (dsdx, dtdx, dsdy, dtdy), indexed by
+ * M_ORIENTATION_*.
+ */
+static const float ROTATION_MATRICES[4][4] = {
+    {1, 0, 0, 1},
+    {0, 1, -1, 0},
+    {-1, 0, 0, -1},
+    {0, -1, 1, 0},
+};
+
+struct surface_origin
+{
+    int32_t x; /* last position asked for, unrotated */
+    int32_t y;
+};
 
 struct mflinger_state
 {
     sp<SurfaceComposerClient> compositor;      /* SurfaceFlinger connection */
     sp<SurfaceControl> surfaces[MAX_SURFACES]; /* surfaces alloc'd for clients */
+    struct surface_size sizes[MAX_SURFACES];
+    struct fenced_surface fenced[MAX_SURFACES];
+    struct frame_timing timing[MAX_SURFACES];
+    struct position_page positions[MAX_SURFACES];
+    struct surface_origin origins[MAX_SURFACES];
+    int64_t refresh_ns;                        /* display refresh period */
+    uint32_t orientation;                      /* M_ORIENTATION_* of all surfaces */
+    uint32_t display_width;                    /* rotated display size */
+    uint32_t display_height;
+
+    DisplayEventReceiver *display_events;      /* hotplug, NULL if unavailable */
+    int vsync_on;                              /* vsync events for position pages */
+    int hdmi_connected;                        /* assumed until told otherwise */
+    int visible;                               /* display state last sent */
+    int event_fd;                              /* client event channel, -1 = none */
+    uint32_t event_mask;                       /* M_EVENT_* the client wants */
     int num_surfaces;                          /* num of surfaces currently managed */
     int layerstack;                            /* selects display for surfaces */
+
+    int remote;                                /* client on a network transport */
+    ANativeWindow_Buffer locked[MAX_SURFACES]; /* remote locks, bits NULL = none */
+    uint8_t *scratch;                          /* encoded damage of remote unlocks */
+    size_t scratch_size;
+    char token[M_TOKEN_SIZE];                  /* secret remote clients send first */
+
+    pthread_mutex_t lock;                      /* guards all of the above */
 };
 
 static int32_t buffer_id_to_index(int32_t id)
@@ -104,11 +257,8 @@ static int assign_layerstack()
     return DEFAULT_EXTERNAL_DISPLAY;
 }
 
-static int getDisplayInfo(const int sockfd)
+static void queryDisplayInfo(DisplayInfo &dinfo_ext)
 {
-    /* no request args */
-
-    DisplayInfo dinfo_ext;
     status_t check;
 
     /* undefined display marker */
@@ -132,10 +282,20 @@ static int getDisplayInfo(const int sockfd)
     ALOGD_IF(DEBUG, "HDMI DisplayInfo dump");
     ALOGD_IF(DEBUG, "     display w x h = %d x %d", dinfo_ext.w, dinfo_ext.h);
     ALOGD_IF(DEBUG, "     display orientation = %d", dinfo_ext.orientation);
+}
+
+static int getDisplayInfo(const int sockfd)
+{
+    /* no request args */
+
+    DisplayInfo dinfo_ext;
+    dinfo_ext.orientation = M_ORIENTATION_0;
+    queryDisplayInfo(dinfo_ext);
 
     MGetDisplayInfoResponse response;
     response.width = dinfo_ext.w;
     response.height = dinfo_ext.h;
+    response.orientation = dinfo_ext.orientation;
 
     if (write(sockfd, &response, sizeof(response)) < 0)
     {
@@ -146,9 +306,88 @@ static int getDisplayInfo(const int sockfd)
     return 0;
 }
 
+/**
+ * Move surface @param idx to @param x, @param y in the client's
+ * unrotated coordinates, inside an open transaction.
+ */
+static status_t placeSurface(struct mflinger_state *state, int32_t idx,
+                             int32_t x, int32_t y)
+{
+    float w = state->display_width, h = state->display_height;
+    float xpos = x, ypos = y;
+
+    state->origins[idx].x = x;
+    state->origins[idx].y = y;
+    switch (state->orientation)
+    {
+    case M_ORIENTATION_90:
+        xpos = w - y;
+        ypos = x;
+        break;
+    case M_ORIENTATION_180:
+        xpos = w - x;
+        ypos = h - y;
+        break;
+    case M_ORIENTATION_270:
+        xpos = y;
+        ypos = h - x;
+        break;
+    }
+
+    return state->surfaces[idx]->setPosition(xpos, ypos);
+}
+
+static status_t orientSurface(struct mflinger_state *state, int32_t idx)
+{
+    const float *m = ROTATION_MATRICES[state->orientation];
+    return state->surfaces[idx]->setMatrix(m[0], m[1], m[2], m[3]);
+}
+
+static int setRotation(struct mflinger_state *state,
+                       const MSetRotationRequest &request)
+{
+    ALOGD_IF(DEBUG, "[setRotation] requested orientation = %u",
+             request.orientation);
+
+    if (request.orientation > M_ORIENTATION_270)
+    {
+        ALOGW("ignoring invalid orientation: %u\n", request.orientation);
+        return -1;
+    }
+
+    DisplayInfo dinfo;
+    queryDisplayInfo(dinfo);
+    state->display_width = dinfo.w;
+    state->display_height = dinfo.h;
+    state->orientation = request.orientation;
+
+    status_t ret = NO_ERROR;
+    SurfaceComposerClient::openGlobalTransaction();
+    for (int32_t i = 0; i < state->num_surfaces; ++i)
+    {
+        ret |= orientSurface(state, i);
+        ret |= placeSurface(state, i, state->origins[i].x, state->origins[i].y);
+    }
+    SurfaceComposerClient::closeGlobalTransaction();
+
+    if (NO_ERROR != ret)
+    {
+        ALOGE("compositor transaction failed!");
+        return -1;
+    }
+
+    return 0;
+}
+
 static int createSurface(struct mflinger_state *state,
-                         uint32_t w, uint32_t h)
+                         uint32_t w, uint32_t h,
+                         uint32_t max_w, uint32_t max_h)
 {
+    struct surface_size size;
+    size.width = w;
+    size.height = h;
+    size.alloc_width = max_w > w ? max_w : w;
+    size.alloc_height = max_h > h ? max_h : h;
 
     if (state->num_surfaces >= MAX_SURFACES)
     {
@@ -164,7 +403,7 @@ static int createSurface(struct mflinger_state *state,
     String8 name = String8::format("pionux %d", state->num_surfaces);
     sp<SurfaceControl> surface = state->compositor->createSurface(
         name,
-        w, h,
+        size.alloc_width, size.alloc_height,
         PIXEL_FORMAT_BGRA_8888,
         0);
     if (surface == NULL || !surface->isValid())
@@ -181,34 +420,53 @@ static int createSurface(struct mflinger_state *state,
 
     ret |= surface->setLayer(get_layer(state->num_surfaces));
     ret |= surface->setLayerStack(state->layerstack);
+    ret |= surface->setCrop(Rect(w, h));
+
+    /* the origin lands elsewhere on rotated displays */
+    state->surfaces[state->num_surfaces] = surface;
+    ret |= orientSurface(state, state->num_surfaces);
+    ret |= placeSurface(state, state->num_surfaces, 0, 0);
     ret |= surface->show();
 
-    SurfaceComposerClient::closeGlobalTransaction(true);
+    /*
+     * No need to wait for SurfaceFlinger to apply this: the surface can
+     * be locked right away, and transactions are applied before buffers
+     * are latched, so the first post already lands with its crop.
+     */
+    SurfaceComposerClient::closeGlobalTransaction();
 
     if (NO_ERROR != ret)
     {
         ALOGE("compositor transaction failed!");
+        state->surfaces[state->num_surfaces] = NULL;
         return -1;
     }
 
+    memset(&state->fenced[state->num_surfaces], 0, sizeof(state->fenced[0]));
+    memset(&state->timing[state->num_surfaces], 0, sizeof(state->timing[0]));
+    memset(&state->positions[state->num_surfaces], 0, sizeof(state->positions[0]));
+    sp<Surface> s = surface->getSurface();
+    state->timing[state->num_surfaces].native =
+        native_window_enable_frame_timestamps(s.get(), true) == NO_ERROR;
+
+    state->sizes[state->num_surfaces] = size;
     state->surfaces[(state->num_surfaces)++] = surface;
 
     return 0;
 }
 
-static int createBuffer(const int sockfd, struct mflinger_state *state)
+static int createBuffer(const int sockfd, struct mflinger_state *state,
+                        const MCreateBufferRequest &request)
 {
     int n;
-    MCreateBufferRequest request;
-    n = read(sockfd, &request, sizeof(request));
-    ALOGD_IF(DEBUG, "[C] n: %d", n);
     ALOGD_IF(DEBUG, "[C] requested dims = (%lux%lu)",
              (unsigned long)request.width, (unsigned long)request.height);
 
     ALOGD_IF(DEBUG, "[C] 1 -- num_surfaces = %d", state->num_surfaces);
 
     n = createSurface(state,
-                      request.width, request.height);
+                      request.width, request.height,
+                      request.max_width, request.max_height);
 
     ALOGD_IF(DEBUG, "[C] 2 -- num_surfaces = %d", state->num_surfaces);
 
@@ -225,12 +483,9 @@ static int createBuffer(const int sockfd, struct mflinger_state *state)
     return 0;
 }
 
-static int updateBuffer(const int sockfd, struct mflinger_state *state)
+static int updateBuffer(struct mflinger_state *state,
+                        const MUpdateBufferRequest &request)
 {
-    int n;
-    MUpdateBufferRequest request;
-    n = read(sockfd, &request, sizeof(request));
-    ALOGD_IF(DEBUG, "[updateBuffer] n: %d", n);
     ALOGD_IF(DEBUG, "[updateBuffer] requested id = %d", request.id);
     ALOGD_IF(DEBUG, "[updateBuffer] requested pos = (%d, %d)",
              request.xpos, request.ypos);
@@ -246,7 +501,7 @@ static int updateBuffer(const int sockfd, struct mflinger_state *state)
 
     status_t ret = NO_ERROR;
     SurfaceComposerClient::openGlobalTransaction();
-    ret |= sc->setPosition(request.xpos, request.ypos);
+    ret |= placeSurface(state, idx, request.xpos, request.ypos);
     SurfaceComposerClient::closeGlobalTransaction();
 
     if (NO_ERROR != ret)
@@ -258,11 +513,9 @@ static int updateBuffer(const int sockfd, struct mflinger_state *state)
     return 0;
 }
 
-static int resizeBuffer(const int sockfd, struct mflinger_state *state)
+static int resizeBuffer(const int sockfd, struct mflinger_state *state,
+                        const MResizeBufferRequest &request)
 {
-    int n;
-    MResizeBufferRequest request;
-    n = read(sockfd, &request, sizeof(request));
     ALOGD_IF(DEBUG, "[resizeBuffer] requested width = %d", request.width);
     ALOGD_IF(DEBUG, "[resizeBuffer] requested height = %d", request.height);
 
@@ -274,12 +527,36 @@ static int resizeBuffer(const int sockfd, struct mflinger_state *state)
     }
 
     sp<SurfaceControl> sc = state->surfaces[idx];
+    struct surface_size *size = &state->sizes[idx];
+
+    /* only reallocate if the new size does not fit the buffers */
+    int realloc = request.width > size->alloc_width ||
+                  request.height > size->alloc_height;
 
     status_t ret = NO_ERROR;
     SurfaceComposerClient::openGlobalTransaction();
-    ret |= sc->setSize(request.width, request.height);
+    if (realloc)
+    {
+        ret |= sc->setSize(request.width, request.height);
+    }
+    ret |= sc->setCrop(Rect(request.width, request.height));
     SurfaceComposerClient::closeGlobalTransaction();
 
+    if (NO_ERROR == ret)
+    {
+        if (realloc)
+        {
+            size->alloc_width = request.width;
+            size->alloc_height = request.height;
+
+            /* buffers get reallocated at the new size */
+            memset(state->fenced[idx].slots, 0,
+                   sizeof(state->fenced[idx].slots));
+        }
+        size->width = request.width;
+        size->height = request.height;
+    }
+
     MResizeBufferResponse response;
     response.result = 0;
     if (NO_ERROR != ret)
@@ -298,18 +575,106 @@ static int resizeBuffer(const int sockfd, struct mflinger_state *state)
     return 0;
 }
 
-static int sendfd(const int sockfd,
-                  void *data, const int data_len,
-                  const int fd)
+static int setBufferCount(const int sockfd, struct mflinger_state *state,
+                          const MSetBufferCountRequest &request)
+{
+    ALOGD_IF(DEBUG, "[setBufferCount] requested count = %u", request.count);
+
+    MSetBufferCountResponse response;
+    response.result = -1;
+    response.count = 0;
+
+    int32_t idx = buffer_id_to_index(request.id);
+    if (!is_valid_idx(state, idx))
+    {
+        ALOGW("ignoring buffer count request for invalid surface id: %d\n", idx);
+    }
+    else if (state->fenced[idx].dequeued != NULL || state->locked[idx].bits != NULL)
+    {
+        /* the queue cannot shrink under a dequeued buffer */
+        ALOGW("ignoring buffer count request for locked surface id: %d\n", idx);
+    }
+    else
+    {
+        sp<Surface> s = state->surfaces[idx]->getSurface();
+        ANativeWindow *window = s.get();
+        int min_undequeued = 1;
+        uint32_t count = request.count;
+
+        /* the compositor holds on to some, the client needs one more */
+        window->query(window, NATIVE_WINDOW_MIN_UNDEQUEUED_BUFFERS,
+                      &min_undequeued);
+        if (count != 0 && count < (uint32_t)min_undequeued + 1)
+        {
+            count = min_undequeued + 1;
+        }
+
+        if (native_window_set_buffer_count(window, count) == NO_ERROR)
+        {
+            /* buffers may be reallocated, forget their ages */
+            memset(state->fenced[idx].slots, 0, sizeof(state->fenced[idx].slots));
+            response.result = 0;
+            response.count = count;
+        }
+        else
+        {
+            ALOGE("failed to set buffer count %u", count);
+        }
+    }
+
+    if (write(sockfd, &response, sizeof(response)) < 0)
+    {
+        ALOGE("Failed to write setBufferCount response: %s",
+              strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int trimBuffer(struct mflinger_state *state,
+                      const MTrimBufferRequest &request)
+{
+    ALOGD_IF(DEBUG, "[trimBuffer] requested id = %d", request.id);
+
+    int32_t idx = buffer_id_to_index(request.id);
+    if (!is_valid_idx(state, idx))
+    {
+        ALOGW("ignoring trim request for invalid surface id: %d\n", idx);
+        return -1;
+    }
+    if (state->fenced[idx].dequeued != NULL || state->locked[idx].bits != NULL)
+    {
+        ALOGW("ignoring trim request for locked surface id: %d\n", idx);
+        return -1;
+    }
+
+    /*
+     * Disconnecting frees every buffer the compositor does not hold on
+     * to. The next lock connects again and allocates as it goes.
+     */
+    sp<Surface> s = state->surfaces[idx]->getSurface();
+    if (native_window_api_disconnect(s.get(), NATIVE_WINDOW_API_CPU) != NO_ERROR)
+    {
+        ALOGW("failed to trim surface id: %d\n", idx);
+        return -1;
+    }
+    memset(state->fenced[idx].slots, 0, sizeof(state->fenced[idx].slots));
+    state->fenced[idx].connected = 0;
+
+    return 0;
+}
+
+static int sendfds(const int sockfd,
+                   void *data, const int data_len,
+                   const int *fds, const int num_fds)
 {
     struct msghdr msg = {0}; // 0 initializer
     struct cmsghdr *cmsg;
-    //int bufferFd = 1;
     union {
-        char buf[CMSG_SPACE(sizeof(int))];
+        char buf[CMSG_SPACE(2 * sizeof(int))];
         struct cmsghdr align;
     } u;
-    int *fdptr;
 
     /* 
      * >= 1 byte of nonacillary data must be sent
@@ -322,14 +687,13 @@ static int sendfd(const int sockfd,
     msg.msg_iovlen = 1;
 
     msg.msg_control = u.buf;
-    msg.msg_controllen = sizeof(u.buf);
+    msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
     cmsg = CMSG_FIRSTHDR(&msg);
     cmsg->cmsg_level = SOL_SOCKET;
     cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
 
-    fdptr = (int *)CMSG_DATA(cmsg);
-    memcpy(fdptr, &fd, sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
 
     if (sendmsg(sockfd, &msg, 0) < 0)
     {
@@ -340,221 +704,1767 @@ static int sendfd(const int sockfd,
     return 0;
 }
 
-static int lockBuffer(const int sockfd, struct mflinger_state *state)
+static int sendfd(const int sockfd,
+                  void *data, const int data_len,
+                  const int fd)
 {
-    int n;
-    MLockBufferRequest request;
-    n = read(sockfd, &request, sizeof(request));
-    ALOGD_IF(DEBUG, "[L] n: %d", n);
-    ALOGD_IF(DEBUG, "[L] requested id = %d", request.id);
-    int32_t idx = buffer_id_to_index(request.id);
+    return sendfds(sockfd, data, data_len, &fd, 1);
+}
 
-    MLockBufferResponse response;
-    response.result = -1;
+static int mapPosition(const int sockfd, struct mflinger_state *state,
+                       const MMapPositionRequest &request)
+{
+    ALOGD_IF(DEBUG, "[mapPosition] requested id = %d", request.id);
 
-    if (0 <= idx && idx < state->num_surfaces)
-    {
-        sp<SurfaceControl> sc = state->surfaces[idx];
-        sp<Surface> s = sc->getSurface();
+    MMapPositionResponse response;
+    MPositionPage *page = NULL;
+    int fd = -1;
 
-        ANativeWindow_Buffer outBuffer;
-        buffer_handle_t handle;
-        status_t err = s->lockWithHandle(&outBuffer, &handle, NULL);
-        if (err != 0)
-        {
-            ALOGE("failed to lock buffer");
-        }
-        else if (handle->numFds < 1)
+    int32_t idx = buffer_id_to_index(request.id);
+    if (!is_valid_idx(state, idx))
+    {
+        ALOGW("ignoring position page request for invalid surface id: %d\n", idx);
+    }
+    else if (state->remote || state->display_events == NULL)
+    {
+        ALOGW("Position pages need fd passing and vsync events");
+    }
+    else if ((fd = ashmem_create_region("mflinger-position",
+                                        sizeof(MPositionPage))) < 0)
+    {
+        ALOGE("Failed to create position page: %s", strerror(errno));
+    }
+    else
+    {
+        void *addr = mmap(NULL, sizeof(MPositionPage), PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED)
         {
-            ALOGE("buffer handle does not have any fds");
+            ALOGE("Failed to map position page: %s", strerror(errno));
         }
         else
         {
-            /* all is well */
-            response.buffer.width = outBuffer.width;
-            response.buffer.height = outBuffer.height;
-            response.buffer.stride = outBuffer.stride;
-            response.buffer.bits = NULL;
-            response.result = 0;
+            page = (MPositionPage *)addr;
+            memset(page, 0, sizeof(*page));
+        }
+    }
 
-            return sendfd(sockfd, (void *)&response,
-                          sizeof(response), handle->data[0]);
+    if (page == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        response.result = -1;
+        if (write(sockfd, &response, sizeof(response)) < 0)
+        {
+            ALOGE("Failed to write mapPosition response: %s",
+                  strerror(errno));
         }
+        return -1;
     }
-    else
+
+    response.result = 0;
+    int err = sendfd(sockfd, &response, sizeof(response), fd);
+    close(fd);
+    if (err < 0)
     {
-        ALOGE("Invalid buffer id: %d\n", request.id);
+        munmap(page, sizeof(*page));
+        return -1;
     }
 
-    if (write(sockfd, &response, sizeof(response)) < 0)
+    struct position_page *p = &state->positions[idx];
+    if (p->page != NULL)
     {
-        ALOGE("[L] Failed to write response: %s", strerror(errno));
+        munmap(p->page, sizeof(*p->page));
     }
-    return -1;
+    p->page = page;
+    p->seq = 0;
+
+    if (!state->vsync_on)
+    {
+        state->vsync_on = state->display_events->setVsyncRate(1) == NO_ERROR;
+    }
+    return 0;
 }
 
-static int unlockAndPostBuffer(const int sockfd,
-                               struct mflinger_state *state)
+/**
+ * Apply the positions published since the last vsync.
+ */
+static void samplePositions(struct mflinger_state *state)
 {
-    int n;
-    MUnlockBufferRequest request;
-    n = read(sockfd, &request, sizeof(request));
-    ALOGD_IF(DEBUG, "[U] n: %d", n);
-    ALOGD_IF(DEBUG, "[U] requested id = %d", request.id);
-    int32_t idx = buffer_id_to_index(request.id);
+    int i, n, changed = 0;
 
-    if (0 <= idx && idx < state->num_surfaces)
+    for (i = 0; i < state->num_surfaces; ++i)
     {
-        sp<SurfaceControl> sc = state->surfaces[idx];
-        sp<Surface> s = sc->getSurface();
+        struct position_page *p = &state->positions[i];
+        uint32_t seq = 0, xpos = 0, ypos = 0;
 
-        return s->unlockAndPost();
-    }
-    else
-    {
-        ALOGE("Invalid buffer id: %d\n", request.id);
-    }
+        if (p->page == NULL)
+        {
+            continue;
+        }
 
-    /* TODO return failure to client? */
+        /* never spin on a client that stopped halfway through a write */
+        for (n = 0; n < POSITION_READ_TRIES; ++n)
+        {
+            seq = mseqlock_read_begin(&p->page->seq);
+            xpos = p->page->xpos;
+            ypos = p->page->ypos;
+            if (!mseqlock_read_retry(&p->page->seq, seq))
+            {
+                break;
+            }
+        }
+        if (n == POSITION_READ_TRIES || seq == p->seq)
+        {
+            continue;
+        }
+        p->seq = seq;
 
-    return -1;
-}
+        if (!changed)
+        {
+            SurfaceComposerClient::openGlobalTransaction();
+            changed = 1;
+        }
+        if (placeSurface(state, i, xpos, ypos) != NO_ERROR)
+        {
+            ALOGE("compositor transaction failed!");
+        }
+    }
 
-static void purge_surfaces(struct mflinger_state *state)
-{
-    for (; state->num_surfaces > 0; --state->num_surfaces)
+    if (changed)
     {
-        /*
-         * these are strong pointers so setting them
-         * to NULL will trigger dtor()
-         */
-        state->surfaces[state->num_surfaces - 1] = NULL;
+        SurfaceComposerClient::closeGlobalTransaction();
     }
 }
 
-static void reset_state(struct mflinger_state *state)
+static void rect_union(MRect *a, const MRect *b)
 {
-    purge_surfaces(state);
-
+    if (b->width == 0 || b->height == 0)
+    {
+        return;
+    }
+    if (a->width == 0 || a->height == 0)
+    {
+        *a = *b;
+        return;
+    }
+
+    int32_t left = a->x < b->x ? a->x : b->x;
+    int32_t top = a->y < b->y ? a->y : b->y;
+    int32_t right = a->x + (int32_t)a->width;
+    int32_t bottom = a->y + (int32_t)a->height;
+    if (b->x + (int32_t)b->width > right)
+    {
+        right = b->x + b->width;
+    }
+    if (b->y + (int32_t)b->height > bottom)
+    {
+        bottom = b->y + b->height;
+    }
+
+    a->x = left;
+    a->y = top;
+    a->width = right - left;
+    a->height = bottom - top;
+}
+
+/**
+ * Clip @param r to the visible part of a surface.
+ */
+static void clip_to_size(MRect *r, const struct surface_size *size)
+{
+    int32_t right = r->x + (int32_t)r->width;
+    int32_t bottom = r->y + (int32_t)r->height;
+
+    r->x = r->x < 0 ? 0 : r->x;
+    r->y = r->y < 0 ? 0 : r->y;
+    right = right > (int32_t)size->width ? (int32_t)size->width : right;
+    bottom = bottom > (int32_t)size->height ? (int32_t)size->height : bottom;
+
+    r->width = right > r->x ? right - r->x : 0;
+    r->height = bottom > r->y ? bottom - r->y : 0;
+}
+
+/**
+ * Grow @param dirty by the damage @param buffer missed since it was last
+ * queued, or to the whole surface if that is unknown.
+ */
+static void add_missed_damage(const struct fenced_surface *f,
+                              const struct surface_size *size,
+                              const ANativeWindowBuffer *buffer,
+                              MRect *dirty)
+{
+    const MRect full = {0, 0, size->width, size->height};
+    uint64_t held = 0;
+    int i;
+
+    for (i = 0; i < MAX_BUFFER_SLOTS; ++i)
+    {
+        if (f->slots[i].buffer == buffer)
+        {
+            held = f->slots[i].frame;
+        }
+    }
+
+    if (held == 0 || f->frame - held >= (uint64_t)MAX_DAMAGE_HISTORY)
+    {
+        *dirty = full;
+        return;
+    }
+
+    uint64_t n;
+    for (n = held + 1; n <= f->frame; ++n)
+    {
+        rect_union(dirty, &f->damage[n % MAX_DAMAGE_HISTORY]);
+    }
+}
+
+static void remember_buffer(struct fenced_surface *f,
+                            ANativeWindowBuffer *buffer)
+{
+    int i, oldest = 0;
+
+    for (i = 0; i < MAX_BUFFER_SLOTS; ++i)
+    {
+        if (f->slots[i].buffer == buffer)
+        {
+            oldest = i;
+            break;
+        }
+        if (f->slots[i].frame < f->slots[oldest].frame)
+        {
+            oldest = i;
+        }
+    }
+
+    f->slots[oldest].buffer = buffer;
+    f->slots[oldest].frame = f->frame;
+}
+
+static int lockBufferFenced(const int sockfd, struct mflinger_state *state,
+                            const int32_t idx,
+                            const MLockBufferRequest &request)
+{
+    struct fenced_surface *f = &state->fenced[idx];
+    const struct surface_size *size = &state->sizes[idx];
+    sp<Surface> s = state->surfaces[idx]->getSurface();
+    ANativeWindow *window = s.get();
+
+    MLockBufferResponse response;
+    response.result = -1;
+
+    if (f->dequeued != NULL)
+    {
+        ALOGE("[L] buffer %d is already locked", request.id);
+        goto fail;
+    }
+
+    if (!f->connected)
+    {
+        /* fails harmlessly if Surface::lock() connected already */
+        native_window_api_connect(window, NATIVE_WINDOW_API_CPU);
+        native_window_set_usage(window, GRALLOC_USAGE_SW_READ_OFTEN |
+                                            GRALLOC_USAGE_SW_WRITE_OFTEN);
+        /* rather tell the client to come back than stall every client */
+        s->setDequeueTimeout(0);
+        f->connected = 1;
+    }
+
+    ANativeWindowBuffer *buffer;
+    int fence_fd;
+    status_t err;
+    fence_fd = -1;
+    err = window->dequeueBuffer(window, &buffer, &fence_fd);
+    if (err == WOULD_BLOCK || err == TIMED_OUT)
+    {
+        ALOGD_IF(DEBUG, "[L] no free buffer for id %d", request.id);
+        response.result = M_LOCK_RESULT_WOULD_BLOCK;
+        goto fail;
+    }
+    if (err != NO_ERROR)
+    {
+        ALOGE("failed to dequeue buffer");
+        goto fail;
+    }
+    if (buffer->handle->numFds < 1)
+    {
+        ALOGE("buffer handle does not have any fds");
+        window->cancelBuffer(window, buffer, fence_fd);
+        goto fail;
+    }
+
+    f->dequeued = buffer;
+    f->pending = request.dirty;
+    if (f->pending.width == 0 || f->pending.height == 0)
+    {
+        f->pending.x = f->pending.y = 0;
+        f->pending.width = size->width;
+        f->pending.height = size->height;
+    }
+    clip_to_size(&f->pending, size);
+
+    /* the client only sees the uncropped part */
+    response.buffer.width = size->width;
+    response.buffer.height = size->height;
+    response.buffer.stride = buffer->stride;
+    response.buffer.bits = NULL;
+    response.dirty = f->pending;
+    add_missed_damage(f, size, buffer, &response.dirty);
+    response.result = 0;
+
+    int fds[2];
+    fds[0] = buffer->handle->data[0];
+    fds[1] = fence_fd;
+    response.num_fds = fence_fd >= 0 ? 2 : 1;
+
+    err = sendfds(sockfd, (void *)&response, sizeof(response),
+                  fds, response.num_fds);
+
+    /* the client got its own copy of the fence */
+    if (fence_fd >= 0)
+    {
+        close(fence_fd);
+    }
+    return err;
+
+fail:
+    if (write(sockfd, &response, sizeof(response)) < 0)
+    {
+        ALOGE("[L] Failed to write response: %s", strerror(errno));
+    }
+    return -1;
+}
+
+static int lockBuffer(const int sockfd, struct mflinger_state *state,
+                      const MLockBufferRequest &request)
+{
+    ALOGD_IF(DEBUG, "[L] requested id = %d", request.id);
+    int32_t idx = buffer_id_to_index(request.id);
+
+    /* remote clients cannot take fds, and fences would be pointless */
+    if (is_valid_idx(state, idx) && (request.flags & M_LOCK_FLAG_FENCED) &&
+        !state->remote)
+    {
+        return lockBufferFenced(sockfd, state, idx, request);
+    }
+
+    MLockBufferResponse response;
+    response.num_fds = 1;
+    response.result = -1;
+
+    if (0 <= idx && idx < state->num_surfaces)
+    {
+        sp<SurfaceControl> sc = state->surfaces[idx];
+        sp<Surface> s = sc->getSurface();
+
+        /*
+         * With dirty bounds, Surface copies everything outside of them
+         * back from the last posted buffer and may grow them when it
+         * cannot (e.g. the first lock), so report them back.
+         */
+        ARect dirty;
+        ARect *inOutDirty = NULL;
+        if (request.dirty.width > 0 && request.dirty.height > 0)
+        {
+            dirty.left = request.dirty.x;
+            dirty.top = request.dirty.y;
+            dirty.right = request.dirty.x + request.dirty.width;
+            dirty.bottom = request.dirty.y + request.dirty.height;
+            inOutDirty = &dirty;
+        }
+
+        /*
+         * This waits for a free buffer, let the session's other
+         * connections go on meanwhile. sc keeps the surface alive.
+         */
+        ANativeWindow_Buffer outBuffer;
+        buffer_handle_t handle;
+        pthread_mutex_unlock(&state->lock);
+        status_t err = s->lockWithHandle(&outBuffer, &handle, inOutDirty);
+        pthread_mutex_lock(&state->lock);
+        if (err == 0 && state->surfaces[idx] != sc)
+        {
+            ALOGW("surface id %d went away while locking", request.id);
+            s->unlockAndPost();
+            err = -1;
+        }
+        if (err != 0)
+        {
+            ALOGE("failed to lock buffer");
+        }
+        else if (!state->remote && handle->numFds < 1)
+        {
+            ALOGE("buffer handle does not have any fds");
+        }
+        else
+        {
+            /* all is well, the client only sees the uncropped part */
+            const struct surface_size *size = &state->sizes[idx];
+            response.buffer.width = size->width;
+            response.buffer.height = size->height;
+            response.buffer.stride = outBuffer.stride;
+            response.buffer.bits = NULL;
+            if (inOutDirty != NULL)
+            {
+                response.dirty.x = dirty.left;
+                response.dirty.y = dirty.top;
+                response.dirty.width = dirty.right - dirty.left;
+                response.dirty.height = dirty.bottom - dirty.top;
+            }
+            else
+            {
+                response.dirty.x = response.dirty.y = 0;
+                response.dirty.width = size->width;
+                response.dirty.height = size->height;
+            }
+            clip_to_size(&response.dirty, size);
+            response.result = 0;
+
+            if (!state->remote)
+            {
+                return sendfd(sockfd, (void *)&response,
+                              sizeof(response), handle->data[0]);
+            }
+
+            /* the pixels come with the unlock, see applyDamage() */
+            state->locked[idx] = outBuffer;
+            response.num_fds = 0;
+            if (write(sockfd, &response, sizeof(response)) < 0)
+            {
+                ALOGE("[L] Failed to write response: %s", strerror(errno));
+                return -1;
+            }
+            return 0;
+        }
+    }
+    else
+    {
+        ALOGE("Invalid buffer id: %d\n", request.id);
+    }
+
+    if (write(sockfd, &response, sizeof(response)) < 0)
+    {
+        ALOGE("[L] Failed to write response: %s", strerror(errno));
+    }
+    return -1;
+}
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Called right before a frame is queued to the compositor.
+ */
+static void recordPost(struct mflinger_state *state, int32_t idx,
+                       ANativeWindow *window)
+{
+    struct frame_timing *t = &state->timing[idx];
+    t->posts++;
+
+    if (state->event_fd < 0 || !(state->event_mask & M_EVENT_FRAME_TIMESTAMPS))
+    {
+        return;
+    }
+
+    /* a client that stopped reading events loses the oldest */
+    if (t->num_pending == MAX_PENDING_FRAMES)
+    {
+        memmove(&t->pending[0], &t->pending[1],
+                sizeof(t->pending[0]) * (MAX_PENDING_FRAMES - 1));
+        t->num_pending--;
+    }
+
+    struct pending_frame *p = &t->pending[t->num_pending++];
+    p->id = 0;
+    p->frame = t->posts;
+    p->posted = now_ns();
+    if (t->native && native_window_get_next_frame_id(window, &p->id) != NO_ERROR)
+    {
+        t->native = 0;
+    }
+}
+
+/**
+ * @param release_fence fence to wait on before reading the buffer,
+ * owned by this call, -1 if none
+ */
+static int unlockAndPostBuffer(struct mflinger_state *state,
+                               const MUnlockBufferRequest &request,
+                               const int release_fence)
+{
+    ALOGD_IF(DEBUG, "[U] requested id = %d", request.id);
+    int32_t idx = buffer_id_to_index(request.id);
+
+    if (0 <= idx && idx < state->num_surfaces)
+    {
+        sp<SurfaceControl> sc = state->surfaces[idx];
+        sp<Surface> s = sc->getSurface();
+        struct fenced_surface *f = &state->fenced[idx];
+        state->locked[idx].bits = NULL;
+
+        recordPost(state, idx, s.get());
+
+        if (f->dequeued != NULL)
+        {
+            /* queueBuffer() takes ownership of the fence */
+            ANativeWindow *window = s.get();
+            status_t err = window->queueBuffer(window, f->dequeued,
+                                               release_fence);
+
+            f->frame++;
+            f->damage[f->frame % MAX_DAMAGE_HISTORY] = f->pending;
+            remember_buffer(f, f->dequeued);
+            f->dequeued = NULL;
+            return err;
+        }
+
+        /* Surface::lock() buffers leave us no idea about buffer ages */
+        memset(f->slots, 0, sizeof(f->slots));
+
+        /*
+         * Nothing takes a fence on this path and the request loop never
+         * waits on one, fenced unlocks belong to fenced locks. The
+         * surface still has to be unlocked, so the frame is posted as is.
+         */
+        if (release_fence >= 0)
+        {
+            ALOGW("[U] ignoring fence of unfenced buffer id %d", request.id);
+            close(release_fence);
+        }
+        return s->unlockAndPost();
+    }
+    else
+    {
+        ALOGE("Invalid buffer id: %d\n", request.id);
+    }
+
+    if (release_fence >= 0)
+    {
+        close(release_fence);
+    }
+
+    /* TODO return failure to client? */
+
+    return -1;
+}
+
+static int recv_all(const int sockfd, void *data, const size_t len)
+{
+    ssize_t n = recv(sockfd, data, len, MSG_WAITALL);
+    if (n != (ssize_t)len)
+    {
+        ALOGE("Failed to read damage: %s",
+              n < 0 ? strerror(errno) : "short read");
+        return -1;
+    }
+    return 0;
+}
+
+static int skip_bytes(const int sockfd, size_t len)
+{
+    uint8_t sink[4096];
+    while (len > 0)
+    {
+        size_t chunk = len < sizeof(sink) ? len : sizeof(sink);
+        if (recv_all(sockfd, sink, chunk) < 0)
+        {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int rect_in_size(const MRect *r, const struct surface_size *size)
+{
+    return r->x >= 0 && r->y >= 0 &&
+           (uint32_t)r->x < size->width && (uint32_t)r->y < size->height &&
+           r->width > 0 && r->height > 0 &&
+           r->width <= size->width - r->x &&
+           r->height <= size->height - r->y;
+}
+
+/**
+ * Read the damaged pixels that follow a remote unlock request into the
+ * buffer locked by lockBuffer(). Bad rectangles are skipped.
+ * @return -1 if the stream is out of sync, i.e. the client must go
+ */
+static int applyDamage(const int sockfd, struct mflinger_state *state,
+                       const MUnlockBufferRequest &request)
+{
+    int32_t idx = buffer_id_to_index(request.id);
+    ANativeWindow_Buffer *locked = NULL;
+    const struct surface_size *size = NULL;
+    if (is_valid_idx(state, idx) && state->locked[idx].bits != NULL)
+    {
+        locked = &state->locked[idx];
+        size = &state->sizes[idx];
+    }
+
+    MDamageHeader header;
+    if (recv_all(sockfd, &header, sizeof(header)) < 0)
+    {
+        return -1;
+    }
+    if (header.num_rects > M_MAX_DAMAGE_RECTS)
+    {
+        ALOGE("Too many damage rects: %u", header.num_rects);
+        return -1;
+    }
+
+    uint32_t i;
+    for (i = 0; i < header.num_rects; ++i)
+    {
+        MDamageRect damage;
+        if (recv_all(sockfd, &damage, sizeof(damage)) < 0)
+        {
+            return -1;
+        }
+
+        const MRect &r = damage.rect;
+        if (locked == NULL || !rect_in_size(&r, size) ||
+            damage.size > mcodec_bound(r.width, r.height))
+        {
+            ALOGW("Skipping damage rect %d,%d %ux%u", r.x, r.y,
+                  r.width, r.height);
+            if (skip_bytes(sockfd, damage.size) < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        if (damage.size > state->scratch_size)
+        {
+            uint8_t *scratch = (uint8_t *)realloc(state->scratch, damage.size);
+            if (scratch == NULL)
+            {
+                ALOGE("Failed to allocate damage buffer");
+                return -1;
+            }
+            state->scratch = scratch;
+            state->scratch_size = damage.size;
+        }
+
+        if (recv_all(sockfd, state->scratch, damage.size) < 0)
+        {
+            return -1;
+        }
+
+        uint32_t *dst = (uint32_t *)locked->bits +
+                        r.y * locked->stride + r.x;
+        if (mcodec_decode(state->scratch, damage.size, dst, locked->stride,
+                          r.width, r.height) < 0)
+        {
+            ALOGW("Corrupt damage rect %d,%d %ux%u", r.x, r.y,
+                  r.width, r.height);
+        }
+    }
+
+    return 0;
+}
+
+static void sendEvent(struct mflinger_state *state, const MEvent &event)
+{
+    if (state->event_fd < 0 || !(state->event_mask & event.type))
+    {
+        return;
+    }
+
+    /* never block on a client that is not reading its events */
+    if (send(state->event_fd, &event, sizeof(event),
+             MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    {
+        ALOGW("Dropped event %u: %s", event.type, strerror(errno));
+    }
+}
+
+static void sendDisplayState(struct mflinger_state *state)
+{
+    MEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = M_EVENT_DISPLAY_STATE;
+    event.display_state.visible = state->visible;
+    sendEvent(state, event);
+}
+
+/**
+ * @return 0 if the timestamps of @param p are final (or never will be)
+ */
+static int getFrameTimestamps(struct mflinger_state *state, int32_t idx,
+                              const struct pending_frame *p, int64_t now,
+                              MFrameTimestampsEvent *out)
+{
+    int64_t latched, presented;
+
+    if (state->timing[idx].native)
+    {
+        sp<Surface> s = state->surfaces[idx]->getSurface();
+        status_t err = native_window_get_frame_timestamps(
+            s.get(), p->id, NULL, NULL, &latched, NULL, NULL, NULL,
+            &presented, NULL, NULL);
+        if (err != NO_ERROR)
+        {
+            /* fell out of the compositor's history */
+            latched = presented = NATIVE_WINDOW_TIMESTAMP_INVALID;
+        }
+        else if ((latched == NATIVE_WINDOW_TIMESTAMP_PENDING ||
+                  presented == NATIVE_WINDOW_TIMESTAMP_PENDING) &&
+                 now - p->posted < FRAME_TIMESTAMPS_TIMEOUT_NS)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        /* simulated: latched on the next refresh, shown one later */
+        latched = (p->posted / state->refresh_ns + 1) * state->refresh_ns;
+        presented = latched + state->refresh_ns;
+        if (now < presented)
+        {
+            return -1;
+        }
+    }
+
+    out->posted = p->posted;
+    out->latched = latched > 0 ? latched : 0;
+    out->presented = presented > 0 ? presented : 0;
+    return 0;
+}
+
+static int has_pending_frames(struct mflinger_state *state)
+{
+    int i;
+    for (i = 0; i < state->num_surfaces; ++i)
+    {
+        if (state->timing[i].num_pending > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void sendFrameTimestamps(struct mflinger_state *state)
+{
+    int64_t now = now_ns();
+    int i, n;
+
+    for (i = 0; i < state->num_surfaces; ++i)
+    {
+        struct frame_timing *t = &state->timing[i];
+
+        /* frames complete in order, stop at the first one that has not */
+        for (n = 0; n < t->num_pending; ++n)
+        {
+            MEvent event;
+            memset(&event, 0, sizeof(event));
+            event.type = M_EVENT_FRAME_TIMESTAMPS;
+            event.frame_timestamps.id = i + 1;
+            event.frame_timestamps.frame = t->pending[n].frame;
+            if (getFrameTimestamps(state, i, &t->pending[n], now,
+                                   &event.frame_timestamps) < 0)
+            {
+                break;
+            }
+            sendEvent(state, event);
+        }
+
+        memmove(&t->pending[0], &t->pending[n],
+                sizeof(t->pending[0]) * (t->num_pending - n));
+        t->num_pending -= n;
+    }
+}
+
+static int64_t get_refresh_ns()
+{
+    DisplayInfo dinfo;
+    sp<IBinder> dpy = SurfaceComposerClient::getBuiltInDisplay(
+        ISurfaceComposer::eDisplayIdHdmi);
+    if (SurfaceComposerClient::getDisplayInfo(dpy, &dinfo) != NO_ERROR ||
+        dinfo.fps <= 0)
+    {
+        return DEFAULT_REFRESH_NS;
+    }
+    return (int64_t)(1e9 / dinfo.fps);
+}
+
+static int is_dpms_on()
+{
+    char buf[8] = {0};
+    int fd = open(HDMI_DPMS_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        /* no DPMS node on this device */
+        return 1;
+    }
+
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    return n <= 0 || strncmp(buf, "Off", 3) != 0;
+}
+
+static void handleDisplayEvents(struct mflinger_state *state)
+{
+    DisplayEventReceiver::Event events[8];
+    ssize_t i, n;
+    int vsync = 0;
+
+    while ((n = state->display_events->getEvents(events, 8)) > 0)
+    {
+        for (i = 0; i < n; ++i)
+        {
+            if (events[i].header.type == DisplayEventReceiver::DISPLAY_EVENT_HOTPLUG &&
+                events[i].header.id == ISurfaceComposer::eDisplayIdHdmi)
+            {
+                ALOGI("HDMI display %s", events[i].hotplug.connected
+                                             ? "connected" : "disconnected");
+                state->hdmi_connected = events[i].hotplug.connected;
+            }
+            else if (events[i].header.type == DisplayEventReceiver::DISPLAY_EVENT_VSYNC)
+            {
+                vsync = 1;
+            }
+        }
+    }
+
+    /* once per batch of events, a late wakeup still moves things once */
+    if (vsync)
+    {
+        samplePositions(state);
+    }
+}
+
+static void updateDisplayState(struct mflinger_state *state)
+{
+    int visible = state->hdmi_connected && is_dpms_on();
+    if (visible != state->visible)
+    {
+        ALOGI("Display %s", visible ? "visible" : "hidden");
+        state->visible = visible;
+        sendDisplayState(state);
+    }
+}
+
+static void close_events(struct mflinger_state *state)
+{
+    int i;
+
+    if (state->event_fd >= 0)
+    {
+        close(state->event_fd);
+    }
+    state->event_fd = -1;
+    state->event_mask = 0;
+
+    for (i = 0; i < MAX_SURFACES; ++i)
+    {
+        state->timing[i].num_pending = 0;
+    }
+}
+
+static int selectEvents(const int sockfd, struct mflinger_state *state,
+                        const MSelectEventsRequest &request)
+{
+    MSelectEventsResponse response;
+    int fds[2] = {-1, -1};
+
+    close_events(state);
+    if (state->remote)
+    {
+        ALOGW("Event channels need fd passing, not for remote clients");
+    }
+    else if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+    {
+        ALOGE("Failed to create event channel: %s", strerror(errno));
+    }
+
+    if (fds[0] < 0)
+    {
+        response.result = -1;
+        if (write(sockfd, &response, sizeof(response)) < 0)
+        {
+            ALOGE("Failed to write selectEvents response: %s",
+                  strerror(errno));
+        }
+        return -1;
+    }
+
+    response.result = 0;
+    int err = sendfd(sockfd, &response, sizeof(response), fds[1]);
+    close(fds[1]);
+    if (err < 0)
+    {
+        close(fds[0]);
+        return -1;
+    }
+
+    state->event_fd = fds[0];
+    state->event_mask = request.mask;
+    if (request.mask & M_EVENT_FRAME_TIMESTAMPS)
+    {
+        state->refresh_ns = get_refresh_ns();
+    }
+
+    /* start the client off with the current state */
+    state->visible = state->hdmi_connected && is_dpms_on();
+    sendDisplayState(state);
+    return 0;
+}
+
+static void purge_surfaces(struct mflinger_state *state)
+{
+    for (; state->num_surfaces > 0; --state->num_surfaces)
+    {
+        struct fenced_surface *f = &state->fenced[state->num_surfaces - 1];
+        if (f->dequeued != NULL)
+        {
+            sp<Surface> s = state->surfaces[state->num_surfaces - 1]->getSurface();
+            ANativeWindow *window = s.get();
+            window->cancelBuffer(window, f->dequeued, -1);
+            f->dequeued = NULL;
+        }
+
+        state->locked[state->num_surfaces - 1].bits = NULL;
+
+        struct position_page *p = &state->positions[state->num_surfaces - 1];
+        if (p->page != NULL)
+        {
+            munmap(p->page, sizeof(*p->page));
+            p->page = NULL;
+        }
+
+        /*
+         * these are strong pointers so setting them
+         * to NULL will trigger dtor()
+         */
+        state->surfaces[state->num_surfaces - 1] = NULL;
+    }
+}
+
+static void reset_state(struct mflinger_state *state)
+{
+    purge_surfaces(state);
+    close_events(state);
+
+    /* no more pages to sample */
+    if (state->vsync_on)
+    {
+        state->display_events->setVsyncRate(0);
+        state->vsync_on = 0;
+    }
+
     /* look for new displays for the next client */
     state->layerstack = -1;
+    state->orientation = M_ORIENTATION_0;
+}
+
+/**
+ * @return the body size of a request, -1 for unknown requests
+ */
+static ssize_t request_size(uint32_t op)
+{
+    switch (op)
+    {
+    case M_GET_DISPLAY_INFO:
+        /* empty structs are 0 bytes in C but 1 byte in C++ */
+        return 0;
+    case M_CREATE_BUFFER:
+        return sizeof(MCreateBufferRequest);
+    case M_UPDATE_BUFFER:
+        return sizeof(MUpdateBufferRequest);
+    case M_RESIZE_BUFFER:
+        return sizeof(MResizeBufferRequest);
+    case M_LOCK_BUFFER:
+        return sizeof(MLockBufferRequest);
+    case M_UNLOCK_AND_POST_BUFFER:
+        return sizeof(MUnlockBufferRequest);
+    case M_SELECT_EVENTS:
+        return sizeof(MSelectEventsRequest);
+    case M_SET_BUFFER_COUNT:
+        return sizeof(MSetBufferCountRequest);
+    case M_TRIM_BUFFER:
+        return sizeof(MTrimBufferRequest);
+    case M_MAP_POSITION:
+        return sizeof(MMapPositionRequest);
+    case M_SET_ROTATION:
+        return sizeof(MSetRotationRequest);
+    case M_BATCH:
+        /* the batched requests follow, see batch_size() */
+        return sizeof(MBatchRequest);
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Room for any single request, header included, or a full batch.
+ */
+union request_buffer
+{
+    MRequestHeader header;
+    uint8_t bytes[sizeof(MRequestHeader) + sizeof(MBatchRequest) +
+                  M_MAX_BATCH_SIZE];
+    uint64_t align;
+};
+
+/**
+ * @return the body size of an M_BATCH request including the batched
+ * requests, -1 if it claims more than a batch can hold
+ */
+static ssize_t batch_size(const MBatchRequest &request)
+{
+    if (request.size > M_MAX_BATCH_SIZE)
+    {
+        return -1;
+    }
+
+    return sizeof(request) + request.size;
+}
+
+/**
+ * Apply the requests following @param request in a single compositor
+ * transaction, the ones the handlers open nest inside it.
+ */
+static void applyBatch(struct mflinger_state *state,
+                       const MBatchRequest &request)
+{
+    const uint8_t *p = (const uint8_t *)(&request + 1);
+    const uint8_t *end = p + request.size;
+
+    SurfaceComposerClient::openGlobalTransaction();
+    while (p + sizeof(MRequestHeader) <= end)
+    {
+        const MRequestHeader *header = (const MRequestHeader *)p;
+        const void *body = p + sizeof(*header);
+        ssize_t size = request_size(header->op);
+        if (size < 0 || p + sizeof(*header) + size > end)
+        {
+            ALOGW("Dropping the rest of a malformed batch");
+            break;
+        }
+
+        if (header->op == M_UPDATE_BUFFER)
+        {
+            updateBuffer(state, *(const MUpdateBufferRequest *)body);
+        }
+        else if (header->op == M_UNLOCK_AND_POST_BUFFER &&
+                 !(((const MUnlockBufferRequest *)body)->flags &
+                   (M_UNLOCK_FLAG_FENCED | M_UNLOCK_FLAG_DAMAGE)))
+        {
+            unlockAndPostBuffer(state, *(const MUnlockBufferRequest *)body,
+                                -1);
+        }
+        else
+        {
+            ALOGW("Dropping request %u, it cannot be batched", header->op);
+        }
+        p += sizeof(*header) + size;
+    }
+    SurfaceComposerClient::closeGlobalTransaction();
+}
+
+/**
+ * recv() that also picks up an fd passed along with SCM_RIGHTS.
+ * @param fd set to the received fd, replacing (and closing) any earlier one
+ */
+static ssize_t recv_fd(const int sockfd, void *data, const size_t len,
+                       const int flags, int *fd)
+{
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+
+    ssize_t n = recvmsg(sockfd, &msg, flags | MSG_CMSG_CLOEXEC);
+    for (cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            if (*fd >= 0)
+            {
+                close(*fd);
+            }
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Read one complete request.
+ *
+ * On a SOCK_SEQPACKET connection every request is a single datagram, so
+ * one recv() gets all of it. On a SOCK_STREAM connection the header has
+ * to be read first to learn how much body follows.
+ *
+ * @param fd set to an fd that came with the request (e.g. a fence), the
+ * caller owns it
+ * @return size of the request body, -1 if the connection is done for
+ */
+static ssize_t read_request(const int cfd, const int seqpacket,
+                            union request_buffer *buf, int *fd)
+{
+    ssize_t n, body_size;
+
+    if (seqpacket)
+    {
+        /* MSG_TRUNC reports the real datagram size */
+        n = recv_fd(cfd, buf->bytes, sizeof(buf->bytes), MSG_TRUNC, fd);
+        if (n > (ssize_t)sizeof(buf->bytes))
+        {
+            ALOGW("Dropping oversized request (%zd bytes)", n);
+            /* 0 is no valid op, so dispatch() skips it */
+            buf->header.op = 0;
+            return 0;
+        }
+    }
+    else
+    {
+        n = recv_fd(cfd, &buf->header, sizeof(buf->header), MSG_WAITALL, fd);
+    }
+
+    if (n < 0)
+    {
+        ALOGE("Failed to read from socket: %s", strerror(errno));
+        return -1;
+    }
+    else if (n == 0)
+    {
+        ALOGE("Client closed connection.");
+        return -1;
+    }
+    else if (n < (ssize_t)sizeof(buf->header))
+    {
+        ALOGW("Dropping truncated request");
+        buf->header.op = 0;
+        return seqpacket ? 0 : -1;
+    }
+
+    if (seqpacket)
+    {
+        return n - sizeof(buf->header);
+    }
+
+    body_size = request_size(buf->header.op);
+    if (body_size < 0)
+    {
+        /*
+         * There is no way to find the start of the next request
+         * in the stream once we lose track, so give up on the client.
+         */
+        ALOGE("Unrecognized request %u, stream out of sync", buf->header.op);
+        return -1;
+    }
+
+    if (body_size > 0)
+    {
+        n = recv_fd(cfd, buf->bytes + sizeof(buf->header), body_size,
+                    MSG_WAITALL, fd);
+        if (n != body_size)
+        {
+            ALOGE("Failed to read request body: %s",
+                  n < 0 ? strerror(errno) : "short read");
+            return -1;
+        }
+    }
+
+    if (buf->header.op == M_BATCH)
+    {
+        const MBatchRequest *batch =
+            (const MBatchRequest *)(buf->bytes + sizeof(buf->header));
+        if (batch_size(*batch) < 0)
+        {
+            ALOGE("Oversized batch of %u bytes, stream out of sync",
+                  batch->size);
+            return -1;
+        }
+
+        if (batch->size > 0)
+        {
+            n = recv_fd(cfd, buf->bytes + sizeof(buf->header) + body_size,
+                        batch->size, MSG_WAITALL, fd);
+            if (n != (ssize_t)batch->size)
+            {
+                ALOGE("Failed to read request batch: %s",
+                      n < 0 ? strerror(errno) : "short read");
+                return -1;
+            }
+            body_size += n;
+        }
+    }
+
+    return body_size;
+}
+
+/**
+ * @param fd fd that came with the request, -1 if none, always consumed
+ * @return -1 if the connection is done for
+ */
+static int dispatch(const int cfd, struct mflinger_state *state,
+                     const union request_buffer *buf, const ssize_t body_size,
+                     int fd)
+{
+    const uint32_t op = buf->header.op;
+    const void *body = buf->bytes + sizeof(buf->header);
+    ssize_t expected_size = request_size(op);
+
+    if (op == M_BATCH && body_size >= expected_size)
+    {
+        expected_size = batch_size(*(const MBatchRequest *)body);
+    }
+
+    ALOGD_IF(DEBUG, "op: %d, body: %zd bytes", op, body_size);
+
+    /* only fenced unlocks carry an fd */
+    if (fd >= 0 && (op != M_UNLOCK_AND_POST_BUFFER ||
+                    request_size(op) != body_size ||
+                    !(((const MUnlockBufferRequest *)body)->flags &
+                      M_UNLOCK_FLAG_FENCED)))
+    {
+        ALOGW("Closing unexpected fd sent with request %u", op);
+        close(fd);
+        fd = -1;
+    }
+
+    if (expected_size != body_size)
+    {
+        ALOGW("Unrecognized request");
+        /*
+         * WATCH OUT! Using write() AND sendmsg() at the
+         * same time to send a reply can result in mixed up
+         * order on the client-side when calling recvmsg()
+         * and parsing the main data buffer.
+         * Basically, don't mix calls to write() and writev().
+         */
+        return 0;
+    }
+
+    switch (op)
+    {
+    case M_GET_DISPLAY_INFO:
+        ALOGD_IF(DEBUG, "Get display info request!");
+        getDisplayInfo(cfd);
+        break;
+
+    case M_CREATE_BUFFER:
+        ALOGD_IF(DEBUG, "Create buffer request!");
+        createBuffer(cfd, state, *(const MCreateBufferRequest *)body);
+        break;
+
+    case M_UPDATE_BUFFER:
+        ALOGD_IF(DEBUG, "Update buffer request!");
+        updateBuffer(state, *(const MUpdateBufferRequest *)body);
+        break;
+
+    case M_RESIZE_BUFFER:
+        ALOGD_IF(DEBUG, "Resize buffer request!");
+        resizeBuffer(cfd, state, *(const MResizeBufferRequest *)body);
+        break;
+
+    case M_LOCK_BUFFER:
+        ALOGD_IF(DEBUG, "Lock buffer request!");
+        lockBuffer(cfd, state, *(const MLockBufferRequest *)body);
+        break;
+
+    case M_UNLOCK_AND_POST_BUFFER:
+        ALOGD_IF(DEBUG, "Unlock and post buffer request!");
+        if ((((const MUnlockBufferRequest *)body)->flags &
+             M_UNLOCK_FLAG_DAMAGE) &&
+            applyDamage(cfd, state, *(const MUnlockBufferRequest *)body) < 0)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return -1;
+        }
+        unlockAndPostBuffer(state, *(const MUnlockBufferRequest *)body, fd);
+        break;
+
+    case M_SELECT_EVENTS:
+        ALOGD_IF(DEBUG, "Select events request!");
+        selectEvents(cfd, state, *(const MSelectEventsRequest *)body);
+        break;
+
+    case M_SET_BUFFER_COUNT:
+        ALOGD_IF(DEBUG, "Set buffer count request!");
+        setBufferCount(cfd, state, *(const MSetBufferCountRequest *)body);
+        break;
+
+    case M_MAP_POSITION:
+        ALOGD_IF(DEBUG, "Map position request!");
+        mapPosition(cfd, state, *(const MMapPositionRequest *)body);
+        break;
+
+    case M_TRIM_BUFFER:
+        ALOGD_IF(DEBUG, "Trim buffer request!");
+        trimBuffer(state, *(const MTrimBufferRequest *)body);
+        break;
+
+    case M_SET_ROTATION:
+        ALOGD_IF(DEBUG, "Set rotation request!");
+        setRotation(state, *(const MSetRotationRequest *)body);
+        break;
+
+    case M_BATCH:
+        ALOGD_IF(DEBUG, "Batch request!");
+        applyBatch(state, *(const MBatchRequest *)body);
+        break;
+    }
+
+    return 0;
+}
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * One listening socket per transport, clients pick one when connecting.
+ */
+struct listener
+{
+    int fd;
+    int seqpacket;
+    int remote; /* network transport, no fd passing */
+};
+
+/* time a remote client gets to send its MAuthRequest */
+static const int AUTH_TIMEOUT_S = 2;
+
+/*
+ * Connections opened while a client is being served join its session
+ * and share its surfaces, so a client can spread its requests over
+ * threads (e.g. mclient's cursor thread). Only the process that started
+ * the session may join it, remote peers have no credentials to compare
+ * and are vouched for by M_TOKEN_ENV instead. The session ends with the
+ * connection that started it.
+ *
+ * Every connection is read on its own thread and requests are handled
+ * one at a time under state->lock, so a connection waiting for the rest
+ * of a request, or for a free buffer in lockBuffer(), does not hold up
+ * the others.
+ */
+static const int MAX_CONNECTIONS = 4;
+
+struct session;
+
+struct connection
+{
+    int fd;       /* -1 = unused */
+    int seqpacket;
+    int done;     /* the thread is about to exit */
+    pthread_t thread;
+    struct session *session;
+};
+
+struct session
+{
+    struct mflinger_state *state;
+    struct connection conns[MAX_CONNECTIONS]; /* [0] started the session */
+    struct ucred owner;                       /* its peer, if local */
+    int wake[2];                              /* pipe, a thread is done */
+};
+
+/**
+ * Check the MAuthRequest a remote client opens with against our secret.
+ * @return 0 if it matches, -1 otherwise
+ */
+static int authenticate(const int cfd, const struct mflinger_state *state)
+{
+    MAuthRequest auth;
+    struct timeval timeout = {AUTH_TIMEOUT_S, 0};
+    unsigned char diff = 0;
+    size_t i;
+
+    /* a silent peer must not hold up the session for long */
+    setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ssize_t n = recv(cfd, &auth, sizeof(auth), MSG_WAITALL);
+    timeout.tv_sec = 0;
+    setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (n != (ssize_t)sizeof(auth))
+    {
+        return -1;
+    }
+
+    /* every byte, so the time taken tells nothing about the secret */
+    for (i = 0; i < sizeof(auth.token); ++i)
+    {
+        diff |= auth.token[i] ^ state->token[i];
+    }
+    return diff == 0 ? 0 : -1;
+}
+
+/**
+ * @return fd of the accepted connection, -1 on error
+ */
+static int accept_client(const struct listener *listener,
+                         const struct mflinger_state *state)
+{
+    struct sockaddr_storage remote;
+    socklen_t t = sizeof(remote);
+
+    int cfd = accept(listener->fd, (struct sockaddr *)&remote, &t);
+    if (cfd < 0)
+    {
+        ALOGE("Failed to accept client: %s", strerror(errno));
+        return -1;
+    }
+
+    if (listener->remote && remote.ss_family != AF_VSOCK)
+    {
+        /* small requests, never hold them back */
+        int one = 1;
+        setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    if (listener->remote && authenticate(cfd, state) < 0)
+    {
+        ALOGW("Rejecting a remote client without the right %s", M_TOKEN_ENV);
+        close(cfd);
+        return -1;
+    }
+
+    return cfd;
+}
+
+/**
+ * @return 1 if @param cfd, accepted on @param listener, may join
+ */
+static int may_join(const struct session *session,
+                    const struct listener *listener, const int cfd)
+{
+    /* remote sessions cannot pass fds, so never mix the two */
+    if (listener->remote != session->state->remote)
+    {
+        return 0;
+    }
+    if (listener->remote)
+    {
+        return 1;
+    }
+
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+    {
+        ALOGE("Failed to identify client: %s", strerror(errno));
+        return 0;
+    }
+    return cred.pid == session->owner.pid && cred.uid == session->owner.uid;
+}
+
+/**
+ * Read and handle one request.
+ * @return -1 if the connection is done for
+ */
+static int serve_request(const struct connection *conn,
+                         struct mflinger_state *state)
+{
+    union request_buffer buf;
+    int fd = -1, err;
+
+    ssize_t body_size = read_request(conn->fd, conn->seqpacket, &buf, &fd);
+    if (body_size < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    err = dispatch(conn->fd, state, &buf, body_size, fd);
+    pthread_mutex_unlock(&state->lock);
+    return err;
+}
+
+static void *serve_connection(void *data)
+{
+    struct connection *conn = (struct connection *)data;
+    char c = 0;
+
+    while (serve_request(conn, conn->session->state) >= 0)
+    {
+    }
+
+    /* serve() joins us */
+    __atomic_store_n(&conn->done, 1, __ATOMIC_RELEASE);
+    if (write(conn->session->wake[1], &c, 1) < 0 && errno != EAGAIN)
+    {
+        ALOGE("Failed to wake up the session: %s", strerror(errno));
+    }
+    return NULL;
+}
+
+/**
+ * Serve @param cfd in @param slot of @param session on a new thread.
+ * @return 0 on success, -1 (and @param cfd closed) on error
+ */
+static int start_connection(struct session *session, const int slot,
+                            const int cfd, const int seqpacket)
+{
+    struct connection *conn = &session->conns[slot];
+    conn->fd = cfd;
+    conn->seqpacket = seqpacket;
+    conn->done = 0;
+    conn->session = session;
+
+    int err = pthread_create(&conn->thread, NULL, serve_connection, conn);
+    if (err != 0)
+    {
+        ALOGE("Failed to start connection thread: %s", strerror(err));
+        close(cfd);
+        conn->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Join the threads of finished connections, or of all of them when the
+ * session is over.
+ * @return 1 if the connection that started the session is gone
+ */
+static int reap_connections(struct session *session, const int all)
+{
+    int i, over = 0;
+
+    for (i = 0; i < MAX_CONNECTIONS; ++i)
+    {
+        struct connection *conn = &session->conns[i];
+        if (conn->fd < 0)
+        {
+            continue;
+        }
+
+        if (all)
+        {
+            /* wakes up a thread blocked on the socket */
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        else if (!__atomic_load_n(&conn->done, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+        else if (i > 0)
+        {
+            ALOGI("Client closed one of its connections");
+        }
+
+        pthread_join(conn->thread, NULL);
+        close(conn->fd);
+        conn->fd = -1;
+        over |= i == 0;
+    }
+
+    return over;
 }
 
-static void serve(const int sockfd, struct mflinger_state *state)
+static void serve(const struct listener *listeners, const int num_listeners,
+                  struct mflinger_state *state)
 {
-    int cfd;
-    socklen_t t;
-    struct sockaddr_un remote;
+    int i, cfd = -1, seqpacket = 0;
+    struct session session;
+    struct pollfd fds[num_listeners];
 
     ALOGD_IF(DEBUG, "Listening for client requests...");
 
-    t = sizeof(remote);
-    cfd = accept(sockfd, (struct sockaddr *)&remote, &t);
+    for (i = 0; i < num_listeners; ++i)
+    {
+        fds[i].fd = listeners[i].fd;
+        fds[i].events = POLLIN;
+    }
+    if (poll(fds, num_listeners, -1) < 0)
+    {
+        ALOGE("Failed to poll listeners: %s", strerror(errno));
+        return;
+    }
+
+    for (i = 0; i < num_listeners && cfd < 0; ++i)
+    {
+        if (fds[i].revents & POLLIN)
+        {
+            cfd = accept_client(&listeners[i], state);
+            seqpacket = listeners[i].seqpacket;
+            state->remote = listeners[i].remote;
+        }
+    }
     if (cfd < 0)
     {
-        ALOGE("Failed to accept client: %s", strerror(errno));
         return;
     }
 
-    do
+    ALOGI("Client connected over %s", state->remote ? "the network" :
+                                      seqpacket ? "SOCK_SEQPACKET" : "SOCK_STREAM");
+
+    session.state = state;
+    for (i = 0; i < MAX_CONNECTIONS; ++i)
+    {
+        session.conns[i].fd = -1;
+    }
+
+    /* nobody else joins where the peer is unknown */
+    socklen_t len = sizeof(session.owner);
+    session.owner.pid = -1;
+    if (!state->remote &&
+        getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &session.owner, &len) < 0)
     {
-        int n;
-        uint32_t buf;
-        n = read(cfd, &buf, sizeof(buf));
+        ALOGW("Failed to identify client: %s", strerror(errno));
+    }
 
-        if (n < 0)
-        {
-            ALOGE("Failed to read from socket: %s", strerror(errno));
+    if (pipe2(session.wake, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        ALOGE("Failed to create session pipe: %s", strerror(errno));
+        close(cfd);
+        return;
+    }
+    if (start_connection(&session, 0, cfd, seqpacket) < 0)
+    {
+        close(session.wake[0]);
+        close(session.wake[1]);
+        return;
+    }
 
-            // client hung up with unread data
-            if (errno == -ECONNRESET)
-            {
-                break;
-            }
+    /*
+     * Wait for further connections and finished ones, but wake up for
+     * display changes (and periodically for those without notifications)
+     * in between.
+     */
+    struct pollfd pfds[num_listeners + 2];
+    int64_t next_check = 0;
+    int done = 0;
+    while (!done)
+    {
+        int num_pfds = 0, wake_idx, events_idx = -1;
+        for (i = 0; i < num_listeners; ++i, ++num_pfds)
+        {
+            pfds[num_pfds].fd = listeners[i].fd;
+            pfds[num_pfds].events = POLLIN;
         }
-        else if (n == 0)
+        wake_idx = num_pfds++;
+        pfds[wake_idx].fd = session.wake[0];
+        pfds[wake_idx].events = POLLIN;
+        if (state->display_events != NULL)
         {
-            ALOGE("Client closed connection.");
-            break;
+            events_idx = num_pfds++;
+            pfds[events_idx].fd = state->display_events->getFd();
+            pfds[events_idx].events = POLLIN;
         }
 
-        ALOGD_IF(DEBUG, "n: %d", n);
-        ALOGD_IF(DEBUG, "buf: %d", buf);
-        switch (buf)
+        /* frame timestamps trickle in after the fact, check back soon */
+        pthread_mutex_lock(&state->lock);
+        int pending = has_pending_frames(state);
+        pthread_mutex_unlock(&state->lock);
+        int n = poll(pfds, num_pfds,
+                     pending ? FRAME_TIMESTAMPS_POLL_MS : DISPLAY_POLL_MS);
+        if (n < 0 && errno != EINTR)
         {
-        case M_GET_DISPLAY_INFO:
-            ALOGD_IF(DEBUG, "Get display info request!");
-            getDisplayInfo(cfd);
-            break;
-
-        case M_CREATE_BUFFER:
-            ALOGD_IF(DEBUG, "Create buffer request!");
-            createBuffer(cfd, state);
+            ALOGE("Failed to poll client: %s", strerror(errno));
             break;
+        }
 
-        case M_UPDATE_BUFFER:
-            ALOGD_IF(DEBUG, "Update buffer request!");
-            updateBuffer(cfd, state);
-            break;
+        pthread_mutex_lock(&state->lock);
+        if (events_idx >= 0 && n > 0 && (pfds[events_idx].revents & POLLIN))
+        {
+            handleDisplayEvents(state);
+            next_check = 0;
+        }
 
-        case M_RESIZE_BUFFER:
-            ALOGD_IF(DEBUG, "Resize buffer request!");
-            resizeBuffer(cfd, state);
-            break;
+        int64_t now = now_ms();
+        if (state->event_fd >= 0 && now >= next_check)
+        {
+            updateDisplayState(state);
+            next_check = now + DISPLAY_POLL_MS;
+        }
 
-        case M_LOCK_BUFFER:
-            ALOGD_IF(DEBUG, "Lock buffer request!");
-            lockBuffer(cfd, state);
-            break;
+        if (pending)
+        {
+            sendFrameTimestamps(state);
+        }
+        pthread_mutex_unlock(&state->lock);
 
-        case M_UNLOCK_AND_POST_BUFFER:
-            ALOGD_IF(DEBUG, "Unlock and post buffer request!");
-            unlockAndPostBuffer(cfd, state);
-            break;
+        if (n <= 0)
+        {
+            continue;
+        }
 
-        default:
-            ALOGW("Unrecognized request");
-            /*
-                 * WATCH OUT! Using write() AND sendmsg() at the
-                 * same time to send a reply can result in mixed up
-                 * order on the client-side when calling recvmsg() 
-                 * and parsing the main data buffer.
-                 * Basically, don't mix calls to write() and writev().
-                 */
-            // if (write(cfd, ACK, strlen(ACK) + 1) < 0) {
-            //     ALOGE("Failed to write socket ACK: %s", strerror(errno));
-            // }
-            break;
+        if (pfds[wake_idx].revents & POLLIN)
+        {
+            char c[MAX_CONNECTIONS];
+            while (read(session.wake[0], c, sizeof(c)) > 0)
+            {
+            }
+            done = reap_connections(&session, 0);
         }
-    } while (1);
 
-    reset_state(state);
-    close(cfd);
-}
+        for (i = 0; i < num_listeners && !done; ++i)
+        {
+            if (!(pfds[i].revents & POLLIN))
+            {
+                continue;
+            }
 
-int main()
-{
+            cfd = accept_client(&listeners[i], state);
+            if (cfd < 0)
+            {
+                continue;
+            }
 
-    struct mflinger_state state;
-    state.num_surfaces = 0;
-    state.layerstack = -1;
+            int slot;
+            for (slot = 1; slot < MAX_CONNECTIONS; ++slot)
+            {
+                if (session.conns[slot].fd < 0)
+                {
+                    break;
+                }
+            }
+            if (slot == MAX_CONNECTIONS || !may_join(&session, &listeners[i], cfd))
+            {
+                ALOGW("Turning away a connection, a client is being served");
+                close(cfd);
+                continue;
+            }
 
-    //
-    // Establish a connection with SurfaceFlinger
-    //
-    state.compositor = new SurfaceComposerClient;
-    status_t check = state.compositor->initCheck();
-    ALOGD_IF(DEBUG, "compositor->initCheck() = %d", check);
-    if (NO_ERROR != check)
-    {
-        ALOGE("compositor->initCheck() failed!");
-        return -1;
+            if (start_connection(&session, slot, cfd, listeners[i].seqpacket) == 0)
+            {
+                ALOGI("Client opened connection %d", slot + 1);
+            }
+        }
     }
 
-    //
-    // Connect to bridge socket
-    //
-    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    reap_connections(&session, 1);
+    close(session.wake[0]);
+    close(session.wake[1]);
+    reset_state(state);
+}
+
+static int open_listener(const int type, const char *name)
+{
+    int sockfd = socket(AF_UNIX, type, 0);
     if (sockfd < 0)
     {
         ALOGE("Failed to create socket: %s", strerror(errno));
@@ -568,7 +2478,7 @@ int main()
 
     /* add a leading null byte to indicate abstract socket namespace */
     local.sun_path[0] = '\0';
-    strcpy(local.sun_path + 1, M_SOCK_PATH);
+    strcpy(local.sun_path + 1, name);
     len = 1 + strlen(local.sun_path + 1) + sizeof(local.sun_family);
 
     /* unlink just in case...but abstract names should be auto destroyed */
@@ -577,6 +2487,7 @@ int main()
     if (err < 0)
     {
         ALOGE("Failed to bind socket: %s", strerror(errno));
+        close(sockfd);
         return -1;
     }
 
@@ -584,16 +2495,237 @@ int main()
     if (err < 0)
     {
         ALOGE("Failed to listen on socket: %s", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+static int is_loopback(const struct sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET)
+    {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        return (ntohl(in->sin_addr.s_addr) >> 24) == IN_LOOPBACKNET;
+    }
+    if (addr->sa_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+        return IN6_IS_ADDR_LOOPBACK(&in6->sin6_addr);
+    }
+    return 0;
+}
+
+/**
+ * Listen for remote clients (see M_DISPLAY_ENV) on @param address:
+ *     tcp:PORT        loopback only, e.g. with port forwarding
+ *     tcp:HOST:PORT   the address of one interface, e.g. tcp:10.0.2.15:5900
+ *     vsock:PORT      any CID
+ * Only M_TOKEN_ENV keeps others out where the address is reachable.
+ */
+static int open_remote_listener(const char *address)
+{
+    int sockfd = -1;
+    char *end;
+
+    if (strncmp(address, "vsock:", 6) == 0)
+    {
+        struct sockaddr_vm local;
+        memset(&local, 0, sizeof(local));
+        local.svm_family = AF_VSOCK;
+        local.svm_cid = VMADDR_CID_ANY;
+        local.svm_port = strtoul(address + 6, &end, 10);
+        if (end == address + 6 || *end != '\0')
+        {
+            ALOGE("Invalid vsock address: %s", address);
+            return -1;
+        }
+
+        sockfd = socket(AF_VSOCK, SOCK_STREAM, 0);
+        if (sockfd >= 0 &&
+            bind(sockfd, (struct sockaddr *)&local, sizeof(local)) < 0)
+        {
+            close(sockfd);
+            sockfd = -1;
+        }
+    }
+    else if (strncmp(address, "tcp:", 4) == 0)
+    {
+        char host[256] = "127.0.0.1";
+        const char *port = strrchr(address, ':');
+        size_t host_len = port > address + 3 ? port - (address + 4) : 0;
+        if (host_len >= sizeof(host) || port[1] == '\0')
+        {
+            ALOGE("Invalid tcp address: %s", address);
+            return -1;
+        }
+        if (host_len > 0)
+        {
+            memcpy(host, address + 4, host_len);
+            host[host_len] = '\0';
+        }
+
+        struct addrinfo hints, *res, *ai;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        int err = getaddrinfo(host, port + 1, &hints, &res);
+        if (err != 0)
+        {
+            ALOGE("Failed to resolve %s: %s", address, gai_strerror(err));
+            return -1;
+        }
+
+        for (ai = res; ai != NULL && sockfd < 0; ai = ai->ai_next)
+        {
+            sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (sockfd < 0)
+            {
+                continue;
+            }
+
+            int one = 1;
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(sockfd, ai->ai_addr, ai->ai_addrlen) < 0)
+            {
+                close(sockfd);
+                sockfd = -1;
+            }
+            else if (!is_loopback(ai->ai_addr))
+            {
+                ALOGW("%s is reachable from other hosts, unencrypted and only "
+                      "guarded by %s", address, M_TOKEN_ENV);
+            }
+        }
+        freeaddrinfo(res);
+    }
+    else
+    {
+        ALOGE("Unsupported listen address: %s", address);
+        return -1;
+    }
+
+    if (sockfd < 0)
+    {
+        ALOGE("Failed to bind %s: %s", address, strerror(errno));
+        return -1;
+    }
+
+    if (listen(sockfd, 1) < 0)
+    {
+        ALOGE("Failed to listen on %s: %s", address, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+int main(int argc, char **argv)
+{
+    const char *listen_address = NULL;
+    int i;
+
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc)
+        {
+            listen_address = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--listen tcp:[HOST:]PORT|vsock:PORT]\n"
+                            "  --listen needs a shared secret in %s\n",
+                    argv[0], M_TOKEN_ENV);
+            return -1;
+        }
+    }
+
+    /* a connection may be shut down under a thread writing to it */
+    signal(SIGPIPE, SIG_IGN);
+
+    struct mflinger_state state;
+    pthread_mutex_init(&state.lock, NULL);
+    memset(state.locked, 0, sizeof(state.locked));
+    state.remote = 0;
+    state.scratch = NULL;
+    state.scratch_size = 0;
+    state.num_surfaces = 0;
+    state.layerstack = -1;
+    state.hdmi_connected = 1;
+    state.visible = 1;
+    state.event_fd = -1;
+    state.event_mask = 0;
+    state.vsync_on = 0;
+    state.orientation = M_ORIENTATION_0;
+    memset(state.positions, 0, sizeof(state.positions));
+
+    //
+    // Establish a connection with SurfaceFlinger
+    //
+    state.compositor = new SurfaceComposerClient;
+    status_t check = state.compositor->initCheck();
+    ALOGD_IF(DEBUG, "compositor->initCheck() = %d", check);
+    if (NO_ERROR != check)
+    {
+        ALOGE("compositor->initCheck() failed!");
+        return -1;
+    }
+
+    //
+    // Listen for display hotplug
+    //
+    DisplayEventReceiver display_events;
+    state.display_events = &display_events;
+    if (NO_ERROR != display_events.initCheck())
+    {
+        ALOGW("No display events, assuming the display is always on");
+        state.display_events = NULL;
+    }
+
+    //
+    // Connect to bridge sockets
+    //
+    struct listener listeners[] = {
+        {open_listener(SOCK_STREAM, M_SOCK_PATH), 0, 0},
+        {open_listener(SOCK_SEQPACKET, M_SEQPACKET_SOCK_PATH), 1, 0},
+        {-1, 0, 1},
+    };
+    int num_listeners = 2;
+    if (listeners[0].fd < 0 || listeners[1].fd < 0)
+    {
         return -1;
     }
 
+    if (listen_address != NULL)
+    {
+        const char *token = getenv(M_TOKEN_ENV);
+        if (token == NULL || *token == '\0' || strlen(token) >= M_TOKEN_SIZE)
+        {
+            ALOGE("--listen needs a %s of 1 to %d characters", M_TOKEN_ENV,
+                  M_TOKEN_SIZE - 1);
+            return -1;
+        }
+        memset(state.token, 0, sizeof(state.token));
+        memcpy(state.token, token, strlen(token));
+
+        listeners[2].fd = open_remote_listener(listen_address);
+        if (listeners[2].fd < 0)
+        {
+            return -1;
+        }
+        ++num_listeners;
+    }
+
     //
     // Serve loop
     //
     ALOGI("At your service!");
     for (;;)
     {
-        serve(sockfd, &state);
+        serve(listeners, num_listeners, &state);
     }
 
     //
@@ -601,7 +2733,11 @@ int main()
     //
     purge_surfaces(&state);
     state.compositor = NULL;
+    free(state.scratch);
 
-    close(sockfd);
+    for (i = 0; i < num_listeners; ++i)
+    {
+        close(listeners[i].fd);
+    }
     return 0;
 }
@@ -1,8 +1,27 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <assert.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 
 #include "../src/mclient/util.h"
+#include "../src/mclient/mpacer.h"
+#include "../src/mclient/mrect.h"
+#include "../src/mclient/mfanout.h"
+#include "../src/mclient/mcopy.h"
+#include "../src/mclient/msched.h"
+#include "../src/mclient/mhud.h"
+#include "../src/mclient/mheatmap.h"
+#include "../src/mclient/mbudget.h"
+#include "../src/mclient/mgovernor.h"
+#include "../lib/mcodec.h"
+#include "mlib.h"
+#include "mlib-protocol.h"
+#include "mseqlock.h"
 
 static void test_argb8888_get_alpha() {
     /* ARGB8888 is from MSB to LSB */
@@ -17,8 +36,572 @@ static void test_argb8888_get_alpha() {
     }
 }
 
+static void test_mpacer() {
+    struct MPacer pacer;
+    uint64_t ms = 1000000;
+
+    /* 100 fps = 10ms between frames */
+    mpacer_init(&pacer, 100);
+
+    /* first frame renders right away */
+    assert(mpacer_request(&pacer, 5 * ms) == 5 * ms);
+    /* more damage before the frame starts is coalesced */
+    assert(mpacer_request(&pacer, 6 * ms) == 0);
+    mpacer_begin_frame(&pacer, 5 * ms);
+
+    /* damage within the interval waits for the next slot */
+    assert(mpacer_request(&pacer, 7 * ms) == 15 * ms);
+    mpacer_begin_frame(&pacer, 15 * ms);
+
+    /* damage after an idle period renders right away */
+    assert(mpacer_request(&pacer, 100 * ms) == 100 * ms);
+
+    /* uncapped never waits */
+    mpacer_init(&pacer, 0);
+    mpacer_begin_frame(&pacer, 5 * ms);
+    assert(mpacer_request(&pacer, 5 * ms) == 5 * ms);
+
+    /* frames latched promptly keep the cap */
+    mpacer_init(&pacer, 100);
+    mpacer_feedback(&pacer, 0, 2 * ms, 3 * ms, 20 * ms);
+    assert(pacer.mInterval == 10 * ms);
+    assert(pacer.mLatency == 20 * ms);
+
+    /* a compositor backlog or dropped frames back off, within bounds */
+    int i;
+    for (i = 0; i < 100; ++i) {
+        mpacer_feedback(&pacer, 0, 2 * ms, 0, 0);
+    }
+    assert(pacer.mInterval == 40 * ms);
+    assert(pacer.mLatency == 20 * ms);
+
+    /* and recover once it catches up */
+    for (i = 0; i < 100; ++i) {
+        mpacer_feedback(&pacer, 0, 2 * ms, 3 * ms, 20 * ms);
+    }
+    assert(pacer.mInterval == 10 * ms);
+
+    /* the governor moves the cap both ways */
+    mpacer_set_max_fps(&pacer, 50);
+    assert(pacer.mInterval == 20 * ms && pacer.mMinInterval == 20 * ms);
+    mpacer_set_max_fps(&pacer, 100);
+    assert(pacer.mInterval == 10 * ms);
+}
+
+static void test_mrect() {
+    MRect a = { 10, 10, 20, 20 };
+    MRect b = { 20, 0, 20, 15 };
+    MRect empty = { 5, 5, 0, 0 };
+    MRect r;
+
+    r = a;
+    mrect_union(&r, &b);
+    assert(r.x == 10 && r.y == 0 && r.width == 30 && r.height == 30);
+    assert(mrect_contains(&r, &a) && mrect_contains(&r, &b));
+    assert(!mrect_contains(&a, &r));
+
+    /* empty rects do not grow anything */
+    r = a;
+    mrect_union(&r, &empty);
+    assert(r.x == a.x && r.width == a.width);
+
+    r = a;
+    assert(mrect_intersect(&r, &b));
+    assert(r.x == 20 && r.y == 10 && r.width == 10 && r.height == 5);
+
+    MRect far = { 100, 100, 1, 1 };
+    r = a;
+    assert(!mrect_intersect(&r, &far));
+    assert(mrect_is_empty(&r));
+
+    /* what is left after a cut covers the rest exactly once */
+    MRect rest[4];
+    MRect hole = { 15, 15, 5, 5 };
+    int i, n = mrect_subtract(&a, &hole, rest);
+    uint32_t area = 0;
+    assert(n == 4);
+    for (i = 0; i < n; ++i)
+    {
+        r = rest[i];
+        assert(!mrect_intersect(&r, &hole));
+        area += rest[i].width * rest[i].height;
+    }
+    assert(area == 20 * 20 - 5 * 5);
+    assert(mrect_subtract(&a, &far, rest) == 1 && rest[0].x == a.x);
+    assert(mrect_subtract(&hole, &a, rest) == 0);
+}
+
+static void test_mwaitbuffer() {
+    /* an eventfd stands in for a sync_file, both poll readable when signaled */
+    int fence = eventfd(0, 0);
+    uint64_t one = 1;
+    MBuffer buf = { 0 };
+
+    assert(fence >= 0);
+    buf.__fence_fd = fence;
+
+    /* unsignaled fence times out and stays with the buffer */
+    assert(MWaitBuffer(&buf, 0) == 1);
+    assert(buf.__fence_fd == fence);
+
+    /* signaled fence is consumed */
+    assert(write(fence, &one, sizeof(one)) == sizeof(one));
+    assert(MWaitBuffer(&buf, -1) == 0);
+    assert(buf.__fence_fd == -1);
+    assert(fcntl(fence, F_GETFD) < 0);
+
+    /* no fence means the buffer is ready */
+    assert(MWaitBuffer(&buf, 0) == 0);
+}
+
+static void test_mseqlock() {
+    uint32_t lock = 0;
+    uint32_t seq;
+
+    seq = mseqlock_read_begin(&lock);
+    assert(!mseqlock_read_retry(&lock, seq));
+
+    /* a write in progress or one that happened meanwhile means retry */
+    mseqlock_write_begin(&lock);
+    assert(mseqlock_read_retry(&lock, mseqlock_read_begin(&lock)));
+    mseqlock_write_end(&lock);
+    assert(mseqlock_read_retry(&lock, seq));
+
+    seq = mseqlock_read_begin(&lock);
+    assert(!mseqlock_read_retry(&lock, seq));
+}
+
+static void test_position_page() {
+    MPositionPage page = { 0 };
+    MDisplay dpy = { 0 };
+    MBuffer buf = { 0 };
+    uint32_t seq;
+
+    buf.__position = &page;
+    dpy.sock_fd = -1;
+
+    /* a mapped page takes the update, nothing goes to the socket */
+    assert(MUpdateBuffer(&dpy, &buf, 10, 20) == 0);
+    assert(page.seq == 2 && page.xpos == 10 && page.ypos == 20);
+
+    /* readers only see whole updates, and notice newer ones */
+    seq = mseqlock_read_begin(&page.seq);
+    assert(!mseqlock_read_retry(&page.seq, seq));
+    assert(MUpdateBuffer(&dpy, &buf, 30, 40) == 0);
+    assert(mseqlock_read_retry(&page.seq, seq));
+    assert(page.xpos == 30 && page.ypos == 40);
+}
+
+static void fill_rect(MBuffer *view, const MRect *r, uint32_t px) {
+    uint32_t x, y;
+    for (y = r->y; y < r->y + r->height; ++y) {
+        for (x = r->x; x < r->x + r->width; ++x) {
+            ((uint32_t *)view->bits)[y * view->stride + x] = px;
+        }
+    }
+}
+
+static uint32_t frame_px(struct MFanout *fanout, uint64_t n, int x, int y) {
+    const struct MFramesHeader *hdr = fanout->mRing;
+    const struct MFrameSlot *slot = mframes_slot(hdr, n);
+    assert(slot->frame == n);
+    return ((const uint32_t *)mframes_pixels(hdr, slot))[y * hdr->max_width + x];
+}
+
+static void publish(struct MFanout *fanout, uint32_t width, uint32_t height,
+                    const MRect *damage, uint32_t px) {
+    MBuffer view;
+    assert(mfanout_begin_frame(fanout, width, height, damage, 1, &view) == 0);
+    fill_rect(&view, damage, px);
+    mfanout_end_frame(fanout, px);
+}
+
+static void test_mfanout() {
+    struct MFanout fanout;
+    MRect full = { 0, 0, 8, 4 };
+    MRect a = { 0, 0, 2, 2 };
+    MRect b = { 4, 2, 2, 2 };
+    MRect c = { 6, 0, 1, 1 };
+    MBuffer view;
+
+    assert(mfanout_init(&fanout, 8, 4) == 0);
+    assert(fanout.mRing->magic == MFRAMES_MAGIC);
+    assert(mframes_latest(fanout.mRing) == 0);
+    assert(mfanout_begin_frame(&fanout, 9, 4, &full, 1, &view) < 0);
+
+    publish(&fanout, 8, 4, &full, 1);
+    publish(&fanout, 8, 4, &a, 2);
+    publish(&fanout, 8, 4, &b, 3);
+
+    /* frame 4 reuses the slot of frame 1 and catches up on frames 2 and 3 */
+    publish(&fanout, 8, 4, &c, 4);
+    assert(mframes_latest(fanout.mRing) == 4);
+    assert(frame_px(&fanout, 4, 1, 1) == 2);
+    assert(frame_px(&fanout, 4, 5, 3) == 3);
+    assert(frame_px(&fanout, 4, 6, 0) == 4);
+    assert(frame_px(&fanout, 4, 7, 3) == 1);
+
+    const struct MFrameSlot *slot = mframes_slot(fanout.mRing, 4);
+    uint32_t seq = mseqlock_read_begin(&slot->seq);
+    assert(slot->num_rects == 1 && slot->rects[0].x == 6);
+    assert(slot->timestamp == 4);
+    assert(!mseqlock_read_retry(&slot->seq, seq));
+
+    /* after a resize, slots written at the old size are redrawn in full */
+    MRect small = { 0, 0, 4, 4 };
+    publish(&fanout, 4, 4, &small, 5);
+    publish(&fanout, 4, 4, &a, 6);
+    assert(frame_px(&fanout, 6, 0, 0) == 6);
+    assert(frame_px(&fanout, 6, 3, 3) == 5);
+
+    mfanout_destroy(&fanout, NULL);
+}
+
+static void test_mcodec() {
+    enum { W = 16, H = 4, STRIDE = 20 };
+    uint32_t src[H * STRIDE], dst[H * STRIDE];
+    uint8_t enc[W * H * 4 + H * 4];
+    size_t len;
+    int x, y;
+
+    /* flat fill, a repeated row, and noise */
+    for (y = 0; y < H; ++y) {
+        for (x = 0; x < STRIDE; ++x) {
+            src[y * STRIDE + x] = y == 0 ? 0xff000000 + (x < 8 ? 0 : x * 77)
+                                : y == 1 ? src[x]
+                                : 0xff000000 ^ (uint32_t)(x * 2654435761u + y);
+        }
+    }
+
+    assert(mcodec_bound(W, H) <= sizeof(enc));
+    len = mcodec_encode(src, STRIDE, W, H, enc);
+    assert(len <= mcodec_bound(W, H));
+    /* the fill is a single run, the copied row a single token */
+    assert(len < (W + 1) * H * 4 - 6 * 4);
+
+    memset(dst, 0, sizeof(dst));
+    assert(mcodec_decode(enc, len, dst, STRIDE, W, H) == 0);
+    for (y = 0; y < H; ++y) {
+        assert(memcmp(&src[y * STRIDE], &dst[y * STRIDE], W * 4) == 0);
+        /* pixels past the rectangle are left alone */
+        assert(dst[y * STRIDE + W] == 0);
+    }
+
+    /* truncated or trailing data is rejected */
+    assert(mcodec_decode(enc, len - 1, dst, STRIDE, W, H) < 0);
+    assert(mcodec_decode(enc, len, dst, STRIDE, W, H - 1) < 0);
+}
+
+static void test_mcopy() {
+    /* odd widths and unaligned rows, big enough to be striped */
+    enum { ROWS = 301, ROW_BYTES = 1001, SRC_STRIDE = 1043, DST_STRIDE = 1100 };
+    uint8_t *src = malloc(ROWS * SRC_STRIDE + 3);
+    uint8_t *dst = malloc(ROWS * DST_STRIDE + 5);
+    struct MCopy copy;
+    struct MCopyTuning t;
+    int i, threads;
+    uint32_t y;
+
+    for (i = 0; i < ROWS * SRC_STRIDE + 3; ++i) {
+        src[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    assert(mcopy_init(&copy) == 0);
+    assert(mcopy_set(&copy, "bogus", 1) < 0);
+    assert(mcopy_set(&copy, "memcpy", MCOPY_MAX_THREADS + 1) < 0);
+    for (i = 0; i < mcopy_num_kernels; ++i) {
+        for (threads = 1; threads <= 3; threads += 2) {
+            assert(mcopy_set(&copy, mcopy_kernels[i].name, threads) == 0);
+            memset(dst, 0, ROWS * DST_STRIDE + 5);
+            mcopy_rows(&copy, dst + 5, DST_STRIDE, src + 3, SRC_STRIDE,
+                       ROW_BYTES, ROWS);
+            for (y = 0; y < ROWS; ++y) {
+                assert(memcmp(dst + 5 + y * DST_STRIDE, src + 3 + y * SRC_STRIDE,
+                              ROW_BYTES) == 0);
+                /* the gap between rows is left alone */
+                assert(dst[5 + y * DST_STRIDE + ROW_BYTES] == 0);
+            }
+        }
+    }
+    mcopy_destroy(&copy);
+    free(src);
+    free(dst);
+
+    assert(mcopy_parse_tuning("1920x1080 sse2 2 Intel(R) Core(TM) i5\n", &t) == 0);
+    assert(t.width == 1920 && t.height == 1080 && t.threads == 2);
+    assert(strcmp(t.kernel, "sse2") == 0);
+    assert(strcmp(t.cpu, "Intel(R) Core(TM) i5") == 0);
+    assert(mcopy_parse_tuning("1920x1080 sse2 2\n", &t) < 0);
+    assert(mcopy_parse_tuning("1920x1080 sse2 0 cpu\n", &t) < 0);
+    assert(mcopy_parse_tuning("garbage\n", &t) < 0);
+}
+
+static void test_msched() {
+    struct MSchedPolicy p;
+    char buf[64];
+
+    assert(msched_parse("fifo:10@2,3", &p) == 0);
+    assert(p.policy == SCHED_FIFO && p.priority == 10 && p.cpus == 0xc);
+    msched_format(&p, buf, sizeof(buf));
+    assert(strcmp(buf, "fifo:10@2-3") == 0);
+
+    assert(msched_parse("other:-5@0-1,4", &p) == 0);
+    assert(p.policy == SCHED_OTHER && p.nice == -5 && p.cpus == 0x13);
+    msched_format(&p, buf, sizeof(buf));
+    assert(strcmp(buf, "other:-5@0-1,4") == 0);
+
+    /* real-time policies default to the lowest priority */
+    assert(msched_parse("rr", &p) == 0);
+    assert(p.policy == SCHED_RR && p.priority == 1 && p.cpus == 0);
+
+    assert(msched_parse("idle", &p) < 0);
+    assert(msched_parse("fifo:0", &p) < 0);
+    assert(msched_parse("other:20", &p) < 0);
+    assert(msched_parse("fifo@3-1", &p) < 0);
+    assert(msched_parse("rr:5@1,", &p) < 0);
+    assert(msched_parse("rr:5x", &p) < 0);
+
+    assert(msched_current(&p) == 0);
+}
+
+static void test_mhud() {
+    enum { W = 10, H = 7 };
+    uint32_t px[W * H];
+    int x, y;
+
+    /* "1" at scale 1, offset by one pixel */
+    static const char *one[] = {
+        ".X.",
+        "XX.",
+        ".X.",
+        ".X.",
+        "XXX",
+    };
+    memset(px, 0, sizeof(px));
+    mhud_draw_text(px, W, W, H, 1, 1, 1, "1", 7);
+    for (y = 0; y < H; ++y) {
+        for (x = 0; x < W; ++x) {
+            int set = y >= 1 && y < 6 && x >= 1 && x < 4 &&
+                      one[y - 1][x - 1] == 'X';
+            assert(px[y * W + x] == (set ? 7u : 0u));
+        }
+    }
+
+    /* lower case maps to the capitals, unknown characters stay blank */
+    uint32_t a[W * H], b[W * H];
+    memset(a, 0, sizeof(a));
+    memset(b, 0, sizeof(b));
+    mhud_draw_text(a, W, W, H, 0, 0, 1, "a", 1);
+    mhud_draw_text(b, W, W, H, 0, 0, 1, "A", 1);
+    assert(memcmp(a, b, sizeof(a)) == 0);
+    memset(a, 0, sizeof(a));
+    mhud_draw_text(a, W, W, H, 0, 0, 1, "~", 1);
+    for (x = 0; x < W * H; ++x) {
+        assert(a[x] == 0);
+    }
+
+    /* clipped at the edges, scaled glyphs are still drawn */
+    memset(px, 0, sizeof(px));
+    mhud_draw_text(px, W, W, H, 8, 4, 2, "8", 1);
+    assert(px[4 * W + 8] == 1 && px[6 * W + 9] == 1);
+}
+
+static void test_mheatmap() {
+    struct MHeatmap map;
+    char prefix[] = "/tmp/mheatmap-XXXXXX", path[64], line[64];
+    FILE *f;
+
+    /* 100x40 = 4x2 tiles, the last ones partial */
+    assert(mheatmap_init(&map, 100, 40) == 0);
+    assert(map.mCols == 4 && map.mRows == 2);
+
+    /* a 2x2 tile block and a single pixel in the last tile */
+    MRect frame1[] = {{16, 16, 32, 20}, {99, 39, 1, 1}};
+    mheatmap_add(&map, frame1, 2);
+    MRect frame2[] = {{0, 0, 10, 10}};
+    mheatmap_add(&map, frame2, 1);
+    mheatmap_add(&map, frame2, 0);
+
+    assert(map.mFrames == 2 && map.mRects == 3);
+    assert(map.mCounts[0] == 2 && map.mCounts[1] == 1 && map.mCounts[2] == 0);
+    assert(map.mCounts[4] == 1 && map.mCounts[5] == 1 && map.mCounts[7] == 1);
+    /* areas 640, 1 and 100 */
+    assert(map.mSizes[9] == 1 && map.mSizes[0] == 1 && map.mSizes[6] == 1);
+
+    int fd = mkstemp(prefix);
+    assert(fd >= 0);
+    close(fd);
+    unlink(prefix);
+    assert(mheatmap_write(&map, prefix) == 0);
+
+    snprintf(path, sizeof(path), "%s.pgm", prefix);
+    f = fopen(path, "rb");
+    assert(f != NULL);
+    assert(fgets(line, sizeof(line), f) && strcmp(line, "P5\n") == 0);
+    assert(fgets(line, sizeof(line), f) && line[0] == '#');
+    assert(fgets(line, sizeof(line), f) && strcmp(line, "4 2\n") == 0);
+    assert(fgets(line, sizeof(line), f) && strcmp(line, "255\n") == 0);
+    assert(fgetc(f) == 255 && fgetc(f) == 127);
+    fclose(f);
+    unlink(path);
+
+    snprintf(path, sizeof(path), "%s.csv", prefix);
+    f = fopen(path, "r");
+    assert(f != NULL);
+    assert(fgets(line, sizeof(line), f) && strcmp(line, "min_area,max_area,rects\n") == 0);
+    assert(fgets(line, sizeof(line), f) && strcmp(line, "1,1,1\n") == 0);
+    fclose(f);
+    unlink(path);
+
+    mheatmap_destroy(&map);
+}
+
+static void test_mbudget() {
+    struct MBudget budget;
+    MRect now[MBUDGET_MAX_RECTS];
+    uint64_t bytes, ns;
+    int i;
+
+    assert(mbudget_parse("8ms", &bytes, &ns) == 0 && bytes == 0 && ns == 8000000);
+    assert(mbudget_parse("4M", &bytes, &ns) == 0 && bytes == 4 << 20 && ns == 0);
+    assert(mbudget_parse("512K", &bytes, &ns) == 0 && bytes == 512 << 10);
+    assert(mbudget_parse("100", &bytes, &ns) == 0 && bytes == 100);
+    assert(mbudget_parse("8s", &bytes, &ns) < 0);
+    assert(mbudget_parse("", &bytes, &ns) < 0);
+
+    /* no budget: everything goes */
+    MRect screen[] = {{0, 0, 100, 100}};
+    mbudget_init(&budget, 0, 0);
+    assert(mbudget_allowance(&budget) == 0);
+    assert(mbudget_split(&budget, screen, 1, 50, 50, now) == 1);
+    assert(budget.mNumPending == 0);
+
+    /* 20 rows a frame, starting around the pointer */
+    mbudget_init(&budget, 100 * 4 * 20, 0);
+    assert(mbudget_split(&budget, screen, 1, 50, 50, now) == 1);
+    assert(now[0].y == 40 && now[0].height == 20 && now[0].width == 100);
+    assert(budget.mNumPending == 2 && budget.mDeferred == 1);
+
+    /* then growing out from it, nearest first */
+    assert(mbudget_split(&budget, NULL, 0, 50, 50, now) == 1);
+    assert(now[0].y == 60 && now[0].height == 20);
+    assert(budget.mNumPending == 2);
+    uint64_t area = 0;
+    for (i = 0; i < budget.mNumPending; ++i)
+    {
+        area += budget.mPending[i].width * budget.mPending[i].height;
+    }
+    assert(area == 100 * 60);
+
+    /* new damage over carried over rectangles replaces them */
+    assert(mbudget_split(&budget, screen, 1, 50, 50, now) == 1);
+    assert(now[0].y == 40 && budget.mNumPending == 2);
+    mbudget_drop(&budget, &screen[0]);
+    assert(budget.mNumPending == 0);
+
+    /* carried over rectangles lose what new damage overlaps */
+    MRect corner[] = {{0, 0, 60, 60}};
+    mbudget_init(&budget, 100 * 4 * 20, 0);
+    mbudget_split(&budget, screen, 1, 50, 50, now);
+    assert(mbudget_split(&budget, corner, 1, 1000, 1000, now) == 1);
+    area = (uint64_t)now[0].width * now[0].height;
+    for (i = 0; i < budget.mNumPending; ++i)
+    {
+        area += budget.mPending[i].width * budget.mPending[i].height;
+    }
+    assert(area == 60 * 60 + 40 * 40 + 100 * 40);
+    mbudget_drop(&budget, &screen[0]);
+
+    /* away from the pointer in scan order, whole rectangles when they fit */
+    MRect apart[] = {{0, 50, 10, 10}, {20, 0, 10, 10}, {0, 0, 10, 10}};
+    assert(mbudget_split(&budget, apart, 3, 1000, 1000, now) == 3);
+    assert(now[0].x == 0 && now[0].y == 0);
+    assert(now[1].x == 20 && now[1].y == 0);
+    assert(now[2].y == 50);
+
+    /* a tiny budget still makes progress */
+    mbudget_init(&budget, 4, 0);
+    assert(mbudget_split(&budget, screen, 1, 1000, 1000, now) == 1);
+    assert(now[0].y == 0 && now[0].height == MBUDGET_MIN_ROWS);
+    assert(budget.mNumPending == 1);
+
+    /* a time budget waits for a large enough measurement */
+    mbudget_init(&budget, 0, 1000000);
+    mbudget_feedback(&budget, 4096, 1000);
+    assert(mbudget_allowance(&budget) == 0);
+    mbudget_feedback(&budget, 1000000, 1000000);
+    assert(mbudget_allowance(&budget) == 1000000);
+}
+
+static void test_mgovernor() {
+    struct MGovernor gov;
+    struct MGovernorSample sample;
+    uint64_t ms = 1000000;
+    int i;
+
+    /* cool, idle and cheap frames stay at the ceiling */
+    struct MGovernorSample calm = {120 * ms, 1000 * ms, 60, 100, 50000};
+    mgovernor_init(&gov, 10, 60);
+    assert(mgovernor_update(&gov, &calm) == 60);
+    assert(gov.mReason == MGOVERNOR_STEADY);
+
+    /* heat steps down to the floor and stays blamed there */
+    struct MGovernorSample hot = calm;
+    hot.temp = 85000;
+    assert(mgovernor_update(&gov, &hot) == 45);
+    assert(gov.mReason == MGOVERNOR_THERMAL);
+    for (i = 0; i < 10; ++i) {
+        mgovernor_update(&gov, &hot);
+    }
+    assert(gov.mFps == 10 && gov.mReason == MGOVERNOR_THERMAL);
+
+    /* between the thresholds nothing moves */
+    struct MGovernorSample warm = calm;
+    warm.temp = 77000;
+    assert(mgovernor_update(&gov, &warm) == 10);
+    assert(gov.mReason == MGOVERNOR_THERMAL);
+
+    /* cooled down, creep back up */
+    assert(mgovernor_update(&gov, &calm) == 11);
+    assert(gov.mReason == MGOVERNOR_HEADROOM);
+
+    /* an overloaded system */
+    struct MGovernorSample busy = calm;
+    busy.load = 1500;
+    assert(mgovernor_update(&gov, &busy) == 10);
+    assert(gov.mReason == MGOVERNOR_LOAD);
+
+    /* 20ms of CPU per frame fit 25 of them in half a core */
+    struct MGovernorSample costly = {600 * ms, 1000 * ms, 30, 0, MGOVERNOR_TEMP_UNKNOWN};
+    mgovernor_init(&gov, 10, 60);
+    assert(mgovernor_update(&gov, &costly) == 25);
+    assert(gov.mReason == MGOVERNOR_CPU);
+    assert(mgovernor_update(&gov, &costly) == 25);
+    assert(gov.mReason == MGOVERNOR_CPU);
+    assert(strcmp(mgovernor_reason(gov.mReason), "cpu") == 0);
+
+    /* sampling reports deltas */
+    mgovernor_init(&gov, 10, 60);
+    assert(mgovernor_sample(&gov, 1000 * ms, 100, &sample) < 0);
+    assert(mgovernor_sample(&gov, 2000 * ms, 130, &sample) == 0);
+    assert(sample.period_ns == 1000 * ms && sample.frames == 30);
+}
+
 int main() {
     test_argb8888_get_alpha();
+    test_mpacer();
+    test_mrect();
+    test_mwaitbuffer();
+    test_mseqlock();
+    test_position_page();
+    test_mfanout();
+    test_mcodec();
+    test_mcopy();
+    test_msched();
+    test_mhud();
+    test_mheatmap();
+    test_mbudget();
+    test_mgovernor();
 
     printf("All tests passed.\n");
     return 0;